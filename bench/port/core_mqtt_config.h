@@ -0,0 +1,15 @@
+/*
+ * coreMQTT configuration of the host benchmark. Like the configuration of
+ * esp-aws-iot, it pulls in the ESP-IDF logging macros.
+ */
+#ifndef CORE_MQTT_CONFIG_H
+#define CORE_MQTT_CONFIG_H
+
+#include "esp_log.h"
+
+#define LogError(message)
+#define LogWarn(message)
+#define LogInfo(message)
+#define LogDebug(message)
+
+#endif /* CORE_MQTT_CONFIG_H */
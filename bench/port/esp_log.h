@@ -0,0 +1,26 @@
+/*
+ * Host port of the ESP-IDF logging macros. Errors go to stderr unless
+ * BENCH_PORT_LOG_ERRORS is 0, as for the stress test, whose writers run the
+ * filter arena full on purpose. The rest is dropped so that it does not
+ * disturb the measurements.
+ */
+#ifndef BENCH_PORT_ESP_LOG_H
+#define BENCH_PORT_ESP_LOG_H
+
+#include <stdio.h>
+
+#ifndef BENCH_PORT_LOG_ERRORS
+#define BENCH_PORT_LOG_ERRORS    1
+#endif
+
+#if BENCH_PORT_LOG_ERRORS
+#define ESP_LOGE(tag, format, ...)    fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#else
+#define ESP_LOGE(tag, format, ...)    do { (void) (tag); } while (0)
+#endif
+#define ESP_LOGW(tag, format, ...)    do { (void) (tag); } while (0)
+#define ESP_LOGI(tag, format, ...)    do { (void) (tag); } while (0)
+#define ESP_LOGD(tag, format, ...)    do { (void) (tag); } while (0)
+#define ESP_LOGV(tag, format, ...)    do { (void) (tag); } while (0)
+
+#endif /* BENCH_PORT_ESP_LOG_H */
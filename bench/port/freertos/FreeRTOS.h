@@ -0,0 +1,34 @@
+/*
+ * Host port of the parts of FreeRTOS used by the subscription manager, so that
+ * it can be built and benchmarked natively. Not for use on a target.
+ */
+#ifndef BENCH_PORT_FREERTOS_H
+#define BENCH_PORT_FREERTOS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdTRUE           1
+#define pdFALSE          0
+#define pdPASS           pdTRUE
+#define pdFAIL           pdFALSE
+#define portMAX_DELAY    0xFFFFFFFFU
+
+#define configASSERT(x)    do { if (!(x)) { abort(); } } while (0)
+
+#define pvPortMalloc(xSize)    malloc(xSize)
+#define vPortFree(pv)          free(pv)
+
+/* Critical sections map to a mutex, which is enough for the one-time binding
+ * of the routing index they guard. */
+typedef pthread_mutex_t portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    PTHREAD_MUTEX_INITIALIZER
+#define taskENTER_CRITICAL(pxMux)       pthread_mutex_lock(pxMux)
+#define taskEXIT_CRITICAL(pxMux)        pthread_mutex_unlock(pxMux)
+
+#endif /* BENCH_PORT_FREERTOS_H */
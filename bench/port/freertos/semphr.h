@@ -0,0 +1,31 @@
+/*
+ * Host port of the FreeRTOS mutexes used by the subscription manager.
+ */
+#ifndef BENCH_PORT_SEMPHR_H
+#define BENCH_PORT_SEMPHR_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+    pthread_mutex_t xMutex;
+} StaticSemaphore_t;
+
+typedef pthread_mutex_t *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *pxMutexBuffer) {
+    pthread_mutex_init(&(pxMutexBuffer->xMutex), NULL);
+    return &(pxMutexBuffer->xMutex);
+}
+
+/* Only blocking takes are used, so the block time is ignored. */
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore,
+                                        TickType_t xBlockTime) {
+    (void) xBlockTime;
+    return (pthread_mutex_lock(xSemaphore) == 0) ? pdTRUE : pdFALSE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore) {
+    return (pthread_mutex_unlock(xSemaphore) == 0) ? pdTRUE : pdFALSE;
+}
+
+#endif /* BENCH_PORT_SEMPHR_H */
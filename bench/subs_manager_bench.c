@@ -0,0 +1,544 @@
+/*
+ * Host benchmark of the subscription manager.
+ *
+ * Sweeps the number of subscriptions, the share of wildcard filters, the depth
+ * of the topics and the share of publishes matching a subscription, and reports
+ * the cost of addSubscription(), handleIncomingPublishes() and
+ * removeSubscription() in ns and time-stamp counter ticks per operation. The
+ * results can be saved and compared against a saved baseline.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "freertos/FreeRTOS.h"
+
+#include "core_mqtt_agent_subs_manager.h"
+
+/**
+ * @brief Operations timed together; each sample is their average.
+ */
+#define BENCH_BATCH_SIZE            16U
+
+/**
+ * @brief Fewest add and remove operations timed per configuration, reached by
+ * repeating the rounds of small configurations.
+ */
+#define BENCH_MIN_OPERATIONS        8192U
+
+/**
+ * @brief Number of distinct topics published during a configuration.
+ */
+#define BENCH_TOPIC_POOL_SIZE       1024U
+
+/**
+ * @brief Longest topic filter or topic generated.
+ */
+#define BENCH_MAX_STRING_LENGTH     128U
+
+#define BENCH_MAX_VALUES            16U
+#define BENCH_MAX_RESULTS           1024U
+#define BENCH_KEY_LENGTH            96U
+
+typedef struct benchSweep {
+    uint32_t ulSubscriptions[BENCH_MAX_VALUES];
+    size_t xNumSubscriptions;
+    double dWildcardRatios[BENCH_MAX_VALUES];
+    size_t xNumWildcardRatios;
+    uint32_t ulDepths[BENCH_MAX_VALUES];
+    size_t xNumDepths;
+    double dHitRates[BENCH_MAX_VALUES];
+    size_t xNumHitRates;
+    uint32_t ulDispatches;
+} BenchSweep_t;
+
+typedef struct benchResult {
+    char cKey[BENCH_KEY_LENGTH];
+    double dMeanNs;
+    double dP50Ns;
+    double dP90Ns;
+    double dP99Ns;
+    double dP50Ticks;
+} BenchResult_t;
+
+typedef struct benchSamples {
+    double *pdNs;
+    double *pdTicks;
+    size_t xCount;
+    size_t xCapacity;
+} BenchSamples_t;
+
+/* Bound to the routing index, as the subscription list of the MQTT agent. */
+static SubscriptionElement_t xSubscriptionList[SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS];
+
+static char (*pcFilters)[BENCH_MAX_STRING_LENGTH];
+static uint16_t *pusFilterLengths;
+static char cTopics[BENCH_TOPIC_POOL_SIZE][BENCH_MAX_STRING_LENGTH];
+static uint16_t usTopicLengths[BENCH_TOPIC_POOL_SIZE];
+static volatile uint64_t ullDeliveries;
+
+static BenchResult_t xResults[BENCH_MAX_RESULTS];
+static size_t xNumResults;
+
+static uint64_t ullRandomState = 0x9E3779B97F4A7C15ULL;
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvRandom(void) {
+    /* xorshift64*, so that runs are reproducible on every host. */
+    ullRandomState ^= ullRandomState >> 12;
+    ullRandomState ^= ullRandomState << 25;
+    ullRandomState ^= ullRandomState >> 27;
+
+    return (uint32_t) ((ullRandomState * 2685821657736338717ULL) >> 32);
+}
+
+static double prvRandomUnit(void) {
+    return (double) prvRandom() / 4294967296.0;
+}
+
+static uint64_t prvNowNs(void) {
+    struct timespec xNow;
+
+    clock_gettime(CLOCK_MONOTONIC, &xNow);
+
+    return ((uint64_t) xNow.tv_sec * 1000000000ULL) + (uint64_t) xNow.tv_nsec;
+}
+
+static uint64_t prvNowTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ullTicks;
+
+    __asm__ volatile ("mrs %0, cntvct_el0" : "=r" (ullTicks));
+
+    return ullTicks;
+#else
+    return 0U;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCountDelivery(void *pvContext,
+                             MQTTPublishInfo_t *pxPublishInfo) {
+    (void) pvContext;
+    (void) pxPublishInfo;
+    ullDeliveries++;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvAddSample(BenchSamples_t *pxSamples,
+                         uint64_t ullNs,
+                         uint64_t ullTicks,
+                         uint32_t ulOperations) {
+    if (pxSamples->xCount == pxSamples->xCapacity) {
+        pxSamples->xCapacity = (pxSamples->xCapacity > 0U) ? (pxSamples->xCapacity * 2U) : 1024U;
+        pxSamples->pdNs = realloc(pxSamples->pdNs, pxSamples->xCapacity * sizeof(double));
+        pxSamples->pdTicks = realloc(pxSamples->pdTicks, pxSamples->xCapacity * sizeof(double));
+        configASSERT((pxSamples->pdNs != NULL) && (pxSamples->pdTicks != NULL));
+    }
+
+    pxSamples->pdNs[pxSamples->xCount] = (double) ullNs / ulOperations;
+    pxSamples->pdTicks[pxSamples->xCount] = (double) ullTicks / ulOperations;
+    pxSamples->xCount++;
+}
+
+static int prvCompareDouble(const void *pvA,
+                            const void *pvB) {
+    double dA = *(const double *) pvA, dB = *(const double *) pvB;
+
+    return (dA > dB) - (dA < dB);
+}
+
+static double prvPercentile(const double *pdSorted,
+                            size_t xCount,
+                            double dPercentile) {
+    size_t xRank = (size_t) (dPercentile * (double) (xCount - 1U) + 0.5);
+
+    return pdSorted[xRank];
+}
+
+static void prvRecordResult(const char *pcConfigKey,
+                            const char *pcOperation,
+                            BenchSamples_t *pxSamples) {
+    BenchResult_t *pxResult;
+    double dSum = 0.0;
+    size_t xIndex;
+
+    if ((pxSamples->xCount > 0U) && (xNumResults < BENCH_MAX_RESULTS)) {
+        pxResult = &(xResults[xNumResults++]);
+
+        for (xIndex = 0U; xIndex < pxSamples->xCount; xIndex++) {
+            dSum += pxSamples->pdNs[xIndex];
+        }
+
+        qsort(pxSamples->pdNs, pxSamples->xCount, sizeof(double), prvCompareDouble);
+        qsort(pxSamples->pdTicks, pxSamples->xCount, sizeof(double), prvCompareDouble);
+
+        snprintf(pxResult->cKey, sizeof(pxResult->cKey), "%s/%s", pcConfigKey, pcOperation);
+        pxResult->dMeanNs = dSum / (double) pxSamples->xCount;
+        pxResult->dP50Ns = prvPercentile(pxSamples->pdNs, pxSamples->xCount, 0.50);
+        pxResult->dP90Ns = prvPercentile(pxSamples->pdNs, pxSamples->xCount, 0.90);
+        pxResult->dP99Ns = prvPercentile(pxSamples->pdNs, pxSamples->xCount, 0.99);
+        pxResult->dP50Ticks = prvPercentile(pxSamples->pdTicks, pxSamples->xCount, 0.50);
+
+        printf("%-52s mean %9.1f ns  p50 %9.1f ns  p90 %9.1f ns  p99 %9.1f ns  p50 %9.1f ticks\n",
+               pxResult->cKey, pxResult->dMeanNs, pxResult->dP50Ns, pxResult->dP90Ns,
+               pxResult->dP99Ns, pxResult->dP50Ticks);
+    }
+
+    pxSamples->xCount = 0U;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvGenerateFilters(uint32_t ulSubscriptions,
+                               double dWildcardRatio,
+                               uint32_t ulDepth) {
+    uint32_t ulIndex, ulLevel, ulWildcardLevel;
+    int lLength;
+    bool xWildcard, xMultiLevel;
+
+    for (ulIndex = 0U; ulIndex < ulSubscriptions; ulIndex++) {
+        /* The first level is never a wildcard, so that topics starting with
+         * "miss" match nothing. The last level is unique to the filter. */
+        xWildcard = (prvRandomUnit() < dWildcardRatio);
+        xMultiLevel = xWildcard && ((prvRandom() % 4U) == 0U);
+        ulWildcardLevel = xWildcard ? (1U + (prvRandom() % (ulDepth - 2U))) : ulDepth;
+        lLength = 0;
+
+        for (ulLevel = 0U; ulLevel + 1U < ulDepth; ulLevel++) {
+            if (ulLevel == ulWildcardLevel) {
+                lLength += snprintf(&(pcFilters[ulIndex][lLength]), BENCH_MAX_STRING_LENGTH - (size_t) lLength, "+/");
+            } else {
+                lLength += snprintf(&(pcFilters[ulIndex][lLength]), BENCH_MAX_STRING_LENGTH - (size_t) lLength,
+                                    "l%" PRIu32 "/", prvRandom() % 2U);
+            }
+        }
+
+        lLength += snprintf(&(pcFilters[ulIndex][lLength]), BENCH_MAX_STRING_LENGTH - (size_t) lLength,
+                            "s%" PRIu32 "%s", ulIndex, xMultiLevel ? "/#" : "");
+        pusFilterLengths[ulIndex] = (uint16_t) lLength;
+    }
+}
+
+static void prvGenerateTopics(uint32_t ulSubscriptions,
+                              double dHitRate,
+                              uint32_t ulDepth) {
+    const char *pcFilter;
+    uint32_t ulIndex, ulLevel;
+    int lLength;
+
+    for (ulIndex = 0U; ulIndex < BENCH_TOPIC_POOL_SIZE; ulIndex++) {
+        lLength = 0;
+
+        if (prvRandomUnit() < dHitRate) {
+            /* A topic matching a random filter, wildcards filled in. */
+            for (pcFilter = pcFilters[prvRandom() % ulSubscriptions]; *pcFilter != '\0'; pcFilter++) {
+                if (*pcFilter == '+') {
+                    lLength += snprintf(&(cTopics[ulIndex][lLength]), BENCH_MAX_STRING_LENGTH - (size_t) lLength,
+                                        "w%" PRIu32, prvRandom() % 2U);
+                } else if (*pcFilter == '#') {
+                    lLength += snprintf(&(cTopics[ulIndex][lLength]), BENCH_MAX_STRING_LENGTH - (size_t) lLength,
+                                        "tail");
+                } else {
+                    cTopics[ulIndex][lLength++] = *pcFilter;
+                }
+            }
+        } else {
+            lLength = snprintf(cTopics[ulIndex], BENCH_MAX_STRING_LENGTH, "miss");
+
+            for (ulLevel = 1U; ulLevel < ulDepth; ulLevel++) {
+                lLength += snprintf(&(cTopics[ulIndex][lLength]), BENCH_MAX_STRING_LENGTH - (size_t) lLength,
+                                    "/l%" PRIu32, prvRandom() % 2U);
+            }
+        }
+
+        cTopics[ulIndex][lLength] = '\0';
+        usTopicLengths[ulIndex] = (uint16_t) lLength;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRunConfiguration(uint32_t ulSubscriptions,
+                                double dWildcardRatio,
+                                uint32_t ulDepth,
+                                double dHitRate,
+                                uint32_t ulDispatches,
+                                BenchSamples_t *pxSamples) {
+    char cConfigKey[BENCH_KEY_LENGTH];
+    MQTTPublishInfo_t xPublishInfo = {0};
+    uint64_t ullStartNs, ullStartTicks;
+    uint32_t ulRound, ulRounds, ulIndex, ulBatchEnd;
+    BenchSamples_t xRemoveSamples = {0};
+
+    snprintf(cConfigKey, sizeof(cConfigKey), "subs=%" PRIu32 "/wc=%.2f/depth=%" PRIu32 "/hit=%.2f",
+             ulSubscriptions, dWildcardRatio, ulDepth, dHitRate);
+
+    prvGenerateFilters(ulSubscriptions, dWildcardRatio, ulDepth);
+    prvGenerateTopics(ulSubscriptions, dHitRate, ulDepth);
+
+    ulRounds = (ulSubscriptions < BENCH_MIN_OPERATIONS) ? (BENCH_MIN_OPERATIONS / ulSubscriptions) : 1U;
+
+    for (ulRound = 0U; ulRound < ulRounds; ulRound++) {
+        for (ulIndex = 0U; ulIndex < ulSubscriptions; ulIndex = ulBatchEnd) {
+            ulBatchEnd = (ulIndex + BENCH_BATCH_SIZE < ulSubscriptions) ? (ulIndex + BENCH_BATCH_SIZE) : ulSubscriptions;
+            ullStartNs = prvNowNs();
+            ullStartTicks = prvNowTicks();
+
+            for (uint32_t ulOp = ulIndex; ulOp < ulBatchEnd; ulOp++) {
+                configASSERT(addSubscription(xSubscriptionList, pcFilters[ulOp], pusFilterLengths[ulOp],
+                                             prvCountDelivery, (void *) (uintptr_t) ulOp));
+            }
+
+            prvAddSample(pxSamples, prvNowNs() - ullStartNs, prvNowTicks() - ullStartTicks, ulBatchEnd - ulIndex);
+        }
+
+        /* Dispatch once every subscription is in, in the last round only. */
+        if (ulRound + 1U == ulRounds) {
+            prvRecordResult(cConfigKey, "add", pxSamples);
+
+            for (ulIndex = 0U; ulIndex < ulDispatches; ulIndex += BENCH_BATCH_SIZE) {
+                ullStartNs = prvNowNs();
+                ullStartTicks = prvNowTicks();
+
+                for (uint32_t ulOp = ulIndex; ulOp < ulIndex + BENCH_BATCH_SIZE; ulOp++) {
+                    xPublishInfo.pTopicName = cTopics[ulOp % BENCH_TOPIC_POOL_SIZE];
+                    xPublishInfo.topicNameLength = usTopicLengths[ulOp % BENCH_TOPIC_POOL_SIZE];
+                    (void) handleIncomingPublishes(xSubscriptionList, &xPublishInfo);
+                }
+
+                prvAddSample(pxSamples, prvNowNs() - ullStartNs, prvNowTicks() - ullStartTicks, BENCH_BATCH_SIZE);
+            }
+
+            prvRecordResult(cConfigKey, "dispatch", pxSamples);
+        }
+
+        for (ulIndex = 0U; ulIndex < ulSubscriptions; ulIndex = ulBatchEnd) {
+            ulBatchEnd = (ulIndex + BENCH_BATCH_SIZE < ulSubscriptions) ? (ulIndex + BENCH_BATCH_SIZE) : ulSubscriptions;
+            ullStartNs = prvNowNs();
+            ullStartTicks = prvNowTicks();
+
+            for (uint32_t ulOp = ulIndex; ulOp < ulBatchEnd; ulOp++) {
+                removeSubscription(xSubscriptionList, pcFilters[ulOp], pusFilterLengths[ulOp]);
+            }
+
+            prvAddSample(&xRemoveSamples, prvNowNs() - ullStartNs, prvNowTicks() - ullStartTicks, ulBatchEnd - ulIndex);
+        }
+    }
+
+    prvRecordResult(cConfigKey, "remove", &xRemoveSamples);
+    free(xRemoveSamples.pdNs);
+    free(xRemoveSamples.pdTicks);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvSaveResults(const char *pcPath) {
+    FILE *pxFile = fopen(pcPath, "w");
+    size_t xIndex;
+    bool xReturnStatus = (pxFile != NULL);
+
+    if (xReturnStatus) {
+        for (xIndex = 0U; xIndex < xNumResults; xIndex++) {
+            fprintf(pxFile, "%s %.2f %.2f %.2f %.2f %.2f\n", xResults[xIndex].cKey, xResults[xIndex].dMeanNs,
+                    xResults[xIndex].dP50Ns, xResults[xIndex].dP90Ns, xResults[xIndex].dP99Ns,
+                    xResults[xIndex].dP50Ticks);
+        }
+
+        fclose(pxFile);
+    } else {
+        fprintf(stderr, "Cannot write %s.\n", pcPath);
+    }
+
+    return xReturnStatus;
+}
+
+static bool prvCompareResults(const char *pcPath,
+                              double dThresholdPercent) {
+    FILE *pxFile = fopen(pcPath, "r");
+    BenchResult_t xBaseline;
+    size_t xIndex, xCompared = 0U, xRegressions = 0U;
+    double dDelta;
+
+    if (pxFile == NULL) {
+        fprintf(stderr, "Cannot read %s.\n", pcPath);
+        xRegressions = 1U;
+    } else {
+        printf("\n%-52s %12s %12s %9s\n", "p50 against baseline", "baseline ns", "current ns", "delta");
+
+        while (fscanf(pxFile, "%95s %lf %lf %lf %lf %lf", xBaseline.cKey, &(xBaseline.dMeanNs), &(xBaseline.dP50Ns),
+                      &(xBaseline.dP90Ns), &(xBaseline.dP99Ns), &(xBaseline.dP50Ticks)) == 6) {
+            for (xIndex = 0U; xIndex < xNumResults; xIndex++) {
+                if (strcmp(xResults[xIndex].cKey, xBaseline.cKey) == 0) {
+                    dDelta = 100.0 * (xResults[xIndex].dP50Ns - xBaseline.dP50Ns) / xBaseline.dP50Ns;
+                    printf("%-52s %12.1f %12.1f %+8.1f%%%s\n", xBaseline.cKey, xBaseline.dP50Ns,
+                           xResults[xIndex].dP50Ns, dDelta, (dDelta > dThresholdPercent) ? "  REGRESSION" : "");
+                    xRegressions += (dDelta > dThresholdPercent) ? 1U : 0U;
+                    xCompared++;
+                }
+            }
+        }
+
+        fclose(pxFile);
+        printf("%zu results compared, %zu above the %.1f%% threshold.\n", xCompared, xRegressions, dThresholdPercent);
+    }
+
+    return (xRegressions == 0U);
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t prvParseList(const char *pcList,
+                           double *pdValues) {
+    char *pcEnd = NULL;
+    double dValue;
+    size_t xCount = 0U;
+
+    while ((*pcList != '\0') && (xCount < BENCH_MAX_VALUES) && (pcEnd != pcList)) {
+        dValue = strtod(pcList, &pcEnd);
+
+        if (pcEnd != pcList) {
+            pdValues[xCount++] = dValue;
+            pcList = (*pcEnd == ',') ? (pcEnd + 1) : pcEnd;
+        }
+    }
+
+    return xCount;
+}
+
+static void prvUsage(const char *pcProgram) {
+    fprintf(stderr,
+            "usage: %s [--subs N,..] [--wildcard R,..] [--depth D,..] [--hit R,..] [--dispatches N]\n"
+            "          [--quick] [--save FILE] [--compare FILE] [--threshold PERCENT]\n",
+            pcProgram);
+}
+
+int main(int argc,
+         char **argv) {
+    BenchSweep_t xSweep = {
+        .ulSubscriptions = { 10U, 100U, 1000U, 10000U },
+        .xNumSubscriptions = 4U,
+        .dWildcardRatios = { 0.0, 0.25, 1.0 },
+        .xNumWildcardRatios = 3U,
+        .ulDepths = { 3U, 8U },
+        .xNumDepths = 2U,
+        .dHitRates = { 0.1, 0.9 },
+        .xNumHitRates = 2U,
+        .ulDispatches = 65536U,
+    };
+    double dValues[BENCH_MAX_VALUES], dThresholdPercent = 10.0;
+    const char *pcSavePath = NULL, *pcComparePath = NULL;
+    BenchSamples_t xSamples = {0};
+    size_t xSubs, xWildcard, xDepth, xHit, xIndex;
+    uint32_t ulMaxSubscriptions = 0U;
+    int lArg;
+    bool xReturnStatus = true;
+
+    for (lArg = 1; xReturnStatus && (lArg < argc); lArg++) {
+        bool xHasValue = (lArg + 1 < argc);
+
+        if (strcmp(argv[lArg], "--quick") == 0) {
+            xSweep.ulSubscriptions[0] = 10U;
+            xSweep.ulSubscriptions[1] = 1000U;
+            xSweep.xNumSubscriptions = 2U;
+            xSweep.dWildcardRatios[0] = 0.25;
+            xSweep.xNumWildcardRatios = 1U;
+            xSweep.ulDepths[0] = 4U;
+            xSweep.xNumDepths = 1U;
+            xSweep.dHitRates[0] = 0.5;
+            xSweep.xNumHitRates = 1U;
+            xSweep.ulDispatches = 4096U;
+        } else if ((strcmp(argv[lArg], "--subs") == 0) && xHasValue) {
+            xSweep.xNumSubscriptions = prvParseList(argv[++lArg], dValues);
+
+            for (xIndex = 0U; xIndex < xSweep.xNumSubscriptions; xIndex++) {
+                xSweep.ulSubscriptions[xIndex] = (uint32_t) dValues[xIndex];
+            }
+        } else if ((strcmp(argv[lArg], "--wildcard") == 0) && xHasValue) {
+            xSweep.xNumWildcardRatios = prvParseList(argv[++lArg], xSweep.dWildcardRatios);
+        } else if ((strcmp(argv[lArg], "--depth") == 0) && xHasValue) {
+            xSweep.xNumDepths = prvParseList(argv[++lArg], dValues);
+
+            for (xIndex = 0U; xIndex < xSweep.xNumDepths; xIndex++) {
+                xSweep.ulDepths[xIndex] = (uint32_t) dValues[xIndex];
+            }
+        } else if ((strcmp(argv[lArg], "--hit") == 0) && xHasValue) {
+            xSweep.xNumHitRates = prvParseList(argv[++lArg], xSweep.dHitRates);
+        } else if ((strcmp(argv[lArg], "--dispatches") == 0) && xHasValue) {
+            xSweep.ulDispatches = (uint32_t) strtoul(argv[++lArg], NULL, 10);
+        } else if ((strcmp(argv[lArg], "--save") == 0) && xHasValue) {
+            pcSavePath = argv[++lArg];
+        } else if ((strcmp(argv[lArg], "--compare") == 0) && xHasValue) {
+            pcComparePath = argv[++lArg];
+        } else if ((strcmp(argv[lArg], "--threshold") == 0) && xHasValue) {
+            dThresholdPercent = strtod(argv[++lArg], NULL);
+        } else {
+            xReturnStatus = false;
+        }
+    }
+
+    for (xIndex = 0U; xIndex < xSweep.xNumSubscriptions; xIndex++) {
+        ulMaxSubscriptions = (xSweep.ulSubscriptions[xIndex] > ulMaxSubscriptions) ? xSweep.ulSubscriptions[xIndex]
+                                                                                   : ulMaxSubscriptions;
+        xReturnStatus = xReturnStatus && (xSweep.ulSubscriptions[xIndex] > 0U);
+    }
+
+    /* Two prefix levels at least, since wildcards never take the first one. */
+    for (xIndex = 0U; xIndex < xSweep.xNumDepths; xIndex++) {
+        xReturnStatus = xReturnStatus && (xSweep.ulDepths[xIndex] >= 3U) && (xSweep.ulDepths[xIndex] <= 16U);
+    }
+
+    if (ulMaxSubscriptions > SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT) {
+        fprintf(stderr, "At most %u subscriptions in this build.\n", (unsigned int) SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT);
+        xReturnStatus = false;
+    }
+
+    if (xReturnStatus == false) {
+        prvUsage(argv[0]);
+    } else {
+        pcFilters = calloc(ulMaxSubscriptions, BENCH_MAX_STRING_LENGTH);
+        pusFilterLengths = calloc(ulMaxSubscriptions, sizeof(uint16_t));
+        configASSERT((pcFilters != NULL) && (pusFilterLengths != NULL));
+
+        for (xSubs = 0U; xSubs < xSweep.xNumSubscriptions; xSubs++) {
+            for (xWildcard = 0U; xWildcard < xSweep.xNumWildcardRatios; xWildcard++) {
+                for (xDepth = 0U; xDepth < xSweep.xNumDepths; xDepth++) {
+                    for (xHit = 0U; xHit < xSweep.xNumHitRates; xHit++) {
+                        prvRunConfiguration(xSweep.ulSubscriptions[xSubs], xSweep.dWildcardRatios[xWildcard],
+                                            xSweep.ulDepths[xDepth], xSweep.dHitRates[xHit], xSweep.ulDispatches,
+                                            &xSamples);
+                    }
+                }
+            }
+        }
+
+        printf("%" PRIu64 " callbacks invoked.\n", ullDeliveries);
+
+        if (pcSavePath != NULL) {
+            xReturnStatus = prvSaveResults(pcSavePath);
+        }
+
+        if (pcComparePath != NULL) {
+            xReturnStatus = prvCompareResults(pcComparePath, dThresholdPercent) && xReturnStatus;
+        }
+
+        free(pcFilters);
+        free(pusFilterLengths);
+        free(xSamples.pdNs);
+        free(xSamples.pdTicks);
+    }
+
+    return xReturnStatus ? EXIT_SUCCESS : EXIT_FAILURE;
+}
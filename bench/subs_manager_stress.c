@@ -0,0 +1,148 @@
+/*
+ * Host stress test of the subscription manager.
+ *
+ * Adds and removes subscriptions from several threads while publishes are
+ * dispatched, and checks every callback against its filter, so that a
+ * subscription reused or freed under a running dispatch shows up as an error.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "core_mqtt_agent_subs_manager.h"
+
+#define STRESS_WRITERS              4U
+#define STRESS_DISPATCHES           400000U
+#define STRESS_MAX_FILTER_LENGTH    16U
+
+static SubscriptionElement_t xSubscriptionList[SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS];
+
+typedef struct stressContext {
+    const char *pcFilter;
+    uint32_t ulMagic;
+} StressContext_t;
+
+#define STRESS_MAGIC    0xC0FFEEU
+
+static const char *pcStressFilters[] = {
+    "a/b", "a/+", "a/#", "+/b", "#", "a/b/c", "x/+/z", "x/#", "+/+", "a", "b/+/c", "+/+/+", "a/b/+", "$s/+"
+};
+#define STRESS_NUM_FILTERS    (sizeof(pcStressFilters) / sizeof(pcStressFilters[0]))
+
+static const char *pcStressTopics[] = { "a/b", "a/c", "a", "x/y/z", "a/b/c", "b/q/c", "q/b", "$s/a", "zz" };
+#define STRESS_NUM_TOPICS     (sizeof(pcStressTopics) / sizeof(pcStressTopics[0]))
+
+static StressContext_t xStressContexts[STRESS_WRITERS][STRESS_NUM_FILTERS];
+static StressContext_t xStableContext = { "q/+", STRESS_MAGIC };
+static bool xStressStop;
+static uint64_t ullStressCalls, ullStressErrors, ullStableCalls;
+
+static void prvStressCallback(void *pvContext,
+                              MQTTPublishInfo_t *pxPublishInfo) {
+    StressContext_t *pxContext = (StressContext_t *) pvContext;
+    bool isMatched = false;
+
+    ullStressCalls++;
+
+    /* A callback of a reused or half-written subscription shows up here. */
+    if (pxContext->ulMagic != STRESS_MAGIC) {
+        __atomic_fetch_add(&ullStressErrors, 1U, __ATOMIC_RELAXED);
+    } else {
+        MQTT_MatchTopic(pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength,
+                        pxContext->pcFilter, (uint16_t) strlen(pxContext->pcFilter), &isMatched);
+        __atomic_fetch_add(&ullStressErrors, isMatched ? 0U : 1U, __ATOMIC_RELAXED);
+        ullStableCalls += (pxContext == &xStableContext) ? 1U : 0U;
+    }
+}
+
+static void *prvStressWriter(void *pvWriter) {
+    uint32_t ulWriter = (uint32_t) (uintptr_t) pvWriter, ulFilter, ulSlot;
+    unsigned int uSeed = (ulWriter * 7919U) + 1U;
+    char cFilter[STRESS_MAX_FILTER_LENGTH];
+    bool xAdded[STRESS_NUM_FILTERS] = { false };
+    SubscriptionRequest_t xRequest = {0};
+    SubscriptionElement_t xSubscription;
+    SubscriptionStats_t xStats;
+
+    while (__atomic_load_n(&xStressStop, __ATOMIC_RELAXED) == false) {
+        ulFilter = (uint32_t) rand_r(&uSeed) % STRESS_NUM_FILTERS;
+        xRequest.pcTopicFilterString = pcStressFilters[ulFilter];
+        xRequest.usTopicFilterLength = (uint16_t) strlen(pcStressFilters[ulFilter]);
+        xRequest.pxIncomingPublishCallback = prvStressCallback;
+        xRequest.pvIncomingPublishCallbackContext = &(xStressContexts[ulWriter][ulFilter]);
+
+        /* Each writer toggles its own subscriptions, the others sharing their
+         * filters, so that none is added twice. */
+        if (xAdded[ulFilter]) {
+            xAdded[ulFilter] = (removeSubscriptions(xSubscriptionList, &xRequest, 1U, NULL) == false);
+        } else {
+            /* Clobbered once added, which only works with the filter arena. */
+            strcpy(cFilter, pcStressFilters[ulFilter]);
+            xRequest.pcTopicFilterString = (SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE > 0U) ? cFilter
+                                                                                          : pcStressFilters[ulFilter];
+            xAdded[ulFilter] = addSubscriptions(xSubscriptionList, &xRequest, 1U);
+            memset(cFilter, 0x5A, sizeof(cFilter));
+        }
+
+        if ((rand_r(&uSeed) % 64) == 0) {
+            for (ulSlot = 0U; getSubscription(xSubscriptionList, &ulSlot, &xSubscription);) {
+                __atomic_fetch_add(&ullStressErrors, (xSubscription.usFilterStringLength == 0U) ? 1U : 0U,
+                                   __ATOMIC_RELAXED);
+            }
+
+            getSubscriptionStats(xSubscriptionList, &xStats);
+        }
+    }
+
+    return NULL;
+}
+
+static bool prvRunStress(void) {
+    pthread_t xWriters[STRESS_WRITERS];
+    MQTTPublishInfo_t xPublishInfo = {0};
+    uint64_t ullStableExpected = 0U;
+    uint32_t ulWriter, ulFilter, ulDispatch;
+
+    for (ulWriter = 0U; ulWriter < STRESS_WRITERS; ulWriter++) {
+        for (ulFilter = 0U; ulFilter < STRESS_NUM_FILTERS; ulFilter++) {
+            xStressContexts[ulWriter][ulFilter].pcFilter = pcStressFilters[ulFilter];
+            xStressContexts[ulWriter][ulFilter].ulMagic = STRESS_MAGIC;
+        }
+    }
+
+    /* A subscription none of the writers touches must never be missed. */
+    configASSERT(addSubscription(xSubscriptionList, xStableContext.pcFilter, 3U, prvStressCallback, &xStableContext));
+
+    for (ulWriter = 0U; ulWriter < STRESS_WRITERS; ulWriter++) {
+        pthread_create(&(xWriters[ulWriter]), NULL, prvStressWriter, (void *) (uintptr_t) ulWriter);
+    }
+
+    for (ulDispatch = 0U; ulDispatch < STRESS_DISPATCHES; ulDispatch++) {
+        xPublishInfo.pTopicName = pcStressTopics[ulDispatch % STRESS_NUM_TOPICS];
+        xPublishInfo.topicNameLength = (uint16_t) strlen(xPublishInfo.pTopicName);
+        ullStableExpected += (strcmp(xPublishInfo.pTopicName, "q/b") == 0) ? 1U : 0U;
+        (void) handleIncomingPublishes(xSubscriptionList, &xPublishInfo);
+    }
+
+    __atomic_store_n(&xStressStop, true, __ATOMIC_RELAXED);
+
+    for (ulWriter = 0U; ulWriter < STRESS_WRITERS; ulWriter++) {
+        pthread_join(xWriters[ulWriter], NULL);
+    }
+
+    printf("stress: %" PRIu64 " callbacks, %" PRIu64 " errors, stable subscription %" PRIu64 "/%" PRIu64 "\n",
+           ullStressCalls, ullStressErrors, ullStableCalls, ullStableExpected);
+
+    return (ullStressErrors == 0U) && (ullStableCalls == ullStableExpected);
+}
+
+/*-----------------------------------------------------------*/
+
+int main(void) {
+    return prvRunStress() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
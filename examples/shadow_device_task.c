@@ -186,23 +186,6 @@ static TaskHandle_t xShadowDeviceTaskHandle;
  */
 static bool prvSubscribeToShadowUpdateTopics( void );
 
-/**
- * @brief Passed into MQTTAgent_Subscribe() as the callback to execute when the
- * broker ACKs the SUBSCRIBE message. Its implementation sends a notification
- * to the task that called MQTTAgent_Subscribe() to let the task know the
- * SUBSCRIBE operation completed. It also sets the xReturnStatus of the
- * structure passed in as the command's context to the value of the
- * xReturnStatus parameter - which enables the task to check the status of the
- * operation.
- *
- * See https://freertos.org/mqtt/mqtt-agent-demo.html#example_mqtt_api_call
- *
- * @param[in] pxCommandContext Context of the initial command.
- * @param[in] pxReturnInfo The result of the command.
- */
-static void prvSubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
-                                         MQTTAgentReturnInfo_t * pxReturnInfo );
-
 /**
  * @brief The callback to execute when there is an incoming publish on the
  * topic for delta updates. It verifies the document and sets the
@@ -260,60 +243,31 @@ void vShadowDeviceTask( void * pvParameters );
 static bool prvSubscribeToShadowUpdateTopics( void )
 {
     bool xReturnStatus = false;
-    MQTTStatus_t xStatus;
-    uint32_t ulNotificationValue;
-    MQTTAgentCommandInfo_t xCommandParams = { 0 };
-
-    /* These must persist until the command is processed. */
-    MQTTAgentSubscribeArgs_t xSubscribeArgs = { 0 };
-    MQTTSubscribeInfo_t xSubscribeInfo[ 3 ];
-    MQTTAgentCommandContext_t xApplicationDefinedContext = { 0 };
+    SubscriptionRequest_t xSubscriptions[ 3 ] = { 0 };
 
     /* Subscribe to shadow topic for responses for incoming delta updates. */
-    xSubscribeInfo[ 0 ].pTopicFilter = SHADOW_TOPIC_STRING_UPDATE_DELTA( MQTT_CLIENT_IDENTIFIER );
-    xSubscribeInfo[ 0 ].topicFilterLength = SHADOW_TOPIC_LENGTH_UPDATE_DELTA( MQTT_CLIENT_IDENTIFIER_LENGTH );
-    xSubscribeInfo[ 0 ].qos = MQTTQoS1;
+    xSubscriptions[ 0 ].pcTopicFilterString = SHADOW_TOPIC_STRING_UPDATE_DELTA( MQTT_CLIENT_IDENTIFIER );
+    xSubscriptions[ 0 ].usTopicFilterLength = SHADOW_TOPIC_LENGTH_UPDATE_DELTA( MQTT_CLIENT_IDENTIFIER_LENGTH );
+    xSubscriptions[ 0 ].xQoS = MQTTQoS1;
+    xSubscriptions[ 0 ].pxIncomingPublishCallback = prvIncomingPublishUpdateDeltaCallback;
     /* Subscribe to shadow topic for accepted responses for submitted updates. */
-    xSubscribeInfo[ 1 ].pTopicFilter = SHADOW_TOPIC_STRING_UPDATE_ACCEPTED( MQTT_CLIENT_IDENTIFIER );
-    xSubscribeInfo[ 1 ].topicFilterLength = SHADOW_TOPIC_LENGTH_UPDATE_ACCEPTED( MQTT_CLIENT_IDENTIFIER_LENGTH );
-    xSubscribeInfo[ 1 ].qos = MQTTQoS1;
+    xSubscriptions[ 1 ].pcTopicFilterString = SHADOW_TOPIC_STRING_UPDATE_ACCEPTED( MQTT_CLIENT_IDENTIFIER );
+    xSubscriptions[ 1 ].usTopicFilterLength = SHADOW_TOPIC_LENGTH_UPDATE_ACCEPTED( MQTT_CLIENT_IDENTIFIER_LENGTH );
+    xSubscriptions[ 1 ].xQoS = MQTTQoS1;
+    xSubscriptions[ 1 ].pxIncomingPublishCallback = prvIncomingPublishUpdateAcceptedCallback;
     /* Subscribe to shadow topic for rejected responses for submitted updates. */
-    xSubscribeInfo[ 2 ].pTopicFilter = SHADOW_TOPIC_STRING_UPDATE_REJECTED( MQTT_CLIENT_IDENTIFIER );
-    xSubscribeInfo[ 2 ].topicFilterLength = SHADOW_TOPIC_LENGTH_UPDATE_REJECTED( MQTT_CLIENT_IDENTIFIER_LENGTH );
-    xSubscribeInfo[ 2 ].qos = MQTTQoS1;
-
-    /* Complete the subscribe information. The topic string must persist for
-     * duration of subscription - although in this case it is a static const so
-     * will persist for the lifetime of the application. */
-    xSubscribeArgs.pSubscribeInfo = xSubscribeInfo;
-    xSubscribeArgs.numSubscriptions = 3;
-
-    /* Loop in case the queue used to communicate with the MQTT agent is full and
-     * attempts to post to it time out.  The queue will not become full if the
-     * priority of the MQTT agent task is higher than the priority of the task
-     * calling this function. */
-    xTaskNotifyStateClear( NULL );
-    xCommandParams.blockTimeMs = shadowexampleMAX_COMMAND_SEND_BLOCK_TIME_MS;
-    xCommandParams.cmdCompleteCallback = prvSubscribeCommandCallback;
-    xCommandParams.pCmdCompleteCallbackContext = &xApplicationDefinedContext;
+    xSubscriptions[ 2 ].pcTopicFilterString = SHADOW_TOPIC_STRING_UPDATE_REJECTED( MQTT_CLIENT_IDENTIFIER );
+    xSubscriptions[ 2 ].usTopicFilterLength = SHADOW_TOPIC_LENGTH_UPDATE_REJECTED( MQTT_CLIENT_IDENTIFIER_LENGTH );
+    xSubscriptions[ 2 ].xQoS = MQTTQoS1;
+    xSubscriptions[ 2 ].pxIncomingPublishCallback = prvIncomingPublishUpdateRejectedCallback;
+
     LogInfo( ( "Sending subscribe request to agent for shadow topics." ) );
 
-    do
-    {
-        /* If this fails, the agent's queue is full, so we retry until the agent
-         * has more space in the queue. */
-        xStatus = MQTTAgent_Subscribe( &xGlobalMqttAgentContext,
-                                       &( xSubscribeArgs ),
-                                       &xCommandParams );
-    } while( xStatus != MQTTSuccess );
-
-    /* Wait for acks from subscribe messages - this is optional.  If the
-     * returned value is zero then the wait timed out. */
-    ulNotificationValue = ulTaskNotifyTake( pdFALSE, pdMS_TO_TICKS( shadowexampleMS_TO_WAIT_FOR_NOTIFICATION ) );
-    configASSERT( ulNotificationValue != 0UL );
-
-    /* The callback sets the xReturnStatus member of the context. */
-    if( xApplicationDefinedContext.xReturnStatus != true )
+    /* The three topic filters go out in a single SUBSCRIBE, and their callbacks
+     * are registered together once the broker has granted all of them. The
+     * topic strings are static const so persist for the lifetime of the
+     * application. */
+    if( subscribeToTopics( xSubscriptions, 3 ) != true )
     {
         LogError( ( "Failed to subscribe to shadow update topics." ) );
     }
@@ -328,71 +282,6 @@ static bool prvSubscribeToShadowUpdateTopics( void )
 
 /*-----------------------------------------------------------*/
 
-static void prvSubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
-                                         MQTTAgentReturnInfo_t * pxReturnInfo )
-{
-    bool xSuccess = false;
-
-    /* Check if the subscribe operation is a success. */
-    if( pxReturnInfo->returnCode == MQTTSuccess )
-    {
-        /* Add subscriptions so that incoming publishes are routed to the application
-         * callback. */
-        xSuccess = addSubscription( ( SubscriptionElement_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
-        SHADOW_TOPIC_STRING_UPDATE_DELTA( MQTT_CLIENT_IDENTIFIER ),
-        SHADOW_TOPIC_LENGTH_UPDATE_DELTA( MQTT_CLIENT_IDENTIFIER_LENGTH ),
-                prvIncomingPublishUpdateDeltaCallback,
-                NULL );
-
-        if( xSuccess == false )
-        {
-            LogError( ( "Failed to register an incoming publish callback for topic %.*s.",
-                    SHADOW_TOPIC_LENGTH_UPDATE_DELTA( MQTT_CLIENT_IDENTIFIER_LENGTH ),
-                    SHADOW_TOPIC_STRING_UPDATE_DELTA( MQTT_CLIENT_IDENTIFIER ) ) );
-        }
-    }
-
-    if( xSuccess == true )
-    {
-        xSuccess = addSubscription( ( SubscriptionElement_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
-        SHADOW_TOPIC_STRING_UPDATE_ACCEPTED( MQTT_CLIENT_IDENTIFIER ),
-        SHADOW_TOPIC_LENGTH_UPDATE_ACCEPTED( MQTT_CLIENT_IDENTIFIER_LENGTH ),
-                prvIncomingPublishUpdateAcceptedCallback,
-                NULL );
-
-        if( xSuccess == false )
-        {
-            LogError( ( "Failed to register an incoming publish callback for topic %.*s.",
-                    SHADOW_TOPIC_LENGTH_UPDATE_ACCEPTED( MQTT_CLIENT_IDENTIFIER_LENGTH ),
-                    SHADOW_TOPIC_STRING_UPDATE_ACCEPTED( MQTT_CLIENT_IDENTIFIER ) ) );
-        }
-    }
-
-    if( xSuccess == true )
-    {
-        xSuccess = addSubscription( ( SubscriptionElement_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
-        SHADOW_TOPIC_STRING_UPDATE_REJECTED( MQTT_CLIENT_IDENTIFIER ),
-        SHADOW_TOPIC_LENGTH_UPDATE_REJECTED( MQTT_CLIENT_IDENTIFIER_LENGTH ),
-                prvIncomingPublishUpdateRejectedCallback,
-                NULL );
-
-        if( xSuccess == false )
-        {
-            LogError( ( "Failed to register an incoming publish callback for topic %.*s.",
-                    SHADOW_TOPIC_LENGTH_UPDATE_REJECTED( MQTT_CLIENT_IDENTIFIER_LENGTH ),
-                    SHADOW_TOPIC_STRING_UPDATE_REJECTED( MQTT_CLIENT_IDENTIFIER ) ) );
-        }
-    }
-
-    /* Store the result in the application defined context so the calling task
-     * can check it. */
-    pxCommandContext->xReturnStatus = xSuccess;
-
-    xTaskNotifyGive( xShadowDeviceTaskHandle );
-}
-
-/*-----------------------------------------------------------*/
-
 static void prvIncomingPublishUpdateDeltaCallback( void * pxSubscriptionContext,
                                                    MQTTPublishInfo_t * pxPublishInfo )
 {
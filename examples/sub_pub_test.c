@@ -209,7 +209,9 @@ static const char *TAG = "coreMQTTAgentSubPubDemo";
  * @brief The buffer to hold the topic filter. The topic is generated at runtime
  * by adding the task names.
  *
- * @note The topic strings must persist until unsubscribed.
+ * @note The topic strings must persist until unsubscribed, unless
+ * CONFIG_MQTT_SUBSCRIPTION_FILTER_ARENA_SIZE is set and the subscription manager
+ * keeps its own copy. The buffer is also the topic the task publishes to.
  */
 #if democonfigNUM_SIMPLE_SUB_PUB_TASKS_TO_CREATE > 0
 static char topicBuf[ democonfigNUM_SIMPLE_SUB_PUB_TASKS_TO_CREATE ][ mqttexampleSTRING_BUFFER_LENGTH ];
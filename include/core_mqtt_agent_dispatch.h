@@ -0,0 +1,376 @@
+/**
+ * @file core_mqtt_agent_dispatch.h
+ * @brief Delivery of incoming publishes by pools of worker tasks.
+ *
+ * The agent task routes each incoming publish and queues one delivery per
+ * subscriber to the pool the subscriber was added with, so that slow callbacks
+ * hold up neither keep-alives and acknowledgements nor the other subscribers.
+ * Subscribers of a pool that has not been started are called on the agent task.
+ *
+ * Each worker keeps one queue per priority class, and takes a delivery of a
+ * class only once the queues of the classes above it are empty, so that a
+ * burst of bulk publishes does not hold up control messages behind it.
+ *
+ * A subscriber added with SubscriptionRequest_t::xBatch set gets the publishes
+ * it matched in one agent receive cycle together, as one array, to spread its
+ * locking and setup over the whole burst. The batches are collected by the
+ * agent task and delivered once it has processed what it received, or when
+ * full.
+ *
+ * The PUBACK of a QoS 1 publish matching a subscriber added with
+ * SubscriptionRequest_t::xManualAck set is held until the publish is released
+ * by all its deliveries and leases. A subscriber that leases the publish and
+ * releases the lease once it has processed it thereby acknowledges it itself,
+ * so that the in-flight window of the broker throttles the publishes to the
+ * rate the device processes them.
+ *
+ * A callback can also keep the publish it is given beyond its return with
+ * leasePublish(). The publish is then copied once into a slab of the receive
+ * buffer pool, shared by every lease and queued delivery of the publish:
+ *
+ * @code{c}
+ * static void prvCallback(void *pvContext, MQTTPublishInfo_t *pxPublishInfo) {
+ *     PublishLease_t *pxLease = leasePublish(pxPublishInfo);
+ *
+ *     if (pxLease != NULL) {
+ *         // Hand the lease to another task, which reads getLeasedPublish(pxLease)
+ *         // and then calls releasePublishLease(pxLease).
+ *     }
+ * }
+ * @endcode
+ */
+#ifndef CORE_MQTT_AGENT_DISPATCH_H
+#define CORE_MQTT_AGENT_DISPATCH_H
+
+#include "freertos/FreeRTOS.h"
+
+#include "core_mqtt_agent_subs_manager.h"
+
+/**
+ * @brief Number of dispatch pools subscribers can be added to, or 0 to call
+ * every callback on the agent task.
+ */
+#ifndef MQTT_AGENT_DISPATCH_POOLS
+#ifndef CONFIG_MQTT_AGENT_DISPATCH_POOLS
+#define MQTT_AGENT_DISPATCH_POOLS    0U
+#else
+#define MQTT_AGENT_DISPATCH_POOLS    CONFIG_MQTT_AGENT_DISPATCH_POOLS
+#endif
+#endif
+
+/**
+ * @brief Most worker tasks of a dispatch pool.
+ */
+#ifndef MQTT_AGENT_DISPATCH_MAX_WORKERS
+#ifndef CONFIG_MQTT_AGENT_DISPATCH_MAX_WORKERS
+#define MQTT_AGENT_DISPATCH_MAX_WORKERS    4U
+#else
+#define MQTT_AGENT_DISPATCH_MAX_WORKERS    CONFIG_MQTT_AGENT_DISPATCH_MAX_WORKERS
+#endif
+#endif
+
+/**
+ * @brief Time the agent task waits for room in the queue of a worker before
+ * dropping the delivery.
+ */
+#ifndef MQTT_AGENT_DISPATCH_ENQUEUE_TIMEOUT_MS
+#ifndef CONFIG_MQTT_AGENT_DISPATCH_ENQUEUE_TIMEOUT_MS
+#define MQTT_AGENT_DISPATCH_ENQUEUE_TIMEOUT_MS    10U
+#else
+#define MQTT_AGENT_DISPATCH_ENQUEUE_TIMEOUT_MS    CONFIG_MQTT_AGENT_DISPATCH_ENQUEUE_TIMEOUT_MS
+#endif
+#endif
+
+/**
+ * @brief Number of priority classes of the deliveries, class 0 being the
+ * lowest. Subscribers of a higher class are clamped to the highest one.
+ */
+#ifndef MQTT_AGENT_DISPATCH_PRIORITY_CLASSES
+#ifndef CONFIG_MQTT_AGENT_DISPATCH_PRIORITY_CLASSES
+#define MQTT_AGENT_DISPATCH_PRIORITY_CLASSES    2U
+#else
+#define MQTT_AGENT_DISPATCH_PRIORITY_CLASSES    CONFIG_MQTT_AGENT_DISPATCH_PRIORITY_CLASSES
+#endif
+#endif
+
+/**
+ * @brief Fill of the queue of a worker, in percent, past which the agent task
+ * stops reading the socket until the queue is back down to half of it, or 0 to
+ * always read.
+ */
+#ifndef MQTT_AGENT_DISPATCH_HIGH_WATER_PERCENT
+#ifndef CONFIG_MQTT_AGENT_DISPATCH_HIGH_WATER_PERCENT
+#define MQTT_AGENT_DISPATCH_HIGH_WATER_PERCENT    0U
+#else
+#define MQTT_AGENT_DISPATCH_HIGH_WATER_PERCENT    CONFIG_MQTT_AGENT_DISPATCH_HIGH_WATER_PERCENT
+#endif
+#endif
+
+/**
+ * @brief Number of buckets of the queueing latency histogram, for up to 1 ms,
+ * 10 ms, 100 ms and longer.
+ */
+#define MQTT_AGENT_DISPATCH_LATENCY_BUCKETS    4U
+
+/**
+ * @brief Number of slabs of the receive buffer pool the incoming publishes are
+ * copied to, at most 32, or 0 to copy them to the heap.
+ */
+#ifndef MQTT_AGENT_DISPATCH_SLABS
+#ifndef CONFIG_MQTT_AGENT_DISPATCH_SLABS
+#define MQTT_AGENT_DISPATCH_SLABS    0U
+#else
+#define MQTT_AGENT_DISPATCH_SLABS    CONFIG_MQTT_AGENT_DISPATCH_SLABS
+#endif
+#endif
+
+/**
+ * @brief Size of a slab in bytes. A publish larger than a slab, or arriving
+ * while they are all in use, is copied to the heap.
+ */
+#ifndef MQTT_AGENT_DISPATCH_SLAB_SIZE
+#ifndef CONFIG_MQTT_AGENT_DISPATCH_SLAB_SIZE
+#define MQTT_AGENT_DISPATCH_SLAB_SIZE    512U
+#else
+#define MQTT_AGENT_DISPATCH_SLAB_SIZE    CONFIG_MQTT_AGENT_DISPATCH_SLAB_SIZE
+#endif
+#endif
+
+/**
+ * @brief Number of subscribers taking batches that can collect publishes in
+ * the same receive cycle. When more are, the batch of the first is delivered
+ * early to make room.
+ */
+#ifndef MQTT_AGENT_DISPATCH_BATCH_SUBSCRIBERS
+#ifndef CONFIG_MQTT_AGENT_DISPATCH_BATCH_SUBSCRIBERS
+#define MQTT_AGENT_DISPATCH_BATCH_SUBSCRIBERS    4U
+#else
+#define MQTT_AGENT_DISPATCH_BATCH_SUBSCRIBERS    CONFIG_MQTT_AGENT_DISPATCH_BATCH_SUBSCRIBERS
+#endif
+#endif
+
+/**
+ * @brief Most publishes in a batch, delivered as soon as it is full.
+ */
+#ifndef MQTT_AGENT_DISPATCH_BATCH_SIZE
+#ifndef CONFIG_MQTT_AGENT_DISPATCH_BATCH_SIZE
+#define MQTT_AGENT_DISPATCH_BATCH_SIZE    8U
+#else
+#define MQTT_AGENT_DISPATCH_BATCH_SIZE    CONFIG_MQTT_AGENT_DISPATCH_BATCH_SIZE
+#endif
+#endif
+
+/**
+ * @brief A publish kept beyond its callback, taken with leasePublish().
+ */
+typedef struct dispatchMessage PublishLease_t;
+
+/**
+ * @brief Handler of the publishes whose PUBACK was held, set with
+ * setPublishAckHandler().
+ *
+ * @param[in] ulAckToken The token passed to
+ * dispatchIncomingPublishesDeferringAck() for the publish.
+ */
+typedef void (*PublishAckHandler_t )(uint32_t ulAckToken);
+
+/**
+ * @brief Settings of a dispatch pool, passed to startDispatchPool().
+ */
+typedef struct dispatchPoolConfig {
+    uint8_t ucWorkers;         /**< Worker tasks, from 1 to MQTT_AGENT_DISPATCH_MAX_WORKERS. */
+    UBaseType_t uxPriority;    /**< Priority of the worker tasks. */
+    BaseType_t xCoreID;        /**< Core the worker tasks are pinned to, or tskNO_AFFINITY. */
+    uint32_t ulStackSize;      /**< Stack size of each worker task in bytes. */
+    UBaseType_t uxQueueLength; /**< Deliveries each worker task can have waiting in each class. */
+} DispatchPoolConfig_t;
+
+/**
+ * @brief Counters of a priority class of a dispatch pool.
+ */
+typedef struct dispatchClassStats {
+    uint32_t ulQueued;       /**< Deliveries queued to the workers. */
+    uint32_t ulDelivered;    /**< Deliveries whose callback has returned. */
+    uint32_t ulDropped;      /**< Deliveries dropped because a queue stayed full or out of memory. */
+    uint32_t ulWaiting;      /**< Deliveries currently waiting in the queues. */
+    uint32_t ulMaxLatencyUs; /**< Longest time a delivery waited before its callback was called. */
+
+    /**
+     * @brief Deliveries that waited up to 1 ms, 10 ms, 100 ms and longer.
+     */
+    uint32_t ulLatencyBuckets[MQTT_AGENT_DISPATCH_LATENCY_BUCKETS];
+} DispatchClassStats_t;
+
+/**
+ * @brief Counters of a dispatch pool, in total and per priority class.
+ */
+typedef struct dispatchPoolStats {
+    uint32_t ulQueued;    /**< Deliveries queued to the workers. */
+    uint32_t ulDelivered; /**< Deliveries whose callback has returned. */
+    uint32_t ulDropped;   /**< Deliveries dropped because a queue stayed full or out of memory. */
+    uint32_t ulWaiting;   /**< Deliveries currently waiting in the queues. */
+
+    /**
+     * @brief The same counters for each priority class, with the queueing latency.
+     */
+    DispatchClassStats_t xClasses[MQTT_AGENT_DISPATCH_PRIORITY_CLASSES];
+} DispatchPoolStats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Start the worker tasks of a dispatch pool.
+ *
+ * From then on, the publishes matching the subscribers added with
+ * SubscriptionRequest_t::ucDispatchPool set to ucPool, or the static
+ * subscriptions declared for it with STATIC_SUBSCRIPTION_DISPATCHED(), are
+ * copied once and their callbacks called by the workers. The
+ * deliveries of a subscriber, identified by its callback and context, always go
+ * to the same worker, so a callback is never called concurrently for itself and
+ * sees the publishes in the order they arrived. Its deliveries are queued in
+ * the class of SubscriptionRequest_t::ucPriorityClass, a batch counting as one
+ * delivery. A pool can be started once, at any time.
+ *
+ * @param[in] ucPool The pool, lower than MQTT_AGENT_DISPATCH_POOLS.
+ * @param[in] pxConfig Number, priority, core and stack size of the workers.
+ *
+ * @return `true` if the workers were started, `false` if the parameters are
+ * invalid, the pool was already started or out of memory.
+ */
+bool startDispatchPool(uint8_t ucPool,
+                       const DispatchPoolConfig_t *pxConfig);
+
+/**
+ * @brief Wait for every delivery queued to a dispatch pool before the call to
+ * be made.
+ *
+ * Callbacks may still be called for a little while after the subscriber was
+ * removed, with the publishes queued to the pool before. Call this function
+ * after the removal before releasing the context of the callback. It must not
+ * be called from a callback of the pool.
+ *
+ * @param[in] ucPool The pool.
+ */
+void drainDispatchPool(uint8_t ucPool);
+
+/**
+ * @brief Get the counters of a dispatch pool.
+ *
+ * @param[in] ucPool The pool.
+ * @param[out] pxStats Filled with the counters, all 0 if the pool was not
+ * started.
+ */
+void getDispatchPoolStats(uint8_t ucPool,
+                          DispatchPoolStats_t *pxStats);
+
+/**
+ * @brief Route an incoming publish and queue it to the dispatch pools of its
+ * subscribers, or call the subscribers whose pool was not started.
+ *
+ * Called by the agent task in place of handleIncomingPublishes().
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxPublishInfo Info of incoming publish.
+ *
+ * @return `true` if the publish matched a subscriber; `false` otherwise.
+ */
+bool dispatchIncomingPublishes(SubscriptionElement_t *pxSubscriptionList,
+                               MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Route an incoming publish like dispatchIncomingPublishes(), holding
+ * its acknowledgement if it matches a subscriber added with
+ * SubscriptionRequest_t::xManualAck set.
+ *
+ * The PUBACK is then to be sent once the handler set with
+ * setPublishAckHandler() is called with ulAckToken, from the task releasing
+ * the publish last.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxPublishInfo Info of incoming publish.
+ * @param[in] ulAckToken Non-zero token identifying the publish to the handler,
+ * or 0 not to hold its acknowledgement.
+ * @param[out] pxAckDeferred Set to `true` if the acknowledgement is held,
+ * `false` if it is to be sent right away.
+ *
+ * @return `true` if the publish matched a subscriber; `false` otherwise.
+ */
+bool dispatchIncomingPublishesDeferringAck(SubscriptionElement_t *pxSubscriptionList,
+                                           MQTTPublishInfo_t *pxPublishInfo,
+                                           uint32_t ulAckToken,
+                                           bool *pxAckDeferred);
+
+/**
+ * @brief Set the handler of the publishes whose PUBACK was held.
+ *
+ * Must be called before publishes are routed, by the agent task, which sends
+ * the PUBACK. Acknowledgements are never held without a handler.
+ *
+ * @param[in] pxHandler Called once for each publish whose acknowledgement was
+ * held, from any task, and must not block.
+ */
+void setPublishAckHandler(PublishAckHandler_t pxHandler);
+
+/**
+ * @brief Tell whether the dispatch pools are past their high-water mark.
+ *
+ * Called by the agent task before reading the socket. A queue found past
+ * MQTT_AGENT_DISPATCH_HIGH_WATER_PERCENT when a delivery was queued to it keeps
+ * the pools saturated until it is back down to half of the mark, so that TCP
+ * flow control holds the broker back rather than deliveries being dropped.
+ *
+ * @return `true` if the socket should not be read, `false` otherwise.
+ */
+bool isDispatchSaturated(void);
+
+/**
+ * @brief Deliver the batches collected by dispatchIncomingPublishes().
+ *
+ * Called by the agent task whenever it is done with what it received, before
+ * it waits for its next command, and when the connection ends. The batches go
+ * to the dispatch pool of their subscriber, or are called back right away if
+ * the pool was not started.
+ */
+void flushDispatchBatches(void);
+
+/**
+ * @brief Keep the publish a callback is given beyond the return of the
+ * callback.
+ *
+ * Must be called from the callback, with the publish info it was given, for a
+ * publish delivered by dispatchIncomingPublishes(), and not from a batch
+ * callback. The first lease taken on a
+ * publish called back on the agent task copies it, to a slab when it fits; the
+ * publishes delivered by a dispatch pool are already copied. Either way, one
+ * copy is shared by all the leases and deliveries of the publish.
+ *
+ * @param[in] pxPublishInfo The publish info the callback was given.
+ *
+ * @return The lease, to be released with releasePublishLease(), or NULL if not
+ * called from the callback of the publish or out of memory.
+ */
+PublishLease_t *leasePublish(const MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Get the publish a lease keeps.
+ *
+ * @param[in] pxLease The lease.
+ *
+ * @return The publish, shared by the holders of leases on it and valid until
+ * the lease is released.
+ */
+const MQTTPublishInfo_t *getLeasedPublish(const PublishLease_t *pxLease);
+
+/**
+ * @brief Release a lease taken with leasePublish(), from any task.
+ *
+ * @param[in] pxLease The lease.
+ */
+void releasePublishLease(PublishLease_t *pxLease);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* CORE_MQTT_AGENT_DISPATCH_H */
@@ -0,0 +1,150 @@
+/**
+ * @file core_mqtt_agent_stream.h
+ * @brief Streaming receive of publishes larger than the network buffer.
+ *
+ * coreMQTT reads each packet whole into the network buffer of the agent, which
+ * therefore has to be as large as the largest publish expected. Instead, the
+ * agent task reads the transport through receivePublishStreams(), which follows
+ * the packets handed to coreMQTT. A QoS 0 or 1 publish that would not fit the
+ * network buffer, and matches a subscriber added with
+ * SubscriptionRequest_t::xStream set, is kept from coreMQTT: its topic is read
+ * into a small buffer, and its payload handed to PublishStreamCallbacks_t of the
+ * subscribers in chunks as it is read, the PUBACK of a QoS 1 publish being sent
+ * once the payload was read whole. The network buffer then only needs to hold
+ * the other packets.
+ *
+ * Subscribers of such a publish that did not ask for a stream are skipped.
+ * A publish no stream subscriber matched would make coreMQTT fail and the agent
+ * reconnect. It is instead read whole into a spill buffer borrowed from the heap
+ * for it, if no larger than MQTT_AGENT_STREAM_SPILL_SIZE, and passed to the
+ * handler set with setSpilledPublishHandler() as if coreMQTT had received it,
+ * or else read and discarded, and the session goes on. Publishes with a topic
+ * longer than MQTT_AGENT_STREAM_TOPIC_LENGTH, or of QoS 2, whose handshake is
+ * up to coreMQTT, are handed to coreMQTT.
+ *
+ * The agent task does nothing else while it reads the payload of a stream.
+ */
+#ifndef CORE_MQTT_AGENT_STREAM_H
+#define CORE_MQTT_AGENT_STREAM_H
+
+#include "core_mqtt.h"
+
+#include "core_mqtt_agent_subs_manager.h"
+
+/**
+ * @brief Size of the chunks the payloads of the publishes too large for the
+ * network buffer are read in, or 0 to hand every packet to coreMQTT.
+ */
+#ifndef MQTT_AGENT_STREAM_CHUNK_SIZE
+#ifndef CONFIG_MQTT_AGENT_STREAM_CHUNK_SIZE
+#define MQTT_AGENT_STREAM_CHUNK_SIZE    0U
+#else
+#define MQTT_AGENT_STREAM_CHUNK_SIZE    CONFIG_MQTT_AGENT_STREAM_CHUNK_SIZE
+#endif
+#endif
+
+/**
+ * @brief Longest topic of a publish that can be streamed.
+ */
+#ifndef MQTT_AGENT_STREAM_TOPIC_LENGTH
+#ifndef CONFIG_MQTT_AGENT_STREAM_TOPIC_LENGTH
+#define MQTT_AGENT_STREAM_TOPIC_LENGTH    128U
+#else
+#define MQTT_AGENT_STREAM_TOPIC_LENGTH    CONFIG_MQTT_AGENT_STREAM_TOPIC_LENGTH
+#endif
+#endif
+
+/**
+ * @brief Most stream subscribers a publish is streamed to.
+ */
+#ifndef MQTT_AGENT_STREAM_SUBSCRIBERS
+#ifndef CONFIG_MQTT_AGENT_STREAM_SUBSCRIBERS
+#define MQTT_AGENT_STREAM_SUBSCRIBERS    4U
+#else
+#define MQTT_AGENT_STREAM_SUBSCRIBERS    CONFIG_MQTT_AGENT_STREAM_SUBSCRIBERS
+#endif
+#endif
+
+/**
+ * @brief Largest payload of a publish too large for the network buffer, and
+ * matching no stream subscriber, read into a spill buffer rather than
+ * discarded, or 0 to always discard them.
+ */
+#ifndef MQTT_AGENT_STREAM_SPILL_SIZE
+#ifndef CONFIG_MQTT_AGENT_STREAM_SPILL_SIZE
+#define MQTT_AGENT_STREAM_SPILL_SIZE    0U
+#else
+#define MQTT_AGENT_STREAM_SPILL_SIZE    CONFIG_MQTT_AGENT_STREAM_SPILL_SIZE
+#endif
+#endif
+
+/**
+ * @brief Handler of a publish read whole into a spill buffer.
+ *
+ * Called on the agent task, with the publish only valid until it returns.
+ *
+ * @param[in] usPacketId Packet identifier of a QoS 1 publish, 0 for QoS 0.
+ * @param[in] pxPublishInfo The publish.
+ *
+ * @return `true` if the handler holds the PUBACK of the publish and sends it
+ * itself, `false` to have it sent right away.
+ */
+typedef bool (*SpilledPublishHandler_t )(uint16_t usPacketId,
+                                         MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Counters of the publishes too large for the network buffer.
+ */
+typedef struct publishStreamStats {
+    uint32_t ulStreamed;  /**< Publishes streamed whole. */
+    uint32_t ulTruncated; /**< Publishes whose connection was lost while streamed. */
+    uint32_t ulSkipped;   /**< Subscribers of a streamed publish skipped, not being stream subscribers. */
+    uint32_t ulSpilled;   /**< Publishes matching no stream subscriber read into a spill buffer. */
+    uint32_t ulDiscarded; /**< Publishes matching no stream subscriber discarded. */
+} PublishStreamStats_t;
+
+/**
+ * @brief Read from the transport the bytes of the packets to hand to coreMQTT,
+ * streaming the publishes too large for the network buffer to their
+ * subscribers on the way.
+ *
+ * Only called by the agent task, from the receive function of its transport.
+ *
+ * @param[in] pxSubscriptionList The subscriptions the publishes are streamed to.
+ * @param[in] pxTransport The transport read, and sent the PUBACKs of the
+ * publishes kept from coreMQTT.
+ * @param[out] pBuffer Buffer of coreMQTT.
+ * @param[in] bytesToRecv Bytes coreMQTT asks for.
+ * @param[in] xNetworkBufferSize Size of the network buffer of coreMQTT.
+ *
+ * @return Bytes written to pBuffer, 0 if none could be read yet, or the
+ * negative value returned by the transport.
+ */
+int32_t receivePublishStreams(SubscriptionElement_t *pxSubscriptionList,
+                              const TransportInterface_t *pxTransport,
+                              void *pBuffer,
+                              size_t bytesToRecv,
+                              size_t xNetworkBufferSize);
+
+/**
+ * @brief Set the handler of the publishes read into a spill buffer. They are
+ * discarded until one is set.
+ *
+ * @param[in] pxHandler The handler.
+ */
+void setSpilledPublishHandler(SpilledPublishHandler_t pxHandler);
+
+/**
+ * @brief Forget the packet being read, ending the stream being read if any,
+ * once the connection was lost.
+ */
+void resetPublishStreams(void);
+
+/**
+ * @brief Get the counters of the publishes too large for the network buffer.
+ *
+ * @param[out] pxStats The counters.
+ */
+void getPublishStreamStats(PublishStreamStats_t *pxStats);
+
+#endif /* CORE_MQTT_AGENT_STREAM_H */
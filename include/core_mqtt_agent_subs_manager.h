@@ -49,6 +49,149 @@
 #endif
 #endif
 
+/**
+ * @brief Grow the subscription store in chunks taken from the heap once the
+ * subscription list passed by the application is full.
+ *
+ * When disabled, the subscription list is the whole store and the subscription
+ * manager does not use the heap.
+ */
+#ifndef SUBSCRIPTION_MANAGER_USE_POOL
+#ifdef CONFIG_MQTT_SUBSCRIPTION_STORE_POOL
+#define SUBSCRIPTION_MANAGER_USE_POOL    1
+#else
+#define SUBSCRIPTION_MANAGER_USE_POOL    0
+#endif
+#endif
+
+/**
+ * @brief Number of subscriptions added to the store by each chunk.
+ */
+#ifndef SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE
+#ifndef CONFIG_MQTT_SUBSCRIPTION_POOL_CHUNK_SIZE
+#define SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE    8U
+#else
+#define SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE    CONFIG_MQTT_SUBSCRIPTION_POOL_CHUNK_SIZE
+#endif
+#endif
+
+/**
+ * @brief Hard cap on the number of subscriptions, including the ones held by
+ * the subscription list passed by the application.
+ */
+#ifndef SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT
+#if SUBSCRIPTION_MANAGER_USE_POOL
+#ifndef CONFIG_MQTT_SUBSCRIPTION_POOL_LIMIT
+#define SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT    64U
+#else
+#define SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT    CONFIG_MQTT_SUBSCRIPTION_POOL_LIMIT
+#endif
+#else
+#define SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT    SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS
+#endif
+#endif
+
+/**
+ * @brief Maximum number of nodes in the topic trie used to route incoming
+ * publishes.
+ *
+ * Every distinct topic level of every registered filter takes one node, so a
+ * filter with N levels needs at most N nodes and shares the nodes of any common
+ * prefix with the other filters.
+ */
+#ifndef SUBSCRIPTION_MANAGER_MAX_TRIE_NODES
+#ifndef CONFIG_MQTT_SUBSCRIPTION_TRIE_MAX_NODES
+#define SUBSCRIPTION_MANAGER_MAX_TRIE_NODES    64U
+#else
+#define SUBSCRIPTION_MANAGER_MAX_TRIE_NODES    CONFIG_MQTT_SUBSCRIPTION_TRIE_MAX_NODES
+#endif
+#endif
+
+/**
+ * @brief Number of levels, not counting a trailing `#`, up to which topic
+ * filters are precompiled when added.
+ *
+ * Filters with more levels are matched with MQTT_MatchTopic() instead.
+ */
+#ifndef SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS
+#ifndef CONFIG_MQTT_SUBSCRIPTION_MAX_FILTER_LEVELS
+#define SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS    8U
+#else
+#define SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS    CONFIG_MQTT_SUBSCRIPTION_MAX_FILTER_LEVELS
+#endif
+#endif
+
+/**
+ * @brief Size in bytes of the arena topic filters are copied into.
+ *
+ * When non-zero, addSubscription() copies the filter of the subscription list
+ * of the MQTT agent into the arena, and identical filters share one copy, so
+ * callers need not keep their filter strings alive. When 0, the subscription
+ * manager keeps pointers to the strings of the callers.
+ */
+#ifndef SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE
+#ifndef CONFIG_MQTT_SUBSCRIPTION_FILTER_ARENA_SIZE
+#define SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE    0U
+#else
+#define SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE    CONFIG_MQTT_SUBSCRIPTION_FILTER_ARENA_SIZE
+#endif
+#endif
+
+/**
+ * @brief Number of topic names whose matching subscriptions
+ * handleIncomingPublishes() remembers, or 0 to resolve every publish afresh.
+ *
+ * Entries are replaced with the CLOCK algorithm and invalidated by any change
+ * to the subscriptions.
+ */
+#ifndef SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES
+#ifndef CONFIG_MQTT_SUBSCRIPTION_MATCH_CACHE_ENTRIES
+#define SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES    0U
+#else
+#define SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES    CONFIG_MQTT_SUBSCRIPTION_MATCH_CACHE_ENTRIES
+#endif
+#endif
+
+/**
+ * @brief Longest topic name kept in the match cache.
+ */
+#ifndef SUBSCRIPTION_MANAGER_MATCH_CACHE_TOPIC_LENGTH
+#ifndef CONFIG_MQTT_SUBSCRIPTION_MATCH_CACHE_TOPIC_LENGTH
+#define SUBSCRIPTION_MANAGER_MATCH_CACHE_TOPIC_LENGTH    64U
+#else
+#define SUBSCRIPTION_MANAGER_MATCH_CACHE_TOPIC_LENGTH    CONFIG_MQTT_SUBSCRIPTION_MATCH_CACHE_TOPIC_LENGTH
+#endif
+#endif
+
+/**
+ * @brief Most subscriptions a topic name may match to be kept in the match
+ * cache.
+ */
+#ifndef SUBSCRIPTION_MANAGER_MATCH_CACHE_MATCHES
+#define SUBSCRIPTION_MANAGER_MATCH_CACHE_MATCHES    4U
+#endif
+
+/**
+ * @brief Most entries of the table of static subscriptions set with
+ * setStaticSubscriptions(), through registerStaticSubscriptions() for the MQTT
+ * agent, or 0 to leave static subscriptions out.
+ */
+#ifndef SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS
+#ifndef CONFIG_MQTT_SUBSCRIPTION_MAX_STATIC_SUBSCRIPTIONS
+#define SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS    0U
+#else
+#define SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS    CONFIG_MQTT_SUBSCRIPTION_MAX_STATIC_SUBSCRIPTIONS
+#endif
+#endif
+
+/**
+ * @brief Number of buckets of the hash table holding the subscriptions whose
+ * filter contains no wildcard.
+ */
+#ifndef SUBSCRIPTION_MANAGER_EXACT_BUCKETS
+#define SUBSCRIPTION_MANAGER_EXACT_BUCKETS    SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS
+#endif
+
 /**
  * @brief Callback function called when receiving a publish.
  *
@@ -58,6 +201,129 @@
 typedef void (*IncomingPubCallback_t )(void *pvIncomingPublishCallbackContext,
                                        MQTTPublishInfo_t *pxPublishInfo);
 
+/**
+ * @brief Most wildcards a topic filter can capture: one per `+` level and the
+ * `#` tail.
+ */
+#define SUBSCRIPTION_MANAGER_MAX_CAPTURES    (SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS + 1U)
+
+/**
+ * @brief The part of a topic name matched by a wildcard of the topic filter.
+ */
+typedef struct topicCapture {
+    uint16_t usOffset; /**< Offset of the part in the topic name. */
+    uint16_t usLength; /**< Length of the part, 0 for a `#` matching no level. */
+} TopicCapture_t;
+
+/**
+ * @brief The topic filter a publish matched, and what its wildcards matched.
+ */
+typedef struct subscriptionMatch {
+    const char *pcTopicFilterString; /**< Filter matched, without the `$share/<group>/` prefix. */
+    uint16_t usTopicFilterLength;    /**< Length of the filter. */
+    uint8_t ucCaptureCount;          /**< Captures, one per `+` in order and then the `#` tail if any. */
+    bool xMultiLevel;                /**< Filter ends with `#`, its tail being the last capture. */
+
+    /**
+     * @brief Levels of the topic name matched by the wildcards. The `#` tail
+     * spans all the remaining levels, separators included.
+     */
+    TopicCapture_t xCaptures[SUBSCRIPTION_MANAGER_MAX_CAPTURES];
+} SubscriptionMatch_t;
+
+/**
+ * @brief Callback invoked for incoming publishes with the captures of the
+ * wildcards of its topic filter, set with SubscriptionRequest_t::xCaptures.
+ *
+ * @param[in] pvIncomingPublishCallbackContext Context of the subscription.
+ * @param[in] pxPublishInfo The publish.
+ * @param[in] pxMatch The filter matched and its captures, only valid until the
+ * callback returns. Captures are offsets into pxPublishInfo->pTopicName.
+ */
+typedef void (*IncomingPubCaptureCallback_t )(void *pvIncomingPublishCallbackContext,
+                                              MQTTPublishInfo_t *pxPublishInfo,
+                                              const SubscriptionMatch_t *pxMatch);
+
+/**
+ * @brief Callback invoked with a batch of incoming publishes, set with
+ * SubscriptionRequest_t::xBatch.
+ *
+ * @param[in] pvIncomingPublishCallbackContext Context of the subscription.
+ * @param[in] pxPublishes The publishes, in the order they arrived, only valid
+ * until the callback returns.
+ * @param[in] usPublishCount Number of publishes, at least 1.
+ */
+typedef void (*IncomingPubBatchCallback_t )(void *pvIncomingPublishCallbackContext,
+                                            MQTTPublishInfo_t *pxPublishes,
+                                            uint16_t usPublishCount);
+
+/**
+ * @brief Callbacks taking the payload of incoming publishes as a sequence of
+ * chunks, set with SubscriptionRequest_t::xStream.
+ *
+ * Publishes larger than the network buffer of the agent are read from the
+ * transport in chunks, see core_mqtt_agent_stream.h, and the others are passed
+ * as a single chunk. The callbacks are always called on the agent task.
+ */
+typedef struct publishStreamCallbacks {
+    /**
+     * @brief Called when a publish begins, with pPayload NULL and payloadLength
+     * the length of the whole payload.
+     */
+    void (*pxBegin)(void *pvIncomingPublishCallbackContext,
+                    const MQTTPublishInfo_t *pxPublishInfo);
+
+    /**
+     * @brief Called with each chunk of the payload in order, xOffset being the
+     * offset of the chunk in the payload.
+     */
+    void (*pxData)(void *pvIncomingPublishCallbackContext,
+                   const uint8_t *pucChunk,
+                   size_t xChunkLength,
+                   size_t xOffset);
+
+    /**
+     * @brief Called when the publish ends, with xComplete unset if the
+     * connection was lost before the whole payload was read.
+     */
+    void (*pxEnd)(void *pvIncomingPublishCallbackContext,
+                  bool xComplete);
+} PublishStreamCallbacks_t;
+
+/**
+ * @brief A subscriber a publish is delivered to, as handed to a DeliveryHook_t.
+ */
+typedef struct subscriptionDelivery {
+    union {
+        IncomingPubCallback_t pxIncomingPublishCallback;  /**< Callback of the subscriber, if pxMatch is NULL and xBatch unset. */
+        IncomingPubCaptureCallback_t pxCaptureCallback;   /**< Callback of the subscriber, if pxMatch is set. */
+        IncomingPubBatchCallback_t pxBatchCallback;       /**< Callback of the subscriber, if xBatch is set. */
+        const PublishStreamCallbacks_t *pxStreamCallbacks; /**< Callbacks of the subscriber, if xStream is set. */
+    };
+    void *pvIncomingPublishCallbackContext;               /**< Context of the subscriber. */
+    const SubscriptionMatch_t *pxMatch;                   /**< Captures for a capture callback, or NULL. */
+    bool xBatch;                                          /**< The subscriber takes its publishes in batches. */
+    bool xStream;                                         /**< The subscriber takes its payloads in chunks. */
+    bool xManualAck;                                      /**< The subscriber acknowledges its publishes itself. */
+    uint8_t ucDispatchPool;                               /**< Dispatch pool the subscriber was added with. */
+    uint8_t ucPriorityClass;                              /**< Priority class the subscriber was added with. */
+} SubscriptionDelivery_t;
+
+/**
+ * @brief Hook called by deliverIncomingPublishes() for each subscriber a
+ * publish is delivered to, in place of invoking its callback.
+ *
+ * @param[in] pvHookContext The context passed to deliverIncomingPublishes().
+ * @param[in] pxDelivery The subscriber.
+ * @param[in] pxPublishInfo The publish, only valid until the hook returns.
+ *
+ * @return `true` if the hook took the delivery over, `false` to have the
+ * callback invoked right away.
+ */
+typedef bool (*DeliveryHook_t )(void *pvHookContext,
+                                const SubscriptionDelivery_t *pxDelivery,
+                                MQTTPublishInfo_t *pxPublishInfo);
+
 /**
  * @brief An element in the list of subscriptions.
  *
@@ -66,18 +332,151 @@ typedef void (*IncomingPubCallback_t )(void *pvIncomingPublishCallbackContext,
  *
  * @note This implementation allows multiple tasks to subscribe to the same topic.
  * In this case, another element is added to the subscription list, differing
- * in the intended publish callback. Also note that the topic filters are not
+ * in the intended publish callback. Also note that, unless
+ * SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE is set, the topic filters are not
  * copied in the subscription manager and hence the topic filter strings need to
  * stay in scope until unsubscribed.
+ *
+ * @note The fields other than the callback, its context and the topic filter
+ * are maintained by the subscription manager and must not be modified by the
+ * application. Those changed once the element is linked into the routing index
+ * are kept out of the bitfield, which handleIncomingPublishes() reads without
+ * a lock.
  */
 typedef struct subscriptionElement {
-    IncomingPubCallback_t pxIncomingPublishCallback;
-    void *pvIncomingPublishCallbackContext;
-    uint16_t usFilterStringLength;
-    const char *pcSubscriptionFilterString;
+    union {
+        IncomingPubCallback_t pxIncomingPublishCallback;            /**< Callback for the publishes matching the filter. */
+        IncomingPubCaptureCallback_t pxCaptureCallback;             /**< The same, when xCaptures is set. */
+        IncomingPubBatchCallback_t pxBatchCallback;                 /**< The same, when xBatch is set. */
+        const PublishStreamCallbacks_t *pxStreamCallbacks;          /**< Callbacks kept in scope, when xStream is set. */
+    };
+    void *pvIncomingPublishCallbackContext;                         /**< Context passed to the callback. */
+    const char *pcSubscriptionFilterString;                         /**< Topic filter of the subscription. */
+    uint32_t ulFilterHash;                                          /**< Hash of a wildcard-free filter, past its share prefix. */
+    uint32_t ulRetiredSequence;                                     /**< Dispatch sequence when the element was removed. */
+    uint32_t ulLastDelivery;                                        /**< Share sequence of the last publish delivered to this member. */
+    uint32_t ulSingleLevelMask;                                     /**< Bit n set if level n is `+`. */
+    uint16_t usFilterStringLength;                                  /**< Length of the topic filter. */
+    uint16_t usTrieNode;                                            /**< Trie node the filter hangs from. */
+    uint16_t usNextInNode;                                          /**< Next subscription of the node or hash bucket (index + 1). */
+    uint16_t usShareGroupLength;                                    /**< Length of the `$share/<group>/` prefix, 0 if not shared. */
+    uint16_t usLiteralPrefixLength;                                 /**< Length of the levels in front of the first wildcard, separators included. */
+    uint8_t ucLevelOffsets[SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS]; /**< Offset of each level in the filter, from the first wildcard on. */
+    uint8_t ucLevelCount;                                           /**< Levels in front of a trailing `#`. */
+    uint8_t ucPrefixLevels;                                         /**< Levels in front of the first wildcard. */
+    uint8_t ucDispatchPool;                                         /**< Dispatch pool handed to the delivery hook. */
+    uint8_t ucPriorityClass;                                        /**< Priority class handed to the delivery hook. */
+    uint8_t ucGrantedQoS;                                           /**< QoS the broker granted, requested again on reconnect. */
+    bool xPending;                                                  /**< Added by an addSubscriptions() call still in progress. */
+    bool xRetired;                                                  /**< Removed, but handleIncomingPublishes() may still see it. Accessed atomically. */
+    uint8_t ucRequestedQoS : 2;                                     /**< QoS the subscriber asked for. */
+    bool xCaptures : 1;                                             /**< Callback is an IncomingPubCaptureCallback_t. */
+    bool xBatch : 1;                                                /**< Callback is an IncomingPubBatchCallback_t. */
+    bool xStream : 1;                                               /**< Callbacks are PublishStreamCallbacks_t. */
+    bool xManualAck : 1;                                            /**< PUBACK held until released, passed to the delivery hook. */
+    bool xFilterCompiled : 1;                                       /**< Filter is matched from the fields above rather than by coreMQTT. */
+    bool xMultiLevel : 1;                                           /**< Filter ends with `#`. */
 } SubscriptionElement_t;
 
+/**
+ * @brief One subscription of a batch passed to addSubscriptions() or
+ * removeSubscriptions().
+ */
+typedef struct subscriptionRequest {
+    const char *pcTopicFilterString;                     /**< Topic filter of the subscription. */
+    uint16_t usTopicFilterLength;                        /**< Length of the topic filter. */
+    MQTTQoS_t xQoS;                                      /**< QoS to request from the broker. */
+    union {
+        IncomingPubCallback_t pxIncomingPublishCallback; /**< Callback for the publishes matching the filter. */
+        IncomingPubCaptureCallback_t pxCaptureCallback;  /**< The same, when xCaptures is set. */
+        IncomingPubBatchCallback_t pxBatchCallback;      /**< The same, when xBatch is set. */
+        const PublishStreamCallbacks_t *pxStreamCallbacks; /**< Callbacks kept in scope, when xStream is set. */
+    };
+    void *pvIncomingPublishCallbackContext;              /**< Context passed to the callback. */
+    uint8_t ucDispatchPool;                              /**< Dispatch pool handed to the delivery hook, 0 by default. */
+    uint8_t ucPriorityClass;                             /**< Priority class handed to the delivery hook, 0 by default. */
+
+    /**
+     * @brief Set to call pxCaptureCallback with the captures of the wildcards
+     * of the filter, which must then have at most
+     * SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS levels in front of a `#`.
+     */
+    bool xCaptures;
+
+    /**
+     * @brief Set to call pxBatchCallback with the publishes matching the filter
+     * in batches, rather than one at a time. Cannot be set with xCaptures.
+     */
+    bool xBatch;
+
+    /**
+     * @brief Set to call pxStreamCallbacks with the payloads of the publishes
+     * matching the filter in chunks, so that they can be larger than the
+     * network buffer. Cannot be set with xCaptures or xBatch.
+     */
+    bool xStream;
+
+    /**
+     * @brief Set to hold the PUBACK of the QoS 1 publishes matching the filter
+     * until the subscriber is done with them, see dispatchIncomingPublishesDeferringAck().
+     */
+    bool xManualAck;
+} SubscriptionRequest_t;
+
+/**
+ * @brief A subscription known at build time, declared with STATIC_SUBSCRIPTION()
+ * in a const table that stays in flash.
+ */
+typedef struct staticSubscription {
+    const char *pcTopicFilterString;                 /**< Topic filter of the subscription. */
+    uint16_t usTopicFilterLength;                    /**< Length of the topic filter. */
+    MQTTQoS_t xQoS;                                  /**< QoS to request from the broker. */
+    IncomingPubCallback_t pxIncomingPublishCallback; /**< Callback for the publishes matching the filter. */
+    void *pvIncomingPublishCallbackContext;          /**< Context passed to the callback. */
+    uint8_t ucDispatchPool;                          /**< Dispatch pool handed to the delivery hook. */
+    uint8_t ucPriorityClass;                         /**< Priority class handed to the delivery hook. */
+} StaticSubscription_t;
+
+/**
+ * @brief Initializer of a StaticSubscription_t delivered through a given
+ * dispatch pool and priority class.
+ *
+ * pcFilter must be a string literal, such as
+ * SHADOW_TOPIC_STRING_UPDATE_DELTA(THING_NAME), so that its length is worked
+ * out by the compiler.
+ */
+#define STATIC_SUBSCRIPTION_DISPATCHED(pcFilter, xQoS, pxCallback, pvContext, ucPool, ucClass) \
+    { (pcFilter), (uint16_t) (sizeof(pcFilter) - 1U), (xQoS),                                \
+      (pxCallback), (pvContext), (ucPool), (ucClass) }
+
+/**
+ * @brief Initializer of a StaticSubscription_t, delivered through dispatch
+ * pool 0 in priority class 0.
+ */
+#define STATIC_SUBSCRIPTION(pcFilter, xQoS, pxCallback, pvContext) \
+    STATIC_SUBSCRIPTION_DISPATCHED(pcFilter, xQoS, pxCallback, pvContext, 0U, 0U)
+
+/**
+ * @brief Usage counters of the subscription store.
+ */
+typedef struct subscriptionStats {
+    uint32_t ulActive;        /**< Subscriptions currently registered. */
+    uint32_t ulCapacity;      /**< Slots currently available without growing the store. */
+    uint32_t ulHighWaterMark; /**< Highest number of subscriptions registered at the same time. */
+    uint32_t ulLimit;         /**< Number of slots the store can grow to. */
+    uint32_t ulCacheHits;     /**< Publishes dispatched from the match cache. */
+    uint32_t ulCacheMisses;   /**< Publishes resolved through the routing index. */
+} SubscriptionStats_t;
+
 /* ---------------------------------------------------------------------------*/
+/*
+ * Thread safety: for the subscription list of the MQTT agent, the first list
+ * passed to any of the functions below, subscriptions can be added, removed and
+ * listed from any task while the agent task handles incoming publishes. Those
+ * calls serialise on a mutex. handleIncomingPublishes() and
+ * deliverIncomingPublishes() take no lock and never block, but only one task
+ * may call them at a time. Any other list is accessed without synchronisation.
+ */
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -95,7 +494,24 @@ extern "C" {
  * @param[in] pxIncomingPublishCallback Callback function for the subscription.
  * @param[in] pvIncomingPublishCallbackContext Context for the subscription callback.
  *
- * @return `true` if subscription added or exists, `false` if insufficient memory.
+ * @note Filters are classified when added: filters without `+` or `#` go into a
+ * hash table, the others into the topic trie.
+ *
+ * @note With SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE set, the filter is copied
+ * and pcTopicFilterString may be released as soon as this function returns.
+ *
+ * @note The subscription is recorded as requested at QoS1. Use
+ * addSubscriptions() to record another QoS.
+ *
+ * @note A topic filter of the form `$share/<group>/<filter>` adds a member to
+ * a shared subscription: its group prefix is stripped before matching, and each
+ * publish matching `<filter>` is delivered to a single member of the group, in
+ * turn. Tasks consuming the same stream share it by subscribing their own
+ * callback or context to the same group.
+ *
+ * @return `true` if subscription added or exists, `false` if the topic filter
+ * is invalid or if insufficient memory in either the subscription list, the
+ * topic trie or the filter arena.
  */
 bool addSubscription(SubscriptionElement_t *pxSubscriptionList,
                      const char *pcTopicFilterString,
@@ -107,7 +523,8 @@ bool addSubscription(SubscriptionElement_t *pxSubscriptionList,
  * @brief Remove a subscription from the subscription list.
  *
  * @note If the topic filter exists multiple times in the subscription list,
- * then every instance of the subscription will be removed.
+ * then every instance of the subscription will be removed. Use
+ * removeSubscriptions() to remove a single subscriber.
  *
  * @param[in] pxSubscriptionList  The pointer to the subscription list array.
  * @param[in] pcTopicFilterString Topic filter of subscription.
@@ -117,10 +534,139 @@ void removeSubscription(SubscriptionElement_t *pxSubscriptionList,
                         const char *pcTopicFilterString,
                         uint16_t usTopicFilterLength);
 
+/**
+ * @brief Add a batch of subscriptions to the subscription list.
+ *
+ * The subscriptions are added under a single hold of the lock of the store, and
+ * either all of them are added or, if one is invalid or does not fit, none.
+ * xQoS of each request is recorded as the requested QoS of the subscription,
+ * and as its granted QoS until setGrantedQoS() is called, unless the topic
+ * filter already has subscribers to take the granted QoS from.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxRequests The subscriptions to add.
+ * @param[in] xNumRequests Number of entries in pxRequests.
+ *
+ * @return `true` if every subscription was added or exists, `false` if nothing
+ * was added.
+ */
+bool addSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                      const SubscriptionRequest_t *pxRequests,
+                      size_t xNumRequests);
+
+/**
+ * @brief Check a batch of subscriptions the way addSubscriptions() does,
+ * without adding them.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxRequests The subscriptions to check.
+ * @param[in] xNumRequests Number of entries in pxRequests.
+ *
+ * @return `true` if every topic filter and callback is valid.
+ */
+bool validateSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                           const SubscriptionRequest_t *pxRequests,
+                           size_t xNumRequests);
+
+/**
+ * @brief Remove a batch of subscribers from the subscription list.
+ *
+ * Unlike removeSubscription(), only the subscription of each topic filter with
+ * the callback and context of the request is removed, so that other subscribers
+ * to the same topic filter keep receiving its publishes. The whole batch is
+ * removed under a single hold of the lock of the store.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxRequests The subscribers to remove.
+ * @param[in] xNumRequests Number of entries in pxRequests.
+ * @param[out] pxLastSubscriber Optional array of xNumRequests entries, each set
+ * to `true` if no subscriber to the topic filter of the request is left.
+ *
+ * @return `false` if a request is invalid, in which case nothing was removed.
+ */
+bool removeSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                         const SubscriptionRequest_t *pxRequests,
+                         size_t xNumRequests,
+                         bool *pxLastSubscriber);
+
+/**
+ * @brief Count the subscribers to a topic filter.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pcTopicFilterString Topic filter to look for.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[out] pxRequestedQoS Optional, set to the highest QoS requested by the
+ * subscribers, or MQTTQoS0 if there are none.
+ *
+ * @return Number of callback-context pairs subscribed to exactly that filter,
+ * static subscriptions included.
+ */
+uint32_t getSubscriberCount(SubscriptionElement_t *pxSubscriptionList,
+                            const char *pcTopicFilterString,
+                            uint16_t usTopicFilterLength,
+                            MQTTQoS_t *pxRequestedQoS);
+
+/**
+ * @brief Record the QoS the broker granted to a topic filter in each of its
+ * subscriptions.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pcTopicFilterString Topic filter acknowledged by the broker.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[in] xGrantedQoS QoS returned in the SUBACK.
+ */
+void setGrantedQoS(SubscriptionElement_t *pxSubscriptionList,
+                   const char *pcTopicFilterString,
+                   uint16_t usTopicFilterLength,
+                   MQTTQoS_t xGrantedQoS);
+
+/**
+ * @brief Set the table of static subscriptions of the subscription list of the
+ * MQTT agent.
+ *
+ * The table is used in place: nothing is copied and nothing is added to the
+ * subscription store. Its publishes are delivered by handleIncomingPublishes()
+ * after those of the subscriptions added at runtime, and its topic filters are
+ * counted by getSubscriberCount(). The table is scanned once for wildcards
+ * and its wildcard-free topic filters are hashed into an index held in RAM, so
+ * that a publish only compares its topic with those in its bucket and with the
+ * topic filters that have wildcards. The table can be set once.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxTable The static subscriptions, which must stay in scope for good.
+ * @param[in] xNumEntries Number of entries in pxTable, at most
+ * SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS.
+ *
+ * @return `true` if the table was set, `false` if an entry is invalid, if the
+ * table is too large or if a table was already set.
+ */
+bool setStaticSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                            const StaticSubscription_t *pxTable,
+                            size_t xNumEntries);
+
+/**
+ * @brief Get the table of static subscriptions set with setStaticSubscriptions(),
+ * through registerStaticSubscriptions() for the MQTT agent.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[out] pxNumEntries Set to the number of entries of the table.
+ *
+ * @return The table, or NULL if none was set.
+ */
+const StaticSubscription_t *getStaticSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                                                   size_t *pxNumEntries);
+
 /**
  * @brief Handle incoming publishes by invoking the callbacks registered
  * for the incoming publish's topic filter.
  *
+ * Filters without wildcards are resolved with a single hash of the topic name.
+ * Filters with wildcards are looked up in the topic trie one topic level at a
+ * time, so the cost depends on the depth of the topic rather than on the number
+ * of subscriptions. With SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES set, topic
+ * names seen recently skip the lookup altogether. Of the members of a shared
+ * subscription, only the one served the longest time ago is invoked.
+ *
  * @param[in] pxSubscriptionList  The pointer to the subscription list array.
  * @param[in] pxPublishInfo Info of incoming publish.
  *
@@ -130,6 +676,54 @@ void removeSubscription(SubscriptionElement_t *pxSubscriptionList,
 bool handleIncomingPublishes(SubscriptionElement_t *pxSubscriptionList,
                              MQTTPublishInfo_t *pxPublishInfo);
 
+/**
+ * @brief Route an incoming publish like handleIncomingPublishes(), handing
+ * each delivery to a hook rather than invoking the callback of the subscriber.
+ *
+ * The subscribers are selected exactly as by handleIncomingPublishes(), shared
+ * subscriptions taking their turn, so the hook can queue the deliveries to be
+ * made by other tasks. The same rules apply: only one task may route publishes
+ * at a time. Subscribers taking batches are called with a batch of one when the
+ * hook does not take the delivery over, as by handleIncomingPublishes().
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxPublishInfo Info of incoming publish.
+ * @param[in] pxHook Called for each subscriber, or NULL to invoke the callbacks.
+ * @param[in] pvHookContext Passed to pxHook.
+ *
+ * @return `true` if the publish matched a subscriber; `false` otherwise.
+ */
+bool deliverIncomingPublishes(SubscriptionElement_t *pxSubscriptionList,
+                              MQTTPublishInfo_t *pxPublishInfo,
+                              DeliveryHook_t pxHook,
+                              void *pvHookContext);
+
+/**
+ * @brief Copy the next registered subscription out of the subscription store.
+ *
+ * Start with *pulSlot set to 0 and call again until `false` is returned to
+ * visit every subscription. The copy is taken under the lock of the store, so
+ * it stays consistent while other tasks add and remove subscriptions.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in,out] pulSlot Slot to start looking at, set past the slot returned.
+ * @param[out] pxSubscription Filled with the subscription found.
+ *
+ * @return `true` if a subscription was copied, `false` if there are no more.
+ */
+bool getSubscription(SubscriptionElement_t *pxSubscriptionList,
+                     uint32_t *pulSlot,
+                     SubscriptionElement_t *pxSubscription);
+
+/**
+ * @brief Get the usage counters of the subscription store.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[out] pxStats Filled with the counters.
+ */
+void getSubscriptionStats(SubscriptionElement_t *pxSubscriptionList,
+                          SubscriptionStats_t *pxStats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,262 @@
+/**
+ * @file core_mqtt_agent_subscriber_queue.h
+ * @brief Bounded queues and latest-value mailboxes of incoming publishes, one
+ * per subscriber.
+ *
+ * A subscriber queue is subscribed with subscriberQueueCallback() as the
+ * callback and the queue as its context:
+ *
+ * @code{c}
+ * static SubscriberQueue_t xQueue;
+ * SubscriptionRequest_t xRequest = { "cmd/#", 5, MQTTQoS1, subscriberQueueCallback, &xQueue };
+ *
+ * createSubscriberQueue(&xQueue, 8, SUBSCRIBER_QUEUE_DROP_OLDEST, 0);
+ * subscribeToTopics(&xRequest, 1);
+ *
+ * for (;;) {
+ *     SubscriberMessage_t *pxMessage = receiveSubscriberMessage(&xQueue, portMAX_DELAY);
+ *     // pxMessage->xPublishInfo stays valid until released.
+ *     releaseSubscriberMessage(pxMessage);
+ * }
+ * @endcode
+ *
+ * Each publish is queued with a lease, see leasePublish(), so that the copy the
+ * dispatch makes for a pool, or for the first lease taken on the agent task, is
+ * shared rather than copied again. The consumer reads it in place until it
+ * releases it. A publish waiting in the queue keeps its slab of the receive
+ * buffer pool, and the PUBACK held for a subscriber added with
+ * SubscriptionRequest_t::xManualAck, until then.
+ *
+ * A subscriber mailbox is subscribed the same way with subscriberMailboxCallback()
+ * for state topics, where only the newest value matters. It keeps one publish
+ * per topic, a new publish replacing the one not yet received, so that a slow
+ * consumer bounds the memory used and only sees the latest state of each topic:
+ *
+ * @code{c}
+ * static SubscriberMailbox_t xMailbox;
+ * SubscriptionRequest_t xRequest = { "state/#", 7, MQTTQoS1, subscriberMailboxCallback, &xMailbox };
+ *
+ * createSubscriberMailbox(&xMailbox, 16);
+ * subscribeToTopics(&xRequest, 1);
+ *
+ * for (;;) {
+ *     SubscriberMessage_t *pxMessage = receiveMailboxMessage(&xMailbox, portMAX_DELAY);
+ *     releaseSubscriberMessage(pxMessage);
+ * }
+ * @endcode
+ */
+#ifndef CORE_MQTT_AGENT_SUBSCRIBER_QUEUE_H
+#define CORE_MQTT_AGENT_SUBSCRIBER_QUEUE_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "core_mqtt.h"
+
+#include "core_mqtt_agent_dispatch.h"
+
+/**
+ * @brief What a subscriber queue does with a publish when it is full.
+ */
+typedef enum subscriberQueuePolicy {
+    SUBSCRIBER_QUEUE_DROP_OLDEST, /**< Drop the oldest publish waiting to make room. */
+    SUBSCRIBER_QUEUE_DROP_NEWEST, /**< Drop the incoming publish. */
+    SUBSCRIBER_QUEUE_BLOCK        /**< Wait for room up to the block time, then drop the incoming publish. */
+} SubscriberQueuePolicy_t;
+
+/**
+ * @brief A publish taken from a subscriber queue.
+ *
+ * Its topic name and payload are those of the lease it holds.
+ */
+typedef struct subscriberMessage {
+    MQTTPublishInfo_t xPublishInfo; /**< The publish, valid until released. */
+    PublishLease_t *pxLease;        /**< Lease on the publish. */
+} SubscriberMessage_t;
+
+/**
+ * @brief A bounded queue of publishes, set up with createSubscriberQueue().
+ *
+ * The fields are maintained by the subscriber queue functions and must not be
+ * modified by the application.
+ */
+typedef struct subscriberQueue {
+    QueueHandle_t xMessages;         /**< Pointers to the SubscriberMessage_t waiting. */
+    SubscriberQueuePolicy_t xPolicy; /**< Policy when full. */
+    TickType_t xBlockTime;           /**< Time to wait for room with SUBSCRIBER_QUEUE_BLOCK. */
+    uint32_t ulQueued;               /**< Publishes queued. */
+    uint32_t ulDropped;              /**< Publishes dropped, by the policy or out of memory. */
+} SubscriberQueue_t;
+
+/**
+ * @brief The slot of a subscriber mailbox for one topic.
+ */
+typedef struct subscriberMailboxSlot {
+    char *pcTopicName;               /**< Copy of the topic the slot is for, or NULL if unused. */
+    uint16_t usTopicNameLength;      /**< Length of the topic. */
+    SubscriberMessage_t *pxMessage;  /**< Latest publish not yet received, or NULL. */
+} SubscriberMailboxSlot_t;
+
+/**
+ * @brief A mailbox keeping the latest publish of each topic, set up with
+ * createSubscriberMailbox().
+ *
+ * The fields are maintained by the subscriber mailbox functions and must not
+ * be modified by the application.
+ */
+typedef struct subscriberMailbox {
+    SubscriberMailboxSlot_t *pxSlots; /**< One slot per topic. */
+    UBaseType_t uxSlots;              /**< Number of slots. */
+    QueueHandle_t xReady;             /**< Indices of the slots that went from empty to holding a publish. */
+    uint32_t ulQueued;                /**< Publishes put in a slot. */
+    uint32_t ulCoalesced;             /**< Publishes replaced by a newer one before being received. */
+    uint32_t ulDropped;               /**< Publishes dropped, for want of a free slot or out of memory. */
+} SubscriberMailbox_t;
+
+/**
+ * @brief Counters of a subscriber queue.
+ */
+typedef struct subscriberQueueStats {
+    uint32_t ulQueued;  /**< Publishes queued. */
+    uint32_t ulDropped; /**< Publishes dropped, by the policy or out of memory. */
+    uint32_t ulWaiting; /**< Publishes currently waiting to be received. */
+} SubscriberQueueStats_t;
+
+/**
+ * @brief Counters of a subscriber mailbox.
+ */
+typedef struct subscriberMailboxStats {
+    uint32_t ulQueued;    /**< Publishes put in a slot. */
+    uint32_t ulCoalesced; /**< Publishes replaced by a newer one before being received. */
+    uint32_t ulDropped;   /**< Publishes dropped, for want of a free slot or out of memory. */
+    uint32_t ulWaiting;   /**< Topics currently holding a publish to be received. */
+} SubscriberMailboxStats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Set up a subscriber queue.
+ *
+ * @param[out] pxQueue The queue, which must stay in scope until deleted.
+ * @param[in] uxLength Most publishes waiting to be received.
+ * @param[in] xPolicy What to do with a publish when the queue is full.
+ * @param[in] xBlockTime Time to wait for room with SUBSCRIBER_QUEUE_BLOCK. The
+ * task delivering the publish waits, so a queue that blocks should belong to a
+ * subscriber of a dispatch pool rather than hold up the agent task.
+ *
+ * @return `true` if the queue was created, `false` if the parameters are invalid
+ * or out of memory.
+ */
+bool createSubscriberQueue(SubscriberQueue_t *pxQueue,
+                           UBaseType_t uxLength,
+                           SubscriberQueuePolicy_t xPolicy,
+                           TickType_t xBlockTime);
+
+/**
+ * @brief Delete a subscriber queue and the publishes still waiting in it.
+ *
+ * The queue must have been unsubscribed first, and its dispatch pool drained.
+ *
+ * @param[in] pxQueue The queue.
+ */
+void deleteSubscriberQueue(SubscriberQueue_t *pxQueue);
+
+/**
+ * @brief Callback to subscribe with, the SubscriberQueue_t being its context.
+ *
+ * @param[in] pvIncomingPublishCallbackContext The SubscriberQueue_t.
+ * @param[in] pxPublishInfo The publish to lease into the queue.
+ */
+void subscriberQueueCallback(void *pvIncomingPublishCallbackContext,
+                             MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Take the oldest publish from a subscriber queue.
+ *
+ * @param[in] pxQueue The queue.
+ * @param[in] xTicksToWait Time to wait for a publish.
+ *
+ * @return The publish, to be released with releaseSubscriberMessage(), or NULL
+ * if none arrived in time.
+ */
+SubscriberMessage_t *receiveSubscriberMessage(SubscriberQueue_t *pxQueue,
+                                              TickType_t xTicksToWait);
+
+/**
+ * @brief Release a publish taken with receiveSubscriberMessage().
+ *
+ * @param[in] pxMessage The publish.
+ */
+void releaseSubscriberMessage(SubscriberMessage_t *pxMessage);
+
+/**
+ * @brief Get the counters of a subscriber queue.
+ *
+ * @param[in] pxQueue The queue.
+ * @param[out] pxStats Filled with the counters.
+ */
+void getSubscriberQueueStats(SubscriberQueue_t *pxQueue,
+                             SubscriberQueueStats_t *pxStats);
+
+/**
+ * @brief Set up a subscriber mailbox.
+ *
+ * @param[out] pxMailbox The mailbox, which must stay in scope until deleted.
+ * @param[in] uxTopics Most topics the mailbox keeps a publish for. The slot of
+ * a topic is kept once taken, and the publishes of further topics are dropped.
+ *
+ * @return `true` if the mailbox was created, `false` if the parameters are
+ * invalid or out of memory.
+ */
+bool createSubscriberMailbox(SubscriberMailbox_t *pxMailbox,
+                             UBaseType_t uxTopics);
+
+/**
+ * @brief Delete a subscriber mailbox and the publishes still waiting in it.
+ *
+ * The mailbox must have been unsubscribed first, and its dispatch pool drained.
+ *
+ * @param[in] pxMailbox The mailbox.
+ */
+void deleteSubscriberMailbox(SubscriberMailbox_t *pxMailbox);
+
+/**
+ * @brief Callback to subscribe with, the SubscriberMailbox_t being its context.
+ *
+ * A subscriber is only ever called by one task at a time, which this callback
+ * relies on.
+ *
+ * @param[in] pvIncomingPublishCallbackContext The SubscriberMailbox_t.
+ * @param[in] pxPublishInfo The publish to lease into the slot of its topic.
+ */
+void subscriberMailboxCallback(void *pvIncomingPublishCallbackContext,
+                               MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Take the latest publish of a topic from a subscriber mailbox, the
+ * topics being taken in the order they got a publish.
+ *
+ * @param[in] pxMailbox The mailbox.
+ * @param[in] xTicksToWait Time to wait for a publish.
+ *
+ * @return The publish, to be released with releaseSubscriberMessage(), or NULL
+ * if none arrived in time.
+ */
+SubscriberMessage_t *receiveMailboxMessage(SubscriberMailbox_t *pxMailbox,
+                                           TickType_t xTicksToWait);
+
+/**
+ * @brief Get the counters of a subscriber mailbox.
+ *
+ * @param[in] pxMailbox The mailbox.
+ * @param[out] pxStats Filled with the counters.
+ */
+void getSubscriberMailboxStats(SubscriberMailbox_t *pxMailbox,
+                               SubscriberMailboxStats_t *pxStats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* CORE_MQTT_AGENT_SUBSCRIBER_QUEUE_H */
@@ -104,7 +104,8 @@ extern const char client_key_end[] asm("_binary_client_key_end");
 /**
  * @brief Dimensions the buffer used to serialize and deserialize MQTT packets.
  * @note Specified in bytes.  Must be large enough to hold the maximum
- * anticipated MQTT payload.
+ * anticipated MQTT payload, unless the larger publishes are streamed, see
+ * core_mqtt_agent_stream.h.
  */
 #ifndef CONFIG_MQTT_AGENT_NETWORK_BUFFER_SIZE
 #define MQTT_AGENT_NETWORK_BUFFER_SIZE    ( 5000 )
@@ -262,10 +263,53 @@ extern const char client_key_end[] asm("_binary_client_key_end");
 #define MQTT_AGENT_COMMAND_QUEUE_LENGTH              ( CONFIG_MQTT_AGENT_COMMAND_QUEUE_LENGTH )
 #endif
 
+/**
+ * @brief Time subscribeToTopics() and unsubscribeFromTopics() wait for the
+ * command queue and then again for the broker acknowledgement.
+ */
+#ifndef CONFIG_MQTT_AGENT_SUBSCRIBE_TIMEOUT_MS
+#define MQTT_AGENT_SUBSCRIBE_TIMEOUT_MS              ( 10000U )
+#else
+#define MQTT_AGENT_SUBSCRIBE_TIMEOUT_MS              ( CONFIG_MQTT_AGENT_SUBSCRIBE_TIMEOUT_MS )
+#endif
+
+/**
+ * @brief Least time between two warnings about unsolicited publishes, those
+ * received in between being summarised in the next one.
+ */
+#ifndef CONFIG_MQTT_AGENT_UNSOLICITED_LOG_INTERVAL_MS
+#define MQTT_AGENT_UNSOLICITED_LOG_INTERVAL_MS       ( 10000U )
+#else
+#define MQTT_AGENT_UNSOLICITED_LOG_INTERVAL_MS       ( CONFIG_MQTT_AGENT_UNSOLICITED_LOG_INTERVAL_MS )
+#endif
+
+/**
+ * @brief Number of topic hashes the unsolicited publishes are counted under.
+ */
+#ifndef CONFIG_MQTT_AGENT_UNSOLICITED_TOPICS
+#define MQTT_AGENT_UNSOLICITED_TOPICS                ( 8U )
+#else
+#define MQTT_AGENT_UNSOLICITED_TOPICS                ( CONFIG_MQTT_AGENT_UNSOLICITED_TOPICS )
+#endif
+
+/**
+ * @brief Most QoS 1 publishes whose PUBACK is held for their subscribers at a
+ * time, past which the agent stops reading the socket until some are released.
+ */
+#ifndef CONFIG_MQTT_AGENT_MAX_UNACKED_PUBLISHES
+#define MQTT_AGENT_MAX_UNACKED_PUBLISHES             ( 16U )
+#else
+#define MQTT_AGENT_MAX_UNACKED_PUBLISHES             ( CONFIG_MQTT_AGENT_MAX_UNACKED_PUBLISHES )
+#endif
+
 /* ------------------------------------- */
 
 #include "freertos/event_groups.h"
 
+#include "core_mqtt_agent_subs_manager.h"
+#include "core_mqtt_agent_dispatch.h"
+#include "core_mqtt_agent_subscriber_queue.h"
+
 static EventGroupHandle_t xMQTTAgentEventGroupHandle;
 
 /*
@@ -273,6 +317,36 @@ static EventGroupHandle_t xMQTTAgentEventGroupHandle;
  */
 #define MQTT_AGENT_CONNECTED_FLAG  ( 1 << 0 )
 
+/**
+ * @brief Unsolicited publishes received on the topics of a hash.
+ */
+typedef struct unsolicitedTopicStats {
+    uint32_t ulTopicHash; /**< Hash of the topic, see getUnsolicitedTopicHash(). */
+    uint32_t ulCount;     /**< Publishes received, 0 for an entry not used yet. */
+} UnsolicitedTopicStats_t;
+
+/**
+ * @brief Counters of the publishes no subscriber matched.
+ */
+typedef struct unsolicitedPublishStats {
+    uint32_t ulTotal;                                               /**< Publishes received. */
+    uint32_t ulOtherTopics;                                         /**< Publishes on topics beyond those of xTopics. */
+    UnsolicitedTopicStats_t xTopics[MQTT_AGENT_UNSOLICITED_TOPICS]; /**< Publishes of the first topic hashes seen. */
+} UnsolicitedPublishStats_t;
+
+/**
+ * @brief Counters of the PUBACKs held for subscribers added with
+ * SubscriptionRequest_t::xManualAck set.
+ */
+typedef struct deferredAckStats {
+    uint32_t ulDeferred;   /**< PUBACKs held. */
+    uint32_t ulSent;       /**< PUBACKs sent once their publish was released. */
+    uint32_t ulStale;      /**< PUBACKs dropped, the connection having been lost meanwhile. */
+    uint32_t ulOverCap;    /**< PUBACKs held past MQTT_AGENT_MAX_UNACKED_PUBLISHES, of publishes read before the reads paused. */
+    uint32_t ulUnacked;    /**< PUBACKs currently held. */
+    uint32_t ulWakeFailed; /**< Releases that could not wake the agent task to send their PUBACK. */
+} DeferredAckStats_t;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -295,6 +369,79 @@ void waitForMQTTAgentConnection();
  */
 void initMQTTAgent();
 
+/*
+ * @brief Subscribe to a batch of topic filters with a single SUBSCRIBE packet.
+ *
+ * Only the topic filters nobody is subscribed to yet are sent to the broker;
+ * the others just get another callback. If a packet is sent, the call blocks
+ * until the broker acknowledges it, and the callbacks of the batch are then
+ * registered together, only if the broker granted every topic filter. The topic
+ * filter strings must stay in scope until unsubscribed, unless
+ * SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE is set.
+ *
+ * @return `true` if the callbacks were registered, `false` otherwise. A batch
+ * that timed out is never registered: the topic filters the broker grants it
+ * later are unsubscribed from, unless another task subscribed to them since.
+ */
+bool subscribeToTopics(const SubscriptionRequest_t *pxSubscriptions,
+                       size_t xNumSubscriptions);
+
+/*
+ * @brief Register the table of subscriptions known at build time.
+ *
+ * Must be called before connectToMQTTAndStartAgent(). The topic filters of the
+ * table are subscribed to on every connection without a session present, and
+ * their publishes are delivered without any runtime registration. The table,
+ * declared with STATIC_SUBSCRIPTION(), is used in place and can be const.
+ *
+ * @return `true` if the table was registered, `false` otherwise.
+ */
+bool registerStaticSubscriptions(const StaticSubscription_t *pxTable,
+                                 size_t xNumEntries);
+
+/*
+ * @brief Remove a batch of subscribers, unsubscribing with a single
+ * UNSUBSCRIBE packet from the topic filters left without subscriber.
+ *
+ * Each request removes the callback registered with its callback and context
+ * only, right away. If a packet is sent, the call blocks until the broker
+ * acknowledges it.
+ *
+ * @return `true` if the subscribers were removed and any UNSUBSCRIBE was
+ * acknowledged, `false` otherwise.
+ */
+bool unsubscribeFromTopics(const SubscriptionRequest_t *pxSubscriptions,
+                           size_t xNumSubscriptions);
+
+/*
+ * @brief Set the handler of the publishes no subscriber matched.
+ *
+ * Must be called before connectToMQTTAndStartAgent(). The handler is called on
+ * the agent task, like a callback of the subscription manager, in place of the
+ * default handler which logs a warning at most every
+ * MQTT_AGENT_UNSOLICITED_LOG_INTERVAL_MS. The publishes are counted either way.
+ * Pass NULL to restore the default handler.
+ */
+void setUnsolicitedPublishHandler(IncomingPubCallback_t pxHandler,
+                                  void *pvHandlerContext);
+
+/*
+ * @brief Get the counters of the publishes no subscriber matched.
+ */
+void getUnsolicitedPublishStats(UnsolicitedPublishStats_t *pxStats);
+
+/*
+ * @brief Get the counters of the PUBACKs held for their subscribers.
+ */
+void getDeferredAckStats(DeferredAckStats_t *pxStats);
+
+/*
+ * @brief Hash a topic the way the unsolicited publishes are counted under.
+ *
+ * @return The FNV-1a hash of the topic name.
+ */
+uint32_t getUnsolicitedTopicHash(const char *pcTopicName,
+                                 uint16_t usTopicNameLength);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,1071 @@
+/**
+ * @file core_mqtt_agent_dispatch.c
+ * @brief Delivery of incoming publishes by pools of worker tasks.
+ */
+
+/* Standard includes. */
+#include <stdio.h>
+#include <string.h>
+
+/* Kernel includes. */
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "core_mqtt_agent_dispatch.h"
+
+/**
+ * @brief Logging tag.
+ */
+static const char *TAG = "coreMQTTAgentDispatch";
+
+/**
+ * @brief Slab of a copy allocated from the heap.
+ */
+#define DISPATCH_NO_SLAB    0xFFU
+
+/**
+ * @brief A copy of an incoming publish shared by the deliveries queued for it
+ * and the leases taken on it.
+ *
+ * The topic name and the payload follow the structure in the same slab or heap
+ * allocation. Each queued delivery and each lease holds a reference, and so
+ * does the agent task while it is still routing the publish, so that the copy
+ * is freed by whoever is done with it last. A publish whose PUBACK is held
+ * has a non-zero ulAckToken, handed to the ack handler by the last one.
+ */
+typedef struct dispatchMessage {
+    uint32_t ulReferences;
+    uint32_t ulAckToken;
+    uint8_t ucSlab;
+    MQTTPublishInfo_t xPublishInfo;
+} DispatchMessage_t;
+
+/**
+ * @brief The publish being routed by dispatchIncomingPublishes(), copied by
+ * the first delivery queued or lease taken for it, or when its PUBACK is held.
+ */
+typedef struct dispatchRoute {
+    DispatchMessage_t *pxMessage;
+    uint32_t ulAckToken;
+    bool xAckDeferred;
+} DispatchRoute_t;
+
+#if MQTT_AGENT_DISPATCH_SLABS > 0
+
+/**
+ * @brief A slab of the receive buffer pool, holding a copy and its data.
+ */
+typedef union dispatchSlab {
+    DispatchMessage_t xMessage;
+    uint8_t ucBytes[MQTT_AGENT_DISPATCH_SLAB_SIZE];
+} DispatchSlab_t;
+
+/**
+ * @brief The receive buffer pool.
+ */
+static DispatchSlab_t xDispatchSlabs[MQTT_AGENT_DISPATCH_SLABS];
+
+/**
+ * @brief One bit per slab, set while the slab holds a copy.
+ */
+static uint32_t ulDispatchSlabsInUse = 0U;
+
+#endif /* if MQTT_AGENT_DISPATCH_SLABS > 0 */
+
+/**
+ * @brief The publish the agent task is calling callbacks with, and its route.
+ *
+ * The publish info is set last and cleared first, so that a task finding its
+ * publish info there is the agent task, within a callback, and can use the
+ * route.
+ */
+static const MQTTPublishInfo_t *pxInlinePublishInfo = NULL;
+static DispatchRoute_t *pxInlineRoute = NULL;
+
+/**
+ * @brief Handler of the publishes whose PUBACK was held.
+ */
+static PublishAckHandler_t pxPublishAckHandler = NULL;
+
+/**
+ * @brief The publishes collected for a subscriber taking batches, each holding
+ * a reference to its copy. The entry is free while usCount is 0.
+ */
+typedef struct dispatchBatch {
+    IncomingPubBatchCallback_t pxBatchCallback;
+    void *pvIncomingPublishCallbackContext;
+    uint8_t ucDispatchPool;
+    uint8_t ucPriorityClass;
+    uint16_t usCount;
+    DispatchMessage_t *pxMessages[MQTT_AGENT_DISPATCH_BATCH_SIZE];
+} DispatchBatch_t;
+
+/**
+ * @brief The batches being collected, only used by the agent task.
+ */
+static DispatchBatch_t xDispatchBatches[MQTT_AGENT_DISPATCH_BATCH_SUBSCRIBERS];
+
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+
+/**
+ * @brief A delivery queued to a worker.
+ *
+ * A delivery without callback is a marker queued by drainDispatchPool(), whose
+ * context is the semaphore to give once the worker gets to it. A delivery to a
+ * capture callback owns a copy of its match, the matched filter following it
+ * in the same allocation. A batch, with usBatchCount set, owns an array of its
+ * copies, each holding a reference.
+ */
+typedef struct dispatchJob {
+    union {
+        IncomingPubCallback_t pxIncomingPublishCallback;
+        IncomingPubCaptureCallback_t pxCaptureCallback;
+        IncomingPubBatchCallback_t pxBatchCallback;
+    };
+    void *pvIncomingPublishCallbackContext;
+    union {
+        SubscriptionMatch_t *pxMatch;
+        DispatchMessage_t **ppxBatch;
+    };
+    DispatchMessage_t *pxMessage;
+    uint16_t usBatchCount;
+    uint32_t ulQueuedAtUs;
+} DispatchJob_t;
+
+/**
+ * @brief Counters of the deliveries of a class made by a worker, written by
+ * that worker only.
+ */
+typedef struct dispatchLatency {
+    uint32_t ulDelivered;
+    uint32_t ulMaxLatencyUs;
+    uint32_t ulLatencyBuckets[MQTT_AGENT_DISPATCH_LATENCY_BUCKETS];
+} DispatchLatency_t;
+
+/**
+ * @brief A worker task and its queues of deliveries, one per priority class.
+ *
+ * xWork counts the deliveries waiting across the queues, so that the worker
+ * can block on all of them at once. A task notification would do the same
+ * but is left to the callbacks.
+ */
+typedef struct dispatchWorker {
+    QueueHandle_t xQueues[MQTT_AGENT_DISPATCH_PRIORITY_CLASSES];
+    SemaphoreHandle_t xWork;
+    TaskHandle_t xTask;
+    DispatchLatency_t xLatency[MQTT_AGENT_DISPATCH_PRIORITY_CLASSES];
+    const MQTTPublishInfo_t *pxDelivering; /**< Publish info of the callback being called, for leasePublish(). */
+    DispatchMessage_t *pxDeliveringMessage;
+} DispatchWorker_t;
+
+/**
+ * @brief A dispatch pool.
+ *
+ * ucWorkers stays 0 until every worker has been started, so the agent task
+ * never queues to a pool being started.
+ */
+typedef struct dispatchPool {
+    uint8_t ucWorkers;
+    bool xClaimed;
+    uint32_t ulQueued[MQTT_AGENT_DISPATCH_PRIORITY_CLASSES];
+    uint32_t ulDropped[MQTT_AGENT_DISPATCH_PRIORITY_CLASSES];
+    DispatchWorker_t xWorkers[MQTT_AGENT_DISPATCH_MAX_WORKERS];
+} DispatchPool_t;
+
+/**
+ * @brief The dispatch pools.
+ */
+static DispatchPool_t xDispatchPools[MQTT_AGENT_DISPATCH_POOLS];
+
+/**
+ * @brief Guards the claim of a pool by startDispatchPool().
+ */
+static portMUX_TYPE xDispatchPoolSpinlock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief The queue found past the high-water mark, and its length, only used
+ * by the agent task.
+ */
+static QueueHandle_t xSaturatedQueue = NULL;
+static UBaseType_t uxSaturatedQueueLength = 0U;
+
+#endif /* if MQTT_AGENT_DISPATCH_POOLS > 0 */
+
+/*-----------------------------------------------------------*/
+
+#if MQTT_AGENT_DISPATCH_SLABS > 0
+
+static DispatchMessage_t *prvTakeSlab(void) {
+    DispatchMessage_t *pxMessage = NULL;
+    uint32_t ulInUse = __atomic_load_n(&ulDispatchSlabsInUse, __ATOMIC_RELAXED);
+    uint8_t ucSlab = 0U;
+    bool xTaken = false;
+
+    while ((xTaken == false) && (ucSlab < MQTT_AGENT_DISPATCH_SLABS)) {
+        if ((ulInUse & (1UL << ucSlab)) != 0U) {
+            ucSlab++;
+        } else {
+            /* On failure ulInUse is reloaded and the same slab tried again. */
+            xTaken = __atomic_compare_exchange_n(&ulDispatchSlabsInUse, &ulInUse, ulInUse | (1UL << ucSlab),
+                                                 false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (xTaken) {
+        pxMessage = &(xDispatchSlabs[ucSlab].xMessage);
+        pxMessage->ucSlab = ucSlab;
+    }
+
+    return pxMessage;
+}
+
+#endif /* if MQTT_AGENT_DISPATCH_SLABS > 0 */
+
+/*-----------------------------------------------------------*/
+
+static DispatchMessage_t *prvCopyMessage(const MQTTPublishInfo_t *pxPublishInfo) {
+    DispatchMessage_t *pxMessage = NULL;
+    size_t xSize = sizeof(DispatchMessage_t) + pxPublishInfo->topicNameLength + pxPublishInfo->payloadLength;
+    char *pcTopicName;
+
+#if MQTT_AGENT_DISPATCH_SLABS > 0
+    if (xSize <= sizeof(DispatchSlab_t)) {
+        pxMessage = prvTakeSlab();
+    }
+#endif
+
+    /* Publishes too large for a slab, or arriving while all are in use, are
+     * copied to the heap. */
+    if (pxMessage == NULL) {
+        pxMessage = (DispatchMessage_t *) pvPortMalloc(xSize);
+
+        if (pxMessage != NULL) {
+            pxMessage->ucSlab = DISPATCH_NO_SLAB;
+        }
+    }
+
+    if (pxMessage != NULL) {
+        pcTopicName = (char *) (pxMessage + 1);
+        memcpy(pcTopicName, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
+
+        if (pxPublishInfo->payloadLength > 0U) {
+            memcpy(pcTopicName + pxPublishInfo->topicNameLength, pxPublishInfo->pPayload,
+                   pxPublishInfo->payloadLength);
+        }
+
+        pxMessage->ulReferences = 1U;
+        pxMessage->ulAckToken = 0U;
+        pxMessage->xPublishInfo = *pxPublishInfo;
+        pxMessage->xPublishInfo.pTopicName = pcTopicName;
+        pxMessage->xPublishInfo.pPayload = pcTopicName + pxPublishInfo->topicNameLength;
+    }
+
+    return pxMessage;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvReleaseMessage(DispatchMessage_t *pxMessage) {
+    uint32_t ulAckToken;
+
+    if (__atomic_sub_fetch(&(pxMessage->ulReferences), 1U, __ATOMIC_ACQ_REL) == 0U) {
+        ulAckToken = pxMessage->ulAckToken;
+
+#if MQTT_AGENT_DISPATCH_SLABS > 0
+        if (pxMessage->ucSlab != DISPATCH_NO_SLAB) {
+            (void) __atomic_fetch_and(&ulDispatchSlabsInUse, ~(1UL << pxMessage->ucSlab), __ATOMIC_RELEASE);
+        } else {
+            vPortFree(pxMessage);
+        }
+#else
+        vPortFree(pxMessage);
+#endif
+
+        /* Everyone is done with the publish, it can be acknowledged. */
+        if (ulAckToken != 0U) {
+            pxPublishAckHandler(ulAckToken);
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCallBatch(IncomingPubBatchCallback_t pxBatchCallback,
+                         void *pvIncomingPublishCallbackContext,
+                         DispatchMessage_t *const *ppxMessages,
+                         uint16_t usCount) {
+    MQTTPublishInfo_t xPublishes[MQTT_AGENT_DISPATCH_BATCH_SIZE];
+    uint16_t usIndex;
+
+    /* Each callback gets its own publish infos, only the topic names and the
+     * payloads are shared. */
+    for (usIndex = 0U; usIndex < usCount; usIndex++) {
+        xPublishes[usIndex] = ppxMessages[usIndex]->xPublishInfo;
+    }
+
+    pxBatchCallback(pvIncomingPublishCallbackContext, xPublishes, usCount);
+
+    for (usIndex = 0U; usIndex < usCount; usIndex++) {
+        prvReleaseMessage(ppxMessages[usIndex]);
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+
+/*-----------------------------------------------------------*/
+
+static uint8_t prvWorkerOf(IncomingPubCallback_t pxIncomingPublishCallback,
+                           void *pvIncomingPublishCallbackContext,
+                           uint8_t ucWorkers) {
+    uint32_t ulKey = (uint32_t) (((uintptr_t) pxIncomingPublishCallback >> 2U) ^
+                                 ((uintptr_t) pvIncomingPublishCallbackContext >> 2U));
+
+    /* Fold the upper bits in, contexts are often allocated close together. */
+    ulKey ^= ulKey >> 16U;
+
+    return (uint8_t) (ulKey % ucWorkers);
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRecordLatency(DispatchLatency_t *pxLatency,
+                             uint32_t ulQueuedAtUs) {
+    uint32_t ulLatencyUs = (uint32_t) esp_timer_get_time() - ulQueuedAtUs;
+    uint8_t ucBucket;
+
+    if (ulLatencyUs <= 1000U) {
+        ucBucket = 0U;
+    } else if (ulLatencyUs <= 10000U) {
+        ucBucket = 1U;
+    } else if (ulLatencyUs <= 100000U) {
+        ucBucket = 2U;
+    } else {
+        ucBucket = 3U;
+    }
+
+    /* Relaxed stores, the counters are read by getDispatchPoolStats(). */
+    if (ulLatencyUs > pxLatency->ulMaxLatencyUs) {
+        __atomic_store_n(&(pxLatency->ulMaxLatencyUs), ulLatencyUs, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&(pxLatency->ulLatencyBuckets[ucBucket]), pxLatency->ulLatencyBuckets[ucBucket] + 1U,
+                     __ATOMIC_RELAXED);
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvDispatchWorkerTask(void *pvParameters) {
+    DispatchWorker_t *pxWorker = (DispatchWorker_t *) pvParameters;
+    MQTTPublishInfo_t xPublishInfo;
+    DispatchJob_t xJob;
+    uint8_t ucClass;
+    bool xReceived;
+
+    for (;;) {
+        if (xSemaphoreTake(pxWorker->xWork, portMAX_DELAY) == pdPASS) {
+            /* Every class above is empty before a delivery of a class is taken. */
+            xReceived = false;
+
+            for (ucClass = MQTT_AGENT_DISPATCH_PRIORITY_CLASSES; (xReceived == false) && (ucClass > 0U); ) {
+                ucClass--;
+                xReceived = (xQueueReceive(pxWorker->xQueues[ucClass], &xJob, 0U) == pdPASS);
+            }
+
+            /* Each delivery gives xWork once queued, so one is always found. */
+            if (xReceived == false) {
+                ESP_LOGE(TAG, "No delivery waiting in the queues of a worker.");
+            } else if (xJob.pxIncomingPublishCallback != NULL) {
+                prvRecordLatency(&(pxWorker->xLatency[ucClass]), xJob.ulQueuedAtUs);
+
+                if (xJob.usBatchCount > 0U) {
+                    prvCallBatch(xJob.pxBatchCallback, xJob.pvIncomingPublishCallbackContext, xJob.ppxBatch,
+                                 xJob.usBatchCount);
+                    vPortFree(xJob.ppxBatch);
+                } else {
+                    /* Each callback gets its own publish info, only the topic
+                     * name and the payload are shared. */
+                    xPublishInfo = xJob.pxMessage->xPublishInfo;
+                    pxWorker->pxDeliveringMessage = xJob.pxMessage;
+                    __atomic_store_n(&(pxWorker->pxDelivering), &xPublishInfo, __ATOMIC_RELAXED);
+
+                    if (xJob.pxMatch != NULL) {
+                        xJob.pxCaptureCallback(xJob.pvIncomingPublishCallbackContext, &xPublishInfo, xJob.pxMatch);
+                        vPortFree(xJob.pxMatch);
+                    } else {
+                        xJob.pxIncomingPublishCallback(xJob.pvIncomingPublishCallbackContext, &xPublishInfo);
+                    }
+
+                    __atomic_store_n(&(pxWorker->pxDelivering), NULL, __ATOMIC_RELAXED);
+                    prvReleaseMessage(xJob.pxMessage);
+                }
+
+                __atomic_store_n(&(pxWorker->xLatency[ucClass].ulDelivered),
+                                 pxWorker->xLatency[ucClass].ulDelivered + 1U, __ATOMIC_RELAXED);
+            } else {
+                xSemaphoreGive((SemaphoreHandle_t) xJob.pvIncomingPublishCallbackContext);
+            }
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static SubscriptionMatch_t *prvCopyMatch(const SubscriptionMatch_t *pxMatch) {
+    SubscriptionMatch_t *pxCopy;
+
+    /* The subscription, and its filter, may be removed before the delivery. */
+    pxCopy = (SubscriptionMatch_t *) pvPortMalloc(sizeof(SubscriptionMatch_t) + pxMatch->usTopicFilterLength);
+
+    if (pxCopy != NULL) {
+        *pxCopy = *pxMatch;
+        memcpy(pxCopy + 1, pxMatch->pcTopicFilterString, pxMatch->usTopicFilterLength);
+        pxCopy->pcTopicFilterString = (const char *) (pxCopy + 1);
+    }
+
+    return pxCopy;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvQueueJob(DispatchWorker_t *pxWorker,
+                        uint8_t ucClass,
+                        const DispatchJob_t *pxJob,
+                        TickType_t xTicksToWait) {
+    bool xQueued = (xQueueSendToBack(pxWorker->xQueues[ucClass], pxJob, xTicksToWait) == pdPASS);
+
+    if (xQueued) {
+        /* Cannot overflow, xWork counts up to the room of all the queues. */
+        (void) xSemaphoreGive(pxWorker->xWork);
+    }
+
+    return xQueued;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCheckHighWater(QueueHandle_t xQueue) {
+#if MQTT_AGENT_DISPATCH_HIGH_WATER_PERCENT > 0
+    UBaseType_t uxWaiting = uxQueueMessagesWaiting(xQueue);
+    UBaseType_t uxLength = uxWaiting + uxQueueSpacesAvailable(xQueue);
+
+    if ((xSaturatedQueue == NULL) &&
+        ((uxWaiting * 100U) >= (uxLength * MQTT_AGENT_DISPATCH_HIGH_WATER_PERCENT))) {
+        ESP_LOGD(TAG, "A dispatch queue is %u/%u full, pausing the reads.",
+                 (unsigned int) uxWaiting,
+                 (unsigned int) uxLength);
+        xSaturatedQueue = xQueue;
+        uxSaturatedQueueLength = uxLength;
+    }
+#else
+    (void) xQueue;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvQueueDelivery(void *pvHookContext,
+                             const SubscriptionDelivery_t *pxDelivery,
+                             MQTTPublishInfo_t *pxPublishInfo) {
+    DispatchRoute_t *pxRoute = (DispatchRoute_t *) pvHookContext;
+    DispatchPool_t *pxPool = NULL;
+    DispatchWorker_t *pxWorker;
+    DispatchJob_t xJob;
+    uint8_t ucWorkers = 0U;
+    uint8_t ucClass = pxDelivery->ucPriorityClass;
+    bool xQueued = false;
+
+    if (pxDelivery->ucDispatchPool < MQTT_AGENT_DISPATCH_POOLS) {
+        pxPool = &(xDispatchPools[pxDelivery->ucDispatchPool]);
+        ucWorkers = __atomic_load_n(&(pxPool->ucWorkers), __ATOMIC_ACQUIRE);
+    }
+
+    if (ucClass >= MQTT_AGENT_DISPATCH_PRIORITY_CLASSES) {
+        ucClass = MQTT_AGENT_DISPATCH_PRIORITY_CLASSES - 1U;
+    }
+
+    if (ucWorkers > 0U) {
+        /* The publish is copied once, whatever the number of its subscribers. */
+        if (pxRoute->pxMessage == NULL) {
+            pxRoute->pxMessage = prvCopyMessage(pxPublishInfo);
+        }
+
+        xJob.pxMatch = NULL;
+
+        if ((pxRoute->pxMessage != NULL) && (pxDelivery->pxMatch != NULL)) {
+            xJob.pxMatch = prvCopyMatch(pxDelivery->pxMatch);
+        }
+
+        if ((pxRoute->pxMessage != NULL) &&
+            ((pxDelivery->pxMatch == NULL) || (xJob.pxMatch != NULL))) {
+            xJob.pxIncomingPublishCallback = pxDelivery->pxIncomingPublishCallback;
+            xJob.pvIncomingPublishCallbackContext = pxDelivery->pvIncomingPublishCallbackContext;
+            xJob.pxMessage = pxRoute->pxMessage;
+            xJob.usBatchCount = 0U;
+            xJob.ulQueuedAtUs = (uint32_t) esp_timer_get_time();
+            __atomic_fetch_add(&(xJob.pxMessage->ulReferences), 1U, __ATOMIC_RELAXED);
+
+            pxWorker = &(pxPool->xWorkers[prvWorkerOf(pxDelivery->pxIncomingPublishCallback,
+                                                      pxDelivery->pvIncomingPublishCallbackContext,
+                                                      ucWorkers)]);
+            xQueued = prvQueueJob(pxWorker, ucClass, &xJob, pdMS_TO_TICKS(MQTT_AGENT_DISPATCH_ENQUEUE_TIMEOUT_MS));
+            prvCheckHighWater(pxWorker->xQueues[ucClass]);
+
+            if (xQueued == false) {
+                prvReleaseMessage(xJob.pxMessage);
+                vPortFree(xJob.pxMatch);
+            }
+        }
+
+        if (xQueued) {
+            __atomic_fetch_add(&(pxPool->ulQueued[ucClass]), 1U, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&(pxPool->ulDropped[ucClass]), 1U, __ATOMIC_RELAXED);
+            ESP_LOGW(TAG, "Dropped a publish on %.*s for class %u of dispatch pool %u.",
+                     (int) pxPublishInfo->topicNameLength,
+                     pxPublishInfo->pTopicName,
+                     (unsigned int) ucClass,
+                     (unsigned int) pxDelivery->ucDispatchPool);
+        }
+    }
+
+    /* The subscribers of a pool not started are called on the agent task,
+     * those of a started pool never are, even when their delivery is dropped. */
+    return (ucWorkers > 0U);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvQueueBatch(DispatchBatch_t *pxBatch) {
+    DispatchPool_t *pxPool = NULL;
+    DispatchWorker_t *pxWorker;
+    DispatchJob_t xJob;
+    uint8_t ucWorkers = 0U;
+    uint8_t ucClass = pxBatch->ucPriorityClass;
+    uint16_t usIndex;
+    bool xQueued = false;
+
+    if (pxBatch->ucDispatchPool < MQTT_AGENT_DISPATCH_POOLS) {
+        pxPool = &(xDispatchPools[pxBatch->ucDispatchPool]);
+        ucWorkers = __atomic_load_n(&(pxPool->ucWorkers), __ATOMIC_ACQUIRE);
+    }
+
+    if (ucClass >= MQTT_AGENT_DISPATCH_PRIORITY_CLASSES) {
+        ucClass = MQTT_AGENT_DISPATCH_PRIORITY_CLASSES - 1U;
+    }
+
+    if (ucWorkers > 0U) {
+        /* The job takes the references of the batch over. */
+        xJob.ppxBatch = (DispatchMessage_t **) pvPortMalloc(pxBatch->usCount * sizeof(DispatchMessage_t *));
+
+        if (xJob.ppxBatch != NULL) {
+            memcpy(xJob.ppxBatch, pxBatch->pxMessages, pxBatch->usCount * sizeof(DispatchMessage_t *));
+            xJob.pxBatchCallback = pxBatch->pxBatchCallback;
+            xJob.pvIncomingPublishCallbackContext = pxBatch->pvIncomingPublishCallbackContext;
+            xJob.pxMessage = NULL;
+            xJob.usBatchCount = pxBatch->usCount;
+            xJob.ulQueuedAtUs = (uint32_t) esp_timer_get_time();
+
+            pxWorker = &(pxPool->xWorkers[prvWorkerOf(xJob.pxIncomingPublishCallback,
+                                                      xJob.pvIncomingPublishCallbackContext,
+                                                      ucWorkers)]);
+            xQueued = prvQueueJob(pxWorker, ucClass, &xJob, pdMS_TO_TICKS(MQTT_AGENT_DISPATCH_ENQUEUE_TIMEOUT_MS));
+            prvCheckHighWater(pxWorker->xQueues[ucClass]);
+
+            if (xQueued == false) {
+                vPortFree(xJob.ppxBatch);
+            }
+        }
+
+        if (xQueued) {
+            __atomic_fetch_add(&(pxPool->ulQueued[ucClass]), 1U, __ATOMIC_RELAXED);
+        } else {
+            for (usIndex = 0U; usIndex < pxBatch->usCount; usIndex++) {
+                prvReleaseMessage(pxBatch->pxMessages[usIndex]);
+            }
+
+            __atomic_fetch_add(&(pxPool->ulDropped[ucClass]), 1U, __ATOMIC_RELAXED);
+            ESP_LOGW(TAG, "Dropped a batch of %u publishes for class %u of dispatch pool %u.",
+                     (unsigned int) pxBatch->usCount,
+                     (unsigned int) ucClass,
+                     (unsigned int) pxBatch->ucDispatchPool);
+        }
+    }
+
+    /* As with single deliveries, only the batches of a pool not started are
+     * called back on the agent task. */
+    return (ucWorkers > 0U);
+}
+
+/*-----------------------------------------------------------*/
+
+static DispatchMessage_t *prvFindDelivery(const MQTTPublishInfo_t *pxPublishInfo) {
+    DispatchMessage_t *pxMessage = NULL;
+    DispatchWorker_t *pxWorker;
+    uint8_t ucPool, ucWorker, ucWorkers;
+
+    /* Only the worker calling the callback can find its own publish info. */
+    for (ucPool = 0U; (pxMessage == NULL) && (ucPool < MQTT_AGENT_DISPATCH_POOLS); ucPool++) {
+        ucWorkers = __atomic_load_n(&(xDispatchPools[ucPool].ucWorkers), __ATOMIC_ACQUIRE);
+
+        for (ucWorker = 0U; (pxMessage == NULL) && (ucWorker < ucWorkers); ucWorker++) {
+            pxWorker = &(xDispatchPools[ucPool].xWorkers[ucWorker]);
+
+            if (__atomic_load_n(&(pxWorker->pxDelivering), __ATOMIC_RELAXED) == pxPublishInfo) {
+                pxMessage = pxWorker->pxDeliveringMessage;
+            }
+        }
+    }
+
+    return pxMessage;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvStopWorkers(DispatchPool_t *pxPool) {
+    DispatchWorker_t *pxWorker;
+    uint8_t ucWorker, ucClass;
+
+    for (ucWorker = 0U; ucWorker < MQTT_AGENT_DISPATCH_MAX_WORKERS; ucWorker++) {
+        pxWorker = &(pxPool->xWorkers[ucWorker]);
+
+        if (pxWorker->xTask != NULL) {
+            vTaskDelete(pxWorker->xTask);
+            pxWorker->xTask = NULL;
+        }
+
+        for (ucClass = 0U; ucClass < MQTT_AGENT_DISPATCH_PRIORITY_CLASSES; ucClass++) {
+            if (pxWorker->xQueues[ucClass] != NULL) {
+                vQueueDelete(pxWorker->xQueues[ucClass]);
+                pxWorker->xQueues[ucClass] = NULL;
+            }
+        }
+
+        if (pxWorker->xWork != NULL) {
+            vSemaphoreDelete(pxWorker->xWork);
+            pxWorker->xWork = NULL;
+        }
+    }
+}
+
+#endif /* if MQTT_AGENT_DISPATCH_POOLS > 0 */
+
+/*-----------------------------------------------------------*/
+
+static void prvFlushBatch(DispatchBatch_t *pxBatch) {
+    bool xQueued = false;
+
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+    xQueued = prvQueueBatch(pxBatch);
+#endif
+
+    if (xQueued == false) {
+        prvCallBatch(pxBatch->pxBatchCallback, pxBatch->pvIncomingPublishCallbackContext, pxBatch->pxMessages,
+                     pxBatch->usCount);
+    }
+
+    pxBatch->usCount = 0U;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCollectBatch(DispatchRoute_t *pxRoute,
+                            const SubscriptionDelivery_t *pxDelivery,
+                            MQTTPublishInfo_t *pxPublishInfo) {
+    DispatchBatch_t *pxBatch = NULL, *pxFree = NULL;
+    uint8_t ucBatch;
+
+    for (ucBatch = 0U; (pxBatch == NULL) && (ucBatch < MQTT_AGENT_DISPATCH_BATCH_SUBSCRIBERS); ucBatch++) {
+        if (xDispatchBatches[ucBatch].usCount == 0U) {
+            if (pxFree == NULL) {
+                pxFree = &(xDispatchBatches[ucBatch]);
+            }
+        } else if ((xDispatchBatches[ucBatch].pxBatchCallback == pxDelivery->pxBatchCallback) &&
+                   (xDispatchBatches[ucBatch].pvIncomingPublishCallbackContext ==
+                    pxDelivery->pvIncomingPublishCallbackContext)) {
+            pxBatch = &(xDispatchBatches[ucBatch]);
+        }
+    }
+
+    if (pxBatch == NULL) {
+        /* With every entry collecting for another subscriber, the first one is
+         * delivered early to make room. */
+        if (pxFree == NULL) {
+            pxFree = &(xDispatchBatches[0]);
+            prvFlushBatch(pxFree);
+        }
+
+        pxBatch = pxFree;
+        pxBatch->pxBatchCallback = pxDelivery->pxBatchCallback;
+        pxBatch->pvIncomingPublishCallbackContext = pxDelivery->pvIncomingPublishCallbackContext;
+        pxBatch->ucDispatchPool = pxDelivery->ucDispatchPool;
+        pxBatch->ucPriorityClass = pxDelivery->ucPriorityClass;
+    }
+
+    /* The publish is copied once, whatever the number of its subscribers. */
+    if (pxRoute->pxMessage == NULL) {
+        pxRoute->pxMessage = prvCopyMessage(pxPublishInfo);
+    }
+
+    if (pxRoute->pxMessage == NULL) {
+        ESP_LOGW(TAG, "Out of memory for a batch of publishes on %.*s.",
+                 (int) pxPublishInfo->topicNameLength,
+                 pxPublishInfo->pTopicName);
+    } else {
+        __atomic_fetch_add(&(pxRoute->pxMessage->ulReferences), 1U, __ATOMIC_RELAXED);
+        pxBatch->pxMessages[pxBatch->usCount] = pxRoute->pxMessage;
+        pxBatch->usCount++;
+
+        if (pxBatch->usCount == MQTT_AGENT_DISPATCH_BATCH_SIZE) {
+            prvFlushBatch(pxBatch);
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvRouteDelivery(void *pvHookContext,
+                             const SubscriptionDelivery_t *pxDelivery,
+                             MQTTPublishInfo_t *pxPublishInfo) {
+    DispatchRoute_t *pxRoute = (DispatchRoute_t *) pvHookContext;
+    bool xTaken = false;
+
+    /* The copy holds the acknowledgement back until it is released, the
+     * publish being acknowledged at once if it cannot be copied. */
+    if (pxDelivery->xManualAck &&
+        (pxRoute->ulAckToken != 0U) &&
+        (pxRoute->xAckDeferred == false)) {
+        if (pxRoute->pxMessage == NULL) {
+            pxRoute->pxMessage = prvCopyMessage(pxPublishInfo);
+        }
+
+        if (pxRoute->pxMessage != NULL) {
+            pxRoute->pxMessage->ulAckToken = pxRoute->ulAckToken;
+            pxRoute->xAckDeferred = true;
+        }
+    }
+
+    /* Streams are always called on the agent task, which reads them. */
+    if (pxDelivery->xBatch) {
+        prvCollectBatch(pxRoute, pxDelivery, pxPublishInfo);
+        xTaken = true;
+    } else if (pxDelivery->xStream == false) {
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+        xTaken = prvQueueDelivery(pvHookContext, pxDelivery, pxPublishInfo);
+#endif
+    }
+
+    return xTaken;
+}
+
+/*-----------------------------------------------------------*/
+
+bool startDispatchPool(uint8_t ucPool,
+                       const DispatchPoolConfig_t *pxConfig) {
+    bool xReturnStatus = false;
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+    DispatchPool_t *pxPool = NULL;
+    DispatchWorker_t *pxWorker;
+    char cTaskName[configMAX_TASK_NAME_LEN];
+    uint8_t ucWorker, ucClass;
+    bool xClaimed = false;
+
+    if ((ucPool >= MQTT_AGENT_DISPATCH_POOLS) ||
+        (pxConfig == NULL) ||
+        (pxConfig->ucWorkers == 0U) ||
+        (pxConfig->ucWorkers > MQTT_AGENT_DISPATCH_MAX_WORKERS) ||
+        (pxConfig->uxQueueLength == 0U)) {
+        ESP_LOGE(TAG, "Invalid parameter. ucPool=%u, pxConfig=%p.",
+                 (unsigned int) ucPool,
+                 pxConfig);
+    } else {
+        pxPool = &(xDispatchPools[ucPool]);
+
+        taskENTER_CRITICAL(&xDispatchPoolSpinlock);
+        xClaimed = (pxPool->xClaimed == false);
+        pxPool->xClaimed = true;
+        taskEXIT_CRITICAL(&xDispatchPoolSpinlock);
+
+        if (xClaimed == false) {
+            ESP_LOGE(TAG, "Dispatch pool %u already started.", (unsigned int) ucPool);
+        }
+    }
+
+    if (xClaimed) {
+        xReturnStatus = true;
+
+        for (ucWorker = 0U; xReturnStatus && (ucWorker < pxConfig->ucWorkers); ucWorker++) {
+            pxWorker = &(pxPool->xWorkers[ucWorker]);
+            pxWorker->xWork = xSemaphoreCreateCounting(pxConfig->uxQueueLength * MQTT_AGENT_DISPATCH_PRIORITY_CLASSES,
+                                                       0U);
+            xReturnStatus = (pxWorker->xWork != NULL);
+
+            for (ucClass = 0U; xReturnStatus && (ucClass < MQTT_AGENT_DISPATCH_PRIORITY_CLASSES); ucClass++) {
+                pxWorker->xQueues[ucClass] = xQueueCreate(pxConfig->uxQueueLength, sizeof(DispatchJob_t));
+                xReturnStatus = (pxWorker->xQueues[ucClass] != NULL);
+            }
+
+            (void) snprintf(cTaskName, sizeof(cTaskName), "mqtt_disp%u_%u",
+                            (unsigned int) ucPool, (unsigned int) ucWorker);
+
+            xReturnStatus = xReturnStatus &&
+                            (xTaskCreatePinnedToCore(prvDispatchWorkerTask, cTaskName, pxConfig->ulStackSize,
+                                                     pxWorker, pxConfig->uxPriority, &(pxWorker->xTask),
+                                                     pxConfig->xCoreID) == pdPASS);
+        }
+
+        if (xReturnStatus) {
+            __atomic_store_n(&(pxPool->ucWorkers), pxConfig->ucWorkers, __ATOMIC_RELEASE);
+        } else {
+            ESP_LOGE(TAG, "Failed to start the workers of dispatch pool %u.", (unsigned int) ucPool);
+            prvStopWorkers(pxPool);
+
+            taskENTER_CRITICAL(&xDispatchPoolSpinlock);
+            pxPool->xClaimed = false;
+            taskEXIT_CRITICAL(&xDispatchPoolSpinlock);
+        }
+    }
+#else /* if MQTT_AGENT_DISPATCH_POOLS > 0 */
+    (void) ucPool;
+    (void) pxConfig;
+    ESP_LOGE(TAG, "Dispatch pools are disabled, see MQTT_AGENT_DISPATCH_POOLS.");
+#endif /* if MQTT_AGENT_DISPATCH_POOLS > 0 */
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+void drainDispatchPool(uint8_t ucPool) {
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+    StaticSemaphore_t xDrainedBuffer;
+    SemaphoreHandle_t xDrained;
+    DispatchJob_t xMarker = {0};
+    uint8_t ucWorker, ucWorkers = 0U;
+
+    if (ucPool < MQTT_AGENT_DISPATCH_POOLS) {
+        ucWorkers = __atomic_load_n(&(xDispatchPools[ucPool].ucWorkers), __ATOMIC_ACQUIRE);
+    }
+
+    if (ucWorkers > 0U) {
+        xDrained = xSemaphoreCreateCountingStatic(ucWorkers, 0U, &xDrainedBuffer);
+        xMarker.pvIncomingPublishCallbackContext = xDrained;
+
+        /* Each worker gives the semaphore once it has got past everything
+         * queued to it before the marker. The marker goes to the lowest class,
+         * which a worker only gets to once the classes above are empty. */
+        for (ucWorker = 0U; ucWorker < ucWorkers; ucWorker++) {
+            (void) prvQueueJob(&(xDispatchPools[ucPool].xWorkers[ucWorker]), 0U, &xMarker, portMAX_DELAY);
+        }
+
+        for (ucWorker = 0U; ucWorker < ucWorkers; ucWorker++) {
+            (void) xSemaphoreTake(xDrained, portMAX_DELAY);
+        }
+
+        vSemaphoreDelete(xDrained);
+    }
+#else /* if MQTT_AGENT_DISPATCH_POOLS > 0 */
+    (void) ucPool;
+#endif /* if MQTT_AGENT_DISPATCH_POOLS > 0 */
+}
+
+/*-----------------------------------------------------------*/
+
+void getDispatchPoolStats(uint8_t ucPool,
+                          DispatchPoolStats_t *pxStats) {
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+    DispatchPool_t *pxPool;
+    DispatchLatency_t *pxLatency;
+    DispatchClassStats_t *pxClass;
+    uint8_t ucWorker, ucWorkers, ucClass, ucBucket;
+    uint32_t ulMaxLatencyUs;
+#endif
+
+    if (pxStats == NULL) {
+        ESP_LOGE(TAG, "Invalid parameter. pxStats=%p.", pxStats);
+    } else {
+        memset(pxStats, 0x00, sizeof(DispatchPoolStats_t));
+
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+        if (ucPool < MQTT_AGENT_DISPATCH_POOLS) {
+            pxPool = &(xDispatchPools[ucPool]);
+            ucWorkers = __atomic_load_n(&(pxPool->ucWorkers), __ATOMIC_ACQUIRE);
+
+            for (ucClass = 0U; ucClass < MQTT_AGENT_DISPATCH_PRIORITY_CLASSES; ucClass++) {
+                pxClass = &(pxStats->xClasses[ucClass]);
+                pxClass->ulQueued = __atomic_load_n(&(pxPool->ulQueued[ucClass]), __ATOMIC_RELAXED);
+                pxClass->ulDropped = __atomic_load_n(&(pxPool->ulDropped[ucClass]), __ATOMIC_RELAXED);
+
+                for (ucWorker = 0U; ucWorker < ucWorkers; ucWorker++) {
+                    pxLatency = &(pxPool->xWorkers[ucWorker].xLatency[ucClass]);
+                    pxClass->ulWaiting +=
+                        (uint32_t) uxQueueMessagesWaiting(pxPool->xWorkers[ucWorker].xQueues[ucClass]);
+                    pxClass->ulDelivered += __atomic_load_n(&(pxLatency->ulDelivered), __ATOMIC_RELAXED);
+                    ulMaxLatencyUs = __atomic_load_n(&(pxLatency->ulMaxLatencyUs), __ATOMIC_RELAXED);
+
+                    if (ulMaxLatencyUs > pxClass->ulMaxLatencyUs) {
+                        pxClass->ulMaxLatencyUs = ulMaxLatencyUs;
+                    }
+
+                    for (ucBucket = 0U; ucBucket < MQTT_AGENT_DISPATCH_LATENCY_BUCKETS; ucBucket++) {
+                        pxClass->ulLatencyBuckets[ucBucket] +=
+                            __atomic_load_n(&(pxLatency->ulLatencyBuckets[ucBucket]), __ATOMIC_RELAXED);
+                    }
+                }
+
+                pxStats->ulQueued += pxClass->ulQueued;
+                pxStats->ulDelivered += pxClass->ulDelivered;
+                pxStats->ulDropped += pxClass->ulDropped;
+                pxStats->ulWaiting += pxClass->ulWaiting;
+            }
+        }
+#else
+        (void) ucPool;
+#endif
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+bool dispatchIncomingPublishes(SubscriptionElement_t *pxSubscriptionList,
+                               MQTTPublishInfo_t *pxPublishInfo) {
+    bool xAckDeferred;
+
+    return dispatchIncomingPublishesDeferringAck(pxSubscriptionList, pxPublishInfo, 0U, &xAckDeferred);
+}
+
+/*-----------------------------------------------------------*/
+
+bool dispatchIncomingPublishesDeferringAck(SubscriptionElement_t *pxSubscriptionList,
+                                           MQTTPublishInfo_t *pxPublishInfo,
+                                           uint32_t ulAckToken,
+                                           bool *pxAckDeferred) {
+    bool xPublishHandled;
+    DispatchRoute_t xRoute = {NULL};
+
+    xRoute.ulAckToken = (pxPublishAckHandler != NULL) ? ulAckToken : 0U;
+
+    pxInlineRoute = &xRoute;
+    __atomic_store_n(&pxInlinePublishInfo, pxPublishInfo, __ATOMIC_RELEASE);
+
+    xPublishHandled = deliverIncomingPublishes(pxSubscriptionList, pxPublishInfo, prvRouteDelivery, &xRoute);
+
+    __atomic_store_n(&pxInlinePublishInfo, NULL, __ATOMIC_RELAXED);
+    pxInlineRoute = NULL;
+
+    /* The deliveries queued and the leases taken hold their own references
+     * to the copy, so a count of one left means nobody kept the publish, and
+     * it is acknowledged right away. Only the holders of a reference can take
+     * another one. */
+    if (xRoute.xAckDeferred &&
+        (__atomic_load_n(&(xRoute.pxMessage->ulReferences), __ATOMIC_ACQUIRE) == 1U)) {
+        xRoute.pxMessage->ulAckToken = 0U;
+        xRoute.xAckDeferred = false;
+    }
+
+    *pxAckDeferred = xRoute.xAckDeferred;
+
+    if (xRoute.pxMessage != NULL) {
+        prvReleaseMessage(xRoute.pxMessage);
+    }
+
+    return xPublishHandled;
+}
+
+/*-----------------------------------------------------------*/
+
+void setPublishAckHandler(PublishAckHandler_t pxHandler) {
+    pxPublishAckHandler = pxHandler;
+}
+
+/*-----------------------------------------------------------*/
+
+bool isDispatchSaturated(void) {
+    bool xSaturated = false;
+
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+    if (xSaturatedQueue != NULL) {
+        if ((uxQueueMessagesWaiting(xSaturatedQueue) * 200U) <=
+            (uxSaturatedQueueLength * MQTT_AGENT_DISPATCH_HIGH_WATER_PERCENT)) {
+            ESP_LOGD(TAG, "Dispatch queue back below the low-water mark, resuming the reads.");
+            xSaturatedQueue = NULL;
+        } else {
+            xSaturated = true;
+        }
+    }
+#endif
+
+    return xSaturated;
+}
+
+/*-----------------------------------------------------------*/
+
+void flushDispatchBatches(void) {
+    uint8_t ucBatch;
+
+    for (ucBatch = 0U; ucBatch < MQTT_AGENT_DISPATCH_BATCH_SUBSCRIBERS; ucBatch++) {
+        if (xDispatchBatches[ucBatch].usCount > 0U) {
+            prvFlushBatch(&(xDispatchBatches[ucBatch]));
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+PublishLease_t *leasePublish(const MQTTPublishInfo_t *pxPublishInfo) {
+    DispatchMessage_t *pxMessage = NULL;
+
+    if (pxPublishInfo == NULL) {
+        ESP_LOGE(TAG, "Invalid parameter. pxPublishInfo=%p.", pxPublishInfo);
+    } else if (__atomic_load_n(&pxInlinePublishInfo, __ATOMIC_ACQUIRE) == pxPublishInfo) {
+        /* Called back on the agent task, the publish is still in the network
+         * buffer and copied once for all the leases and queued deliveries. */
+        if (pxInlineRoute->pxMessage == NULL) {
+            pxInlineRoute->pxMessage = prvCopyMessage(pxPublishInfo);
+        }
+
+        pxMessage = pxInlineRoute->pxMessage;
+
+        if (pxMessage == NULL) {
+            ESP_LOGW(TAG, "Out of memory for a lease on %.*s.",
+                     (int) pxPublishInfo->topicNameLength,
+                     pxPublishInfo->pTopicName);
+        }
+    } else {
+#if MQTT_AGENT_DISPATCH_POOLS > 0
+        pxMessage = prvFindDelivery(pxPublishInfo);
+#endif
+
+        if (pxMessage == NULL) {
+            ESP_LOGE(TAG, "Publish to lease not found, leasePublish() must be called from its callback.");
+        }
+    }
+
+    if (pxMessage != NULL) {
+        __atomic_fetch_add(&(pxMessage->ulReferences), 1U, __ATOMIC_RELAXED);
+    }
+
+    return pxMessage;
+}
+
+/*-----------------------------------------------------------*/
+
+const MQTTPublishInfo_t *getLeasedPublish(const PublishLease_t *pxLease) {
+    return &(pxLease->xPublishInfo);
+}
+
+/*-----------------------------------------------------------*/
+
+void releasePublishLease(PublishLease_t *pxLease) {
+    if (pxLease == NULL) {
+        ESP_LOGE(TAG, "Invalid parameter. pxLease=%p.", pxLease);
+    } else {
+        prvReleaseMessage(pxLease);
+    }
+}
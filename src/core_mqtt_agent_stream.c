@@ -0,0 +1,511 @@
+/**
+ * @file core_mqtt_agent_stream.c
+ * @brief Streaming receive of publishes larger than the network buffer.
+ */
+
+/* Standard includes. */
+#include <string.h>
+
+/* Kernel includes. */
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+
+#include "core_mqtt_agent_stream.h"
+
+/**
+ * @brief Logging tag.
+ */
+static const char *TAG = "coreMQTTAgentStream";
+
+#if MQTT_AGENT_STREAM_CHUNK_SIZE > 0
+
+/**
+ * @brief Longest fixed header of a packet: the type and a remaining length of
+ * up to four bytes.
+ */
+#define STREAM_FIXED_HEADER_MAX    5U
+
+/**
+ * @brief Room for the headers of a publish: the fixed header, the topic with
+ * its length and the packet identifier.
+ */
+#define STREAM_HEADER_SIZE         (STREAM_FIXED_HEADER_MAX + 2U + MQTT_AGENT_STREAM_TOPIC_LENGTH + 2U)
+
+/**
+ * @brief What the bytes read next from the transport are.
+ */
+typedef enum streamState {
+    STREAM_FIXED_HEADER = 0, /**< Fixed header of the next packet. */
+    STREAM_PUBLISH_HEADER,   /**< Topic and packet identifier of a publish too large for the network buffer. */
+    STREAM_PASS,             /**< Rest of a packet handed to coreMQTT. */
+    STREAM_PAYLOAD           /**< Payload of a publish streamed, spilled or discarded. */
+} StreamState_t;
+
+/**
+ * @brief A subscriber a publish is streamed to.
+ */
+typedef struct streamSubscriber {
+    const PublishStreamCallbacks_t *pxCallbacks;
+    void *pvContext;
+} StreamSubscriber_t;
+
+/**
+ * @brief The packet being read from the transport.
+ *
+ * The headers read are kept in ucHeader, to be replayed to coreMQTT if the
+ * packet is handed to it after all. xRemaining counts the bytes of the packet
+ * still to be read from the transport. The payload of a publish is streamed to
+ * the subscribers in xSubscribers, or read into pucSpill if set, or else
+ * discarded.
+ */
+typedef struct publishStream {
+    StreamState_t xState;
+    uint8_t ucHeader[STREAM_HEADER_SIZE];
+    size_t xHeaderLength;
+    size_t xFixedHeaderLength;
+    size_t xReplayed;
+    size_t xRemaining;
+    size_t xOffset;
+    uint16_t usPacketId;
+    uint8_t ucSubscribers;
+    uint32_t ulSkipped;
+    uint8_t *pucSpill;
+    StreamSubscriber_t xSubscribers[MQTT_AGENT_STREAM_SUBSCRIBERS];
+    PublishStreamStats_t xStats;
+    uint8_t ucChunk[MQTT_AGENT_STREAM_CHUNK_SIZE];
+} PublishStream_t;
+
+/**
+ * @brief The packet being read. Only used by the agent task, but for the stats.
+ */
+static PublishStream_t xPublishStream;
+
+/**
+ * @brief Handler of the publishes read into a spill buffer.
+ */
+static SpilledPublishHandler_t pxSpilledPublishHandler = NULL;
+
+/*-----------------------------------------------------------*/
+
+static void prvCountStat(uint32_t *pulCounter,
+                         uint32_t ulCount) {
+    __atomic_store_n(pulCounter, *pulCounter + ulCount, __ATOMIC_RELAXED);
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvNextPacket(PublishStream_t *pxStream) {
+    pxStream->xState = STREAM_FIXED_HEADER;
+    pxStream->xHeaderLength = 0U;
+    pxStream->xReplayed = 0U;
+    pxStream->xRemaining = 0U;
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t prvFixedHeaderLength(const PublishStream_t *pxStream) {
+    size_t xLength = 2U, xIndex;
+
+    /* Each byte of the remaining length but the last has its top bit set. */
+    for (xIndex = 1U;
+         (xIndex < pxStream->xHeaderLength) &&
+         (xIndex < (STREAM_FIXED_HEADER_MAX - 1U)) &&
+         ((pxStream->ucHeader[xIndex] & 0x80U) != 0U);
+         xIndex++) {
+        xLength = xIndex + 2U;
+    }
+
+    return xLength;
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t prvPublishHeaderLength(const PublishStream_t *pxStream) {
+    size_t xLength = pxStream->xFixedHeaderLength + 2U;
+    uint8_t ucQoS = (pxStream->ucHeader[0] >> 1U) & 0x03U;
+
+    if (pxStream->xHeaderLength >= xLength) {
+        xLength += ((size_t) pxStream->ucHeader[xLength - 2U] << 8U) | pxStream->ucHeader[xLength - 1U];
+        xLength += (ucQoS > 0U) ? 2U : 0U;
+    }
+
+    return xLength;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvReadHeader(PublishStream_t *pxStream,
+                             const TransportInterface_t *pxTransport,
+                             size_t xHeaderLength) {
+    int32_t lRead;
+
+    lRead = pxTransport->recv(pxTransport->pNetworkContext,
+                              &(pxStream->ucHeader[pxStream->xHeaderLength]),
+                              xHeaderLength - pxStream->xHeaderLength);
+
+    if (lRead > 0) {
+        pxStream->xHeaderLength += (size_t) lRead;
+
+        if (pxStream->xState == STREAM_PUBLISH_HEADER) {
+            pxStream->xRemaining -= (size_t) lRead;
+        }
+    }
+
+    return lRead;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvStartPacket(PublishStream_t *pxStream,
+                           size_t xNetworkBufferSize) {
+    uint8_t ucQoS = (pxStream->ucHeader[0] >> 1U) & 0x03U;
+    size_t xIndex;
+
+    pxStream->xFixedHeaderLength = pxStream->xHeaderLength;
+    pxStream->xRemaining = 0U;
+
+    for (xIndex = pxStream->xHeaderLength - 1U; xIndex > 0U; xIndex--) {
+        pxStream->xRemaining = (pxStream->xRemaining << 7U) | (pxStream->ucHeader[xIndex] & 0x7FU);
+    }
+
+    /* A malformed remaining length is left for coreMQTT to reject. */
+    if ((pxStream->ucHeader[pxStream->xHeaderLength - 1U] & 0x80U) != 0U) {
+        pxStream->xRemaining = 0U;
+        pxStream->xState = STREAM_PASS;
+    } else if (((pxStream->ucHeader[0] & 0xF0U) == MQTT_PACKET_TYPE_PUBLISH) &&
+               (ucQoS < 2U) &&
+               ((pxStream->xHeaderLength + pxStream->xRemaining) > xNetworkBufferSize)) {
+        pxStream->xState = STREAM_PUBLISH_HEADER;
+    } else {
+        pxStream->xState = STREAM_PASS;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvParsePublishHeader(const PublishStream_t *pxStream,
+                                  MQTTPublishInfo_t *pxPublishInfo) {
+    size_t xTopicOffset = pxStream->xFixedHeaderLength + 2U;
+
+    memset(pxPublishInfo, 0x00, sizeof(MQTTPublishInfo_t));
+    pxPublishInfo->qos = (MQTTQoS_t) ((pxStream->ucHeader[0] >> 1U) & 0x03U);
+    pxPublishInfo->retain = (pxStream->ucHeader[0] & 0x01U) != 0U;
+    pxPublishInfo->dup = (pxStream->ucHeader[0] & 0x08U) != 0U;
+    pxPublishInfo->pTopicName = (const char *) &(pxStream->ucHeader[xTopicOffset]);
+    pxPublishInfo->topicNameLength = (uint16_t) (pxStream->xHeaderLength - xTopicOffset -
+                                                 ((pxPublishInfo->qos > MQTTQoS0) ? 2U : 0U));
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvBeginSubscriber(void *pvHookContext,
+                               const SubscriptionDelivery_t *pxDelivery,
+                               MQTTPublishInfo_t *pxPublishInfo) {
+    PublishStream_t *pxStream = (PublishStream_t *) pvHookContext;
+    StreamSubscriber_t *pxSubscriber;
+
+    /* The others cannot be given a payload that is never held whole. */
+    if (pxDelivery->xStream && (pxStream->ucSubscribers < MQTT_AGENT_STREAM_SUBSCRIBERS)) {
+        pxSubscriber = &(pxStream->xSubscribers[pxStream->ucSubscribers]);
+        pxSubscriber->pxCallbacks = pxDelivery->pxStreamCallbacks;
+        pxSubscriber->pvContext = pxDelivery->pvIncomingPublishCallbackContext;
+        pxStream->ucSubscribers++;
+
+        pxSubscriber->pxCallbacks->pxBegin(pxSubscriber->pvContext, pxPublishInfo);
+    } else {
+        pxStream->ulSkipped++;
+    }
+
+    return true;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvBeginStream(PublishStream_t *pxStream,
+                           SubscriptionElement_t *pxSubscriptionList) {
+    MQTTPublishInfo_t xPublishInfo;
+
+    prvParsePublishHeader(pxStream, &xPublishInfo);
+    xPublishInfo.payloadLength = pxStream->xRemaining;
+
+    if (xPublishInfo.qos > MQTTQoS0) {
+        pxStream->usPacketId = (uint16_t) ((pxStream->ucHeader[pxStream->xHeaderLength - 2U] << 8U) |
+                                           pxStream->ucHeader[pxStream->xHeaderLength - 1U]);
+    }
+
+    pxStream->ucSubscribers = 0U;
+    pxStream->ulSkipped = 0U;
+    (void) deliverIncomingPublishes(pxSubscriptionList, &xPublishInfo, prvBeginSubscriber, pxStream);
+
+    /* coreMQTT would fail on the publish and the agent reconnect, so the
+     * publish is rather spilled, or discarded. */
+    if (pxStream->ucSubscribers == 0U) {
+        if ((pxSpilledPublishHandler != NULL) &&
+            (xPublishInfo.payloadLength > 0U) &&
+            (xPublishInfo.payloadLength <= MQTT_AGENT_STREAM_SPILL_SIZE)) {
+            pxStream->pucSpill = (uint8_t *) pvPortMalloc(xPublishInfo.payloadLength);
+        }
+
+        if (pxStream->pucSpill == NULL) {
+            ESP_LOGW(TAG, "Discarding a publish on %.*s of %u bytes too large for the network buffer.",
+                     (int) xPublishInfo.topicNameLength, xPublishInfo.pTopicName,
+                     (unsigned int) xPublishInfo.payloadLength);
+        }
+    } else if (pxStream->ulSkipped > 0U) {
+        ESP_LOGW(TAG, "Publish on %.*s of %u bytes skipped %u subscribers not taking streams.",
+                 (int) xPublishInfo.topicNameLength, xPublishInfo.pTopicName,
+                 (unsigned int) xPublishInfo.payloadLength,
+                 (unsigned int) pxStream->ulSkipped);
+        prvCountStat(&(pxStream->xStats.ulSkipped), pxStream->ulSkipped);
+    }
+
+    pxStream->xOffset = 0U;
+    pxStream->xState = STREAM_PAYLOAD;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvReadChunk(PublishStream_t *pxStream,
+                            const TransportInterface_t *pxTransport) {
+    size_t xChunkLength = pxStream->xRemaining;
+    uint8_t *pucChunk = pxStream->ucChunk;
+    uint8_t ucSubscriber;
+    int32_t lRead;
+
+    if (pxStream->pucSpill != NULL) {
+        pucChunk = &(pxStream->pucSpill[pxStream->xOffset]);
+    } else if (xChunkLength > MQTT_AGENT_STREAM_CHUNK_SIZE) {
+        xChunkLength = MQTT_AGENT_STREAM_CHUNK_SIZE;
+    }
+
+    lRead = pxTransport->recv(pxTransport->pNetworkContext, pucChunk, xChunkLength);
+
+    if (lRead > 0) {
+        for (ucSubscriber = 0U; ucSubscriber < pxStream->ucSubscribers; ucSubscriber++) {
+            pxStream->xSubscribers[ucSubscriber].pxCallbacks->pxData(pxStream->xSubscribers[ucSubscriber].pvContext,
+                                                                     pucChunk, (size_t) lRead,
+                                                                     pxStream->xOffset);
+        }
+
+        pxStream->xOffset += (size_t) lRead;
+        pxStream->xRemaining -= (size_t) lRead;
+    }
+
+    return lRead;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvEndStream(PublishStream_t *pxStream,
+                         bool xComplete) {
+    uint8_t ucSubscriber;
+
+    for (ucSubscriber = 0U; ucSubscriber < pxStream->ucSubscribers; ucSubscriber++) {
+        pxStream->xSubscribers[ucSubscriber].pxCallbacks->pxEnd(pxStream->xSubscribers[ucSubscriber].pvContext,
+                                                                xComplete);
+    }
+
+    pxStream->ucSubscribers = 0U;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvSendAck(const PublishStream_t *pxStream,
+                       const TransportInterface_t *pxTransport) {
+    uint8_t ucPacket[MQTT_PUBLISH_ACK_PACKET_SIZE];
+    MQTTFixedBuffer_t xPacketBuffer = {.pBuffer = ucPacket, .size = sizeof(ucPacket)};
+
+    /* coreMQTT never saw the publish, so the PUBACK is up to the reader. */
+    if ((MQTT_SerializeAck(&xPacketBuffer, MQTT_PACKET_TYPE_PUBACK, pxStream->usPacketId) != MQTTSuccess) ||
+        (pxTransport->send(pxTransport->pNetworkContext, ucPacket, sizeof(ucPacket)) != (int32_t) sizeof(ucPacket))) {
+        ESP_LOGE(TAG, "Failed to send the PUBACK of packet %u kept from coreMQTT.", (unsigned int) pxStream->usPacketId);
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvEndPayload(PublishStream_t *pxStream,
+                          const TransportInterface_t *pxTransport) {
+    MQTTPublishInfo_t xPublishInfo;
+    bool xAckDeferred = false;
+
+    if (pxStream->pucSpill != NULL) {
+        prvParsePublishHeader(pxStream, &xPublishInfo);
+        xPublishInfo.pPayload = pxStream->pucSpill;
+        xPublishInfo.payloadLength = pxStream->xOffset;
+
+        xAckDeferred = pxSpilledPublishHandler((xPublishInfo.qos > MQTTQoS0) ? pxStream->usPacketId : 0U,
+                                               &xPublishInfo);
+        vPortFree(pxStream->pucSpill);
+        pxStream->pucSpill = NULL;
+        prvCountStat(&(pxStream->xStats.ulSpilled), 1U);
+    } else if (pxStream->ucSubscribers > 0U) {
+        prvEndStream(pxStream, true);
+        prvCountStat(&(pxStream->xStats.ulStreamed), 1U);
+    } else {
+        prvCountStat(&(pxStream->xStats.ulDiscarded), 1U);
+    }
+
+    /* A discarded publish is acknowledged as well, lest the broker send it
+     * again and again. */
+    if (((pxStream->ucHeader[0] & 0x06U) != 0U) && (xAckDeferred == false)) {
+        prvSendAck(pxStream, pxTransport);
+    }
+
+    prvNextPacket(pxStream);
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvPass(PublishStream_t *pxStream,
+                       const TransportInterface_t *pxTransport,
+                       void *pBuffer,
+                       size_t bytesToRecv) {
+    size_t xLength;
+    int32_t lRead;
+
+    /* The headers read are replayed before the rest of the packet, which is
+     * read no further than its end, to find the header of the next one. */
+    if (pxStream->xReplayed < pxStream->xHeaderLength) {
+        xLength = pxStream->xHeaderLength - pxStream->xReplayed;
+        xLength = (xLength < bytesToRecv) ? xLength : bytesToRecv;
+        memcpy(pBuffer, &(pxStream->ucHeader[pxStream->xReplayed]), xLength);
+        pxStream->xReplayed += xLength;
+        lRead = (int32_t) xLength;
+    } else {
+        xLength = (pxStream->xRemaining < bytesToRecv) ? pxStream->xRemaining : bytesToRecv;
+        lRead = pxTransport->recv(pxTransport->pNetworkContext, pBuffer, xLength);
+
+        if (lRead > 0) {
+            pxStream->xRemaining -= (size_t) lRead;
+        }
+    }
+
+    if ((pxStream->xReplayed == pxStream->xHeaderLength) && (pxStream->xRemaining == 0U)) {
+        prvNextPacket(pxStream);
+    }
+
+    return lRead;
+}
+
+#endif /* if MQTT_AGENT_STREAM_CHUNK_SIZE > 0 */
+
+/*-----------------------------------------------------------*/
+
+int32_t receivePublishStreams(SubscriptionElement_t *pxSubscriptionList,
+                              const TransportInterface_t *pxTransport,
+                              void *pBuffer,
+                              size_t bytesToRecv,
+                              size_t xNetworkBufferSize) {
+    int32_t lReturn = 0;
+#if MQTT_AGENT_STREAM_CHUNK_SIZE > 0
+    PublishStream_t *pxStream = &xPublishStream;
+    size_t xHeaderLength;
+    int32_t lRead = 1;
+
+    /* Packets kept from coreMQTT are read in the same call, for as long as the
+     * transport has bytes for them. */
+    while ((lReturn == 0) && (lRead > 0) && (bytesToRecv > 0U)) {
+        switch (pxStream->xState) {
+            case STREAM_FIXED_HEADER:
+                xHeaderLength = prvFixedHeaderLength(pxStream);
+
+                if (pxStream->xHeaderLength == xHeaderLength) {
+                    prvStartPacket(pxStream, xNetworkBufferSize);
+                } else {
+                    lRead = prvReadHeader(pxStream, pxTransport, xHeaderLength);
+                }
+
+                break;
+
+            case STREAM_PUBLISH_HEADER:
+                xHeaderLength = prvPublishHeaderLength(pxStream);
+
+                if ((xHeaderLength > STREAM_HEADER_SIZE) ||
+                    ((xHeaderLength - pxStream->xHeaderLength) > pxStream->xRemaining)) {
+                    pxStream->xState = STREAM_PASS;
+                } else if (pxStream->xHeaderLength == xHeaderLength) {
+                    prvBeginStream(pxStream, pxSubscriptionList);
+                } else {
+                    lRead = prvReadHeader(pxStream, pxTransport, xHeaderLength);
+                }
+
+                break;
+
+            case STREAM_PAYLOAD:
+
+                if (pxStream->xRemaining > 0U) {
+                    lRead = prvReadChunk(pxStream, pxTransport);
+                } else {
+                    prvEndPayload(pxStream, pxTransport);
+                }
+
+                break;
+
+            default:
+                lRead = prvPass(pxStream, pxTransport, pBuffer, bytesToRecv);
+                lReturn = lRead;
+                break;
+        }
+    }
+
+    if (lRead < 0) {
+        lReturn = lRead;
+    }
+#else
+    (void) pxSubscriptionList;
+    (void) xNetworkBufferSize;
+
+    lReturn = pxTransport->recv(pxTransport->pNetworkContext, pBuffer, bytesToRecv);
+#endif /* if MQTT_AGENT_STREAM_CHUNK_SIZE > 0 */
+
+    return lReturn;
+}
+
+/*-----------------------------------------------------------*/
+
+void setSpilledPublishHandler(SpilledPublishHandler_t pxHandler) {
+#if MQTT_AGENT_STREAM_CHUNK_SIZE > 0
+    pxSpilledPublishHandler = pxHandler;
+#else
+    (void) pxHandler;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+void resetPublishStreams(void) {
+#if MQTT_AGENT_STREAM_CHUNK_SIZE > 0
+    PublishStream_t *pxStream = &xPublishStream;
+
+    if ((pxStream->xState == STREAM_PAYLOAD) && (pxStream->ucSubscribers > 0U)) {
+        ESP_LOGW(TAG, "Connection lost %u bytes into a streamed publish.", (unsigned int) pxStream->xOffset);
+        prvEndStream(pxStream, false);
+        prvCountStat(&(pxStream->xStats.ulTruncated), 1U);
+    }
+
+    vPortFree(pxStream->pucSpill);
+    pxStream->pucSpill = NULL;
+
+    prvNextPacket(pxStream);
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+void getPublishStreamStats(PublishStreamStats_t *pxStats) {
+    if (pxStats == NULL) {
+        ESP_LOGE(TAG, "Invalid parameter. pxStats=%p.", pxStats);
+    } else {
+#if MQTT_AGENT_STREAM_CHUNK_SIZE > 0
+        pxStats->ulStreamed = __atomic_load_n(&(xPublishStream.xStats.ulStreamed), __ATOMIC_RELAXED);
+        pxStats->ulTruncated = __atomic_load_n(&(xPublishStream.xStats.ulTruncated), __ATOMIC_RELAXED);
+        pxStats->ulSkipped = __atomic_load_n(&(xPublishStream.xStats.ulSkipped), __ATOMIC_RELAXED);
+        pxStats->ulSpilled = __atomic_load_n(&(xPublishStream.xStats.ulSpilled), __ATOMIC_RELAXED);
+        pxStats->ulDiscarded = __atomic_load_n(&(xPublishStream.xStats.ulDiscarded), __ATOMIC_RELAXED);
+#else
+        memset(pxStats, 0x00, sizeof(PublishStreamStats_t));
+#endif
+    }
+}
@@ -34,122 +34,2321 @@
 /* Standard includes. */
 #include <string.h>
 
+/* Kernel includes. */
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
 /* Subscription manager header include. */
 #include "core_mqtt_agent_subs_manager.h"
 
-/**
- * @brief Logging tag.
- */
-static const char *TAG = "coreMQTTAgentSubsManager";
+/**
+ * @brief Logging tag.
+ */
+static const char *TAG = "coreMQTTAgentSubsManager";
+
+/**
+ * @brief Index of the root node of the topic trie. The root is never the child
+ * of another node, so the same value marks an unused child link.
+ */
+#define TRIE_ROOT_NODE     0U
+#define TRIE_NODE_NONE     0U
+
+/**
+ * @brief Marks an edge table slot whose node has been removed. Lookups probe
+ * past it, so that entries never have to be moved while being read.
+ */
+#define TRIE_EDGE_TOMBSTONE    0xFFFFU
+
+/**
+ * @brief Number of slots of the open addressing table holding the trie edges.
+ * Kept at twice the number of nodes so that probe sequences stay short.
+ */
+#define TRIE_EDGE_SLOTS    (SUBSCRIPTION_MANAGER_MAX_TRIE_NODES * 2U)
+
+/**
+ * @brief Prefix of the topic filter of a shared subscription, which is
+ * followed by the name of the group and the filter actually matched.
+ */
+#define SHARE_PREFIX           "$share/"
+#define SHARE_PREFIX_LENGTH    (sizeof(SHARE_PREFIX) - 1U)
+
+/**
+ * @brief Number of chunks the subscription store can grow by beyond the
+ * subscription list passed by the application.
+ */
+#define SUBSCRIPTION_POOL_MAX_CHUNKS                                                    \
+    ((SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT - SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS + \
+      SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE - 1U) / SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE)
+
+#if SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE > 0
+
+/**
+ * @brief Header of a topic filter copied into the arena, followed by the
+ * NUL terminated filter itself.
+ *
+ * Records are laid out back to back from the start of the arena, so the arena
+ * is walked by adding up their sizes. Free records are reused first fit and
+ * merged with the free records following them.
+ */
+typedef struct filterArenaRecord {
+    uint16_t usSize;     /**< Size of the record in headers, the header included. */
+    uint16_t usRefCount; /**< Subscriptions using the filter, 0 if the record is free. */
+} FilterArenaRecord_t;
+
+/**
+ * @brief Size of the topic filter arena in record headers.
+ */
+#define FILTER_ARENA_RECORDS    (SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE / sizeof(FilterArenaRecord_t))
+
+#endif
+
+#if SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES > 0
+
+/**
+ * @brief A topic name recently handled by handleIncomingPublishes() and the
+ * subscriptions it matched.
+ *
+ * The entry is only valid while its generation equals the generation of the
+ * index, which every change to the subscriptions increments.
+ */
+typedef struct matchCacheEntry {
+    uint32_t ulTopicHash;                                        /**< FNV-1a hash of the topic name. */
+    uint32_t ulGeneration;                                       /**< Generation of the index the matches were resolved in. */
+    uint16_t usTopicLength;                                      /**< Length of the topic name, 0 if the entry is unused. */
+    uint16_t usMatchCount;                                       /**< Number of matching subscriptions. */
+    bool xReferenced;                                            /**< Set on a hit, cleared as the clock hand passes. */
+    uint16_t usMatches[SUBSCRIPTION_MANAGER_MATCH_CACHE_MATCHES]; /**< Slots of the matching subscriptions. */
+    char cTopic[SUBSCRIPTION_MANAGER_MATCH_CACHE_TOPIC_LENGTH];  /**< The topic name. */
+} MatchCacheEntry_t;
+
+#endif
+
+/**
+ * @brief An incoming topic name split into levels, once per publish.
+ */
+typedef struct topicLevels {
+    uint16_t usLevelCount;                                                 /**< Number of levels of the topic name. */
+    uint16_t usLevelOffsets[SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS + 1U]; /**< Offsets of the first levels. */
+} TopicLevels_t;
+
+/**
+ * @brief Access to the links followed by handleIncomingPublishes().
+ *
+ * Writers fill in a subscription or a trie node completely before publishing
+ * the link to it with a release store, so a reader following the link with an
+ * acquire load always finds it initialised.
+ */
+#define LOAD_ACQUIRE(xLink)            __atomic_load_n(&(xLink), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(xLink, xValue)   __atomic_store_n(&(xLink), (xValue), __ATOMIC_RELEASE)
+
+/**
+ * @brief A node of the topic trie.
+ *
+ * A node stands for one topic level of one or more topic filters. Literal
+ * levels are found through the edge table keyed by the parent node and the hash
+ * of the level, `+` levels through the dedicated usPlusChild link, and filters
+ * ending with `#` are attached to the node of the level in front of the `#`.
+ *
+ * Nodes only store the hash of their level, so a lookup may return filters that
+ * do not match the topic. Every candidate is therefore confirmed with
+ * MQTT_MatchTopic() before its callback is invoked.
+ */
+typedef struct topicTrieNode {
+    uint32_t ulLevelHash;       /**< FNV-1a hash of the topic level. */
+    uint32_t ulRetiredSequence; /**< Value of ulDispatchSequence when the node was unlinked. */
+    uint16_t usLevelLength;     /**< Length of the topic level. */
+    uint16_t usParent;          /**< Parent node. */
+    uint16_t usPlusChild;       /**< Child for the `+` wildcard, or TRIE_NODE_NONE. */
+    uint16_t usExactHead;       /**< Subscriptions (index + 1) whose filter ends at this node. */
+    uint16_t usMultiHead;       /**< Subscriptions (index + 1) whose filter continues with `#`. */
+    uint16_t usRefCount;        /**< Number of children and subscriptions attached to this node. */
+    uint16_t usNextFree;        /**< Next node of the free or retired list while unused. */
+} TopicTrieNode_t;
+
+/**
+ * @brief The routing index of a subscription list.
+ *
+ * Filters without wildcards are kept in a hash table keyed by the hash of the
+ * whole filter, so that they are resolved with one hash of the topic and one
+ * memcmp(). Only filters with `+` or `#` go into the topic trie.
+ *
+ * Writers serialise on xWriteMutex, handleIncomingPublishes() takes no lock at
+ * all. Subscriptions and nodes unlinked by a writer are retired rather than
+ * reused right away: they keep their contents until the dispatch that may still
+ * be walking over them has returned, which ulDispatchSequence tells.
+ */
+typedef struct subscriptionIndex {
+    SubscriptionElement_t *pxSubscriptionList;                   /**< The list this index covers. */
+#if SUBSCRIPTION_MANAGER_USE_POOL
+    SubscriptionElement_t *pxChunks[SUBSCRIPTION_POOL_MAX_CHUNKS]; /**< Chunks taken from the pool. */
+#endif
+    SemaphoreHandle_t xWriteMutex;                               /**< Held while the index is modified. */
+    StaticSemaphore_t xWriteMutexBuffer;                         /**< Storage of xWriteMutex. */
+    uint32_t ulDispatchSequence;                                 /**< Odd while handleIncomingPublishes() runs. */
+    uint16_t usCapacity;                                         /**< Number of usable subscription slots. */
+    uint16_t usActive;                                           /**< Number of registered subscriptions. */
+    uint16_t usHighWaterMark;                                    /**< Highest value usActive has reached. */
+    uint16_t usExactBuckets[SUBSCRIPTION_MANAGER_EXACT_BUCKETS]; /**< Wildcard-free subscriptions (index + 1). */
+    uint16_t usFreeHead;                                         /**< First unused trie node. */
+    uint16_t usRetiredHead;                                      /**< First unlinked node not yet reusable. */
+    TopicTrieNode_t xNodes[SUBSCRIPTION_MANAGER_MAX_TRIE_NODES];
+    uint16_t usEdges[TRIE_EDGE_SLOTS];                           /**< Literal child nodes, TRIE_NODE_NONE if empty. */
+#if SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE > 0
+    uint16_t usArenaUsed;                                        /**< Headers taken from the start of xArena. */
+    FilterArenaRecord_t xArena[FILTER_ARENA_RECORDS];            /**< Copies of the topic filters. */
+#endif
+#if SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES > 0
+    uint32_t ulCacheGeneration;                                  /**< Incremented by every change to the subscriptions. */
+    uint32_t ulCacheHits;                                        /**< Publishes dispatched from xMatchCache. */
+    uint32_t ulCacheMisses;                                      /**< Publishes resolved through the index. */
+    uint16_t usCacheHand;                                        /**< Next entry considered for replacement. */
+    MatchCacheEntry_t xMatchCache[SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES]; /**< Only used by the dispatch. */
+#endif
+#if SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS > 0
+    const StaticSubscription_t *pxStaticSubscriptions;           /**< Table set with setStaticSubscriptions(). */
+    uint16_t usStaticSubscriptions;                              /**< Number of entries of the table. */
+    uint16_t usStaticWildcardCount;                              /**< Number of entries with wildcards. */
+    uint16_t usStaticBuckets[SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS]; /**< Wildcard-free entries (index + 1). */
+    uint16_t usStaticNext[SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS];    /**< Next entry of the bucket (index + 1). */
+    uint32_t ulStaticHashes[SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS];  /**< Hash of the filter of each entry. */
+    uint16_t usStaticWildcards[SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS]; /**< Entries with wildcards. */
+#endif
+} SubscriptionIndex_t;
+
+/**
+ * @brief The routing index.
+ *
+ * @note The index is bound to the first subscription list passed to the
+ * subscription manager, which is the list of the MQTT agent. Any other list is
+ * handled with a linear scan.
+ */
+static SubscriptionIndex_t xSubscriptionIndex;
+
+/**
+ * @brief Guards the binding of xSubscriptionIndex to its subscription list.
+ */
+static portMUX_TYPE xSubscriptionIndexSpinlock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Indices of the subscriptions matched by the publish being handled.
+ *
+ * @note Callbacks are invoked only after the lookup has completed, so that
+ * they can add and remove subscriptions without disturbing it.
+ */
+static uint16_t usMatchedSubscriptions[SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT];
+
+/**
+ * @brief Counts the publishes delivered to members of shared subscriptions,
+ * each member remembering the count of its last one.
+ */
+static uint32_t ulShareSequence;
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvHashString(const char *pcString,
+                              uint16_t usLength) {
+    uint32_t ulHash = 2166136261UL;
+    uint16_t usIndex;
+
+    for (usIndex = 0U; usIndex < usLength; usIndex++) {
+        ulHash ^= (uint8_t) pcString[usIndex];
+        ulHash *= 16777619UL;
+    }
+
+    return ulHash;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvHasWildcard(const char *pcTopicFilterString,
+                           uint16_t usTopicFilterLength) {
+    return (memchr(pcTopicFilterString, '+', usTopicFilterLength) != NULL) ||
+           (memchr(pcTopicFilterString, '#', usTopicFilterLength) != NULL);
+}
+
+/*-----------------------------------------------------------*/
+
+static uint16_t prvShareGroupLength(const char *pcTopicFilterString,
+                                    uint16_t usTopicFilterLength) {
+    const char *pcGroupEnd;
+    uint16_t usPrefixLength = 0U;
+
+    if ((usTopicFilterLength > SHARE_PREFIX_LENGTH) &&
+        (memcmp(pcTopicFilterString, SHARE_PREFIX, SHARE_PREFIX_LENGTH) == 0)) {
+        pcGroupEnd = memchr(&(pcTopicFilterString[SHARE_PREFIX_LENGTH]), '/',
+                            usTopicFilterLength - SHARE_PREFIX_LENGTH);
+
+        /* The group needs a name and a topic filter after it. */
+        if ((pcGroupEnd != NULL) && (pcGroupEnd > &(pcTopicFilterString[SHARE_PREFIX_LENGTH])) &&
+            (pcGroupEnd + 1 < pcTopicFilterString + usTopicFilterLength)) {
+            usPrefixLength = (uint16_t) (pcGroupEnd + 1 - pcTopicFilterString);
+        }
+    }
+
+    return usPrefixLength;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvIsValidTopicFilter(const char *pcTopicFilterString,
+                                  uint16_t usTopicFilterLength) {
+    uint16_t usIndex, usShareGroupLength;
+    bool xValid = true;
+
+    usShareGroupLength = prvShareGroupLength(pcTopicFilterString, usTopicFilterLength);
+
+    /* A shared subscription needs a group and a filter, and the group name
+     * takes no wildcard. */
+    if ((usTopicFilterLength >= SHARE_PREFIX_LENGTH) &&
+        (memcmp(pcTopicFilterString, SHARE_PREFIX, SHARE_PREFIX_LENGTH) == 0)) {
+        xValid = (usShareGroupLength > 0U) &&
+                 (prvHasWildcard(pcTopicFilterString, usShareGroupLength) == false);
+    }
+
+    /* Wildcards must take a whole level, and `#` must be the last one. */
+    for (usIndex = usShareGroupLength; (usIndex < usTopicFilterLength) && xValid; usIndex++) {
+        if ((pcTopicFilterString[usIndex] == '+') || (pcTopicFilterString[usIndex] == '#')) {
+            xValid = ((usIndex == usShareGroupLength) || (pcTopicFilterString[usIndex - 1U] == '/')) &&
+                     ((usIndex + 1U == usTopicFilterLength) ||
+                      ((pcTopicFilterString[usIndex] == '+') && (pcTopicFilterString[usIndex + 1U] == '/')));
+        }
+    }
+
+    return xValid;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint16_t prvCountFilterLevels(const char *pcTopicFilterString,
+                                     uint16_t usTopicFilterLength) {
+    uint16_t usShareGroupLength = prvShareGroupLength(pcTopicFilterString, usTopicFilterLength);
+    uint16_t usIndex, usLevels = 1U;
+
+    for (usIndex = usShareGroupLength; usIndex < usTopicFilterLength; usIndex++) {
+        if (pcTopicFilterString[usIndex] == '/') {
+            usLevels++;
+        }
+    }
+
+    /* A trailing `#` is not a level of its own. */
+    if (pcTopicFilterString[usTopicFilterLength - 1U] == '#') {
+        usLevels--;
+    }
+
+    return usLevels;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCompileFilter(SubscriptionElement_t *pxSubscription) {
+    const char *pcFilter;
+    const char *pcFilterEnd = pxSubscription->pcSubscriptionFilterString + pxSubscription->usFilterStringLength;
+    const char *pcLevel;
+    const char *pcLevelEnd;
+    uint16_t usLevel = 0U;
+    bool xWildcard, xWildcardSeen = false;
+
+    /* The levels of a shared subscription start after its group. */
+    pxSubscription->usShareGroupLength = prvShareGroupLength(pxSubscription->pcSubscriptionFilterString,
+                                                             pxSubscription->usFilterStringLength);
+    pxSubscription->ulLastDelivery = 0U;
+    pcFilter = pxSubscription->pcSubscriptionFilterString + pxSubscription->usShareGroupLength;
+    pcLevel = pcFilter;
+
+    pxSubscription->xFilterCompiled = true;
+    pxSubscription->xMultiLevel = false;
+    pxSubscription->ulSingleLevelMask = 0U;
+
+    for (;;) {
+        pcLevelEnd = memchr(pcLevel, '/', (size_t) (pcFilterEnd - pcLevel));
+
+        if (pcLevelEnd == NULL) {
+            pcLevelEnd = pcFilterEnd;
+        }
+
+        xWildcard = ((pcLevelEnd - pcLevel) == 1) && ((*pcLevel == '#') || (*pcLevel == '+'));
+
+        if (xWildcard) {
+            if (xWildcardSeen == false) {
+                pxSubscription->ucPrefixLevels = (uint8_t) usLevel;
+                pxSubscription->usLiteralPrefixLength = (usLevel > 0U) ? (uint16_t) (pcLevel - pcFilter - 1) : 0U;
+                xWildcardSeen = true;
+            }
+
+            if (*pcLevel == '#') {
+                pxSubscription->xMultiLevel = true;
+                break;
+            }
+        }
+
+        if (usLevel == SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS) {
+            pxSubscription->xFilterCompiled = false;
+            break;
+        }
+
+        if (xWildcard) {
+            pxSubscription->ulSingleLevelMask |= (1UL << usLevel);
+        }
+
+        /* Only the levels from the first wildcard on are compared one by one,
+         * and their offsets have to fit a byte. */
+        if ((pcLevel - pcFilter) <= UINT8_MAX) {
+            pxSubscription->ucLevelOffsets[usLevel] = (uint8_t) (pcLevel - pcFilter);
+        } else if (xWildcardSeen) {
+            pxSubscription->xFilterCompiled = false;
+        }
+
+        usLevel++;
+
+        if (pcLevelEnd == pcFilterEnd) {
+            break;
+        }
+
+        pcLevel = pcLevelEnd + 1;
+    }
+
+    if (xWildcardSeen == false) {
+        pxSubscription->ucPrefixLevels = (uint8_t) usLevel;
+        pxSubscription->usLiteralPrefixLength = (uint16_t) (pcFilterEnd - pcFilter);
+    }
+
+    pxSubscription->ucLevelCount = (uint8_t) usLevel;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvSplitTopic(const MQTTPublishInfo_t *pxPublishInfo,
+                          TopicLevels_t *pxTopicLevels) {
+    const char *pcTopic = pxPublishInfo->pTopicName;
+    const char *pcTopicEnd = pcTopic + pxPublishInfo->topicNameLength;
+    const char *pcLevel = pcTopic;
+
+    pxTopicLevels->usLevelCount = 0U;
+
+    while (pcLevel != NULL) {
+        if (pxTopicLevels->usLevelCount <= SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS) {
+            pxTopicLevels->usLevelOffsets[pxTopicLevels->usLevelCount] = (uint16_t) (pcLevel - pcTopic);
+        }
+
+        pxTopicLevels->usLevelCount++;
+        pcLevel = memchr(pcLevel, '/', (size_t) (pcTopicEnd - pcLevel));
+
+        if (pcLevel != NULL) {
+            pcLevel++;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCaptureWildcards(const SubscriptionElement_t *pxSubscription,
+                                const MQTTPublishInfo_t *pxPublishInfo,
+                                const TopicLevels_t *pxTopicLevels,
+                                SubscriptionMatch_t *pxMatch) {
+    TopicCapture_t *pxCapture;
+    uint16_t usLevel, usTail;
+
+    pxMatch->pcTopicFilterString = pxSubscription->pcSubscriptionFilterString + pxSubscription->usShareGroupLength;
+    pxMatch->usTopicFilterLength = (uint16_t) (pxSubscription->usFilterStringLength -
+                                               pxSubscription->usShareGroupLength);
+    pxMatch->xMultiLevel = pxSubscription->xMultiLevel;
+    pxMatch->ucCaptureCount = 0U;
+
+    /* The filter matched, so its level n is level n of the topic, which was
+     * already split by the matcher. */
+    for (usLevel = pxSubscription->ucPrefixLevels; usLevel < pxSubscription->ucLevelCount; usLevel++) {
+        if ((pxSubscription->ulSingleLevelMask & (1UL << usLevel)) != 0U) {
+            pxCapture = &(pxMatch->xCaptures[pxMatch->ucCaptureCount]);
+            pxCapture->usOffset = pxTopicLevels->usLevelOffsets[usLevel];
+            pxCapture->usLength = (uint16_t) (((usLevel + 1U < pxTopicLevels->usLevelCount)
+                                               ? (uint16_t) (pxTopicLevels->usLevelOffsets[usLevel + 1U] - 1U)
+                                               : pxPublishInfo->topicNameLength) - pxCapture->usOffset);
+            pxMatch->ucCaptureCount++;
+        }
+    }
+
+    if (pxSubscription->xMultiLevel) {
+        usTail = (pxSubscription->ucLevelCount < pxTopicLevels->usLevelCount)
+                     ? pxTopicLevels->usLevelOffsets[pxSubscription->ucLevelCount]
+                     : pxPublishInfo->topicNameLength;
+        pxMatch->xCaptures[pxMatch->ucCaptureCount].usOffset = usTail;
+        pxMatch->xCaptures[pxMatch->ucCaptureCount].usLength = (uint16_t) (pxPublishInfo->topicNameLength - usTail);
+        pxMatch->ucCaptureCount++;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvMatchCompiledFilter(const SubscriptionElement_t *pxSubscription,
+                                   const MQTTPublishInfo_t *pxPublishInfo,
+                                   const TopicLevels_t *pxTopicLevels) {
+    const char *pcTopic = pxPublishInfo->pTopicName;
+    const char *pcFilter = pxSubscription->pcSubscriptionFilterString + pxSubscription->usShareGroupLength;
+    uint16_t usFilterLength = (uint16_t) (pxSubscription->usFilterStringLength - pxSubscription->usShareGroupLength);
+    uint16_t usLevel, usTopicLevelEnd, usFilterLevelEnd, usLevelLength;
+    bool isMatched;
+
+    /* Every level of the filter needs a level of the topic, and only a
+     * trailing `#` takes any number of further levels. */
+    isMatched = (pxPublishInfo->topicNameLength > 0U) &&
+                (pxSubscription->xMultiLevel ? (pxTopicLevels->usLevelCount >= pxSubscription->ucLevelCount)
+                                             : (pxTopicLevels->usLevelCount == pxSubscription->ucLevelCount));
+
+    /* Topics starting with `$` are not matched by a wildcard on the first level. */
+    if (isMatched && (pcTopic[0] == '$') &&
+        ((pxSubscription->ucLevelCount == 0U) || ((pxSubscription->ulSingleLevelMask & 1UL) != 0U))) {
+        isMatched = false;
+    }
+
+    /* The literal levels in front of the first wildcard are compared at once. */
+    if (isMatched && (pxSubscription->ucPrefixLevels > 0U)) {
+        usTopicLevelEnd = (pxSubscription->ucPrefixLevels < pxTopicLevels->usLevelCount)
+                              ? (uint16_t) (pxTopicLevels->usLevelOffsets[pxSubscription->ucPrefixLevels] - 1U)
+                              : pxPublishInfo->topicNameLength;
+        isMatched = (usTopicLevelEnd == pxSubscription->usLiteralPrefixLength) &&
+                    (memcmp(pcTopic, pcFilter, pxSubscription->usLiteralPrefixLength) == 0);
+    }
+
+    for (usLevel = pxSubscription->ucPrefixLevels; isMatched && (usLevel < pxSubscription->ucLevelCount); usLevel++) {
+        if ((pxSubscription->ulSingleLevelMask & (1UL << usLevel)) == 0U) {
+            usTopicLevelEnd = (usLevel + 1U < pxTopicLevels->usLevelCount)
+                                  ? (uint16_t) (pxTopicLevels->usLevelOffsets[usLevel + 1U] - 1U)
+                                  : pxPublishInfo->topicNameLength;
+            usFilterLevelEnd = (usLevel + 1U < pxSubscription->ucLevelCount)
+                                   ? (uint16_t) (pxSubscription->ucLevelOffsets[usLevel + 1U] - 1U)
+                                   : (uint16_t) (usFilterLength - (pxSubscription->xMultiLevel ? 2U : 0U));
+            usLevelLength = (uint16_t) (usFilterLevelEnd - pxSubscription->ucLevelOffsets[usLevel]);
+
+            isMatched = ((usTopicLevelEnd - pxTopicLevels->usLevelOffsets[usLevel]) == usLevelLength) &&
+                        (memcmp(&(pcTopic[pxTopicLevels->usLevelOffsets[usLevel]]),
+                                &(pcFilter[pxSubscription->ucLevelOffsets[usLevel]]),
+                                usLevelLength) == 0);
+        }
+    }
+
+    return isMatched;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvGetRetiredSequence(SubscriptionIndex_t *pxIndex) {
+    /* Order the unlinking stores before the read of the sequence. Pairs with
+     * the fence at the start of handleIncomingPublishes(). */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&(pxIndex->ulDispatchSequence), __ATOMIC_SEQ_CST);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvIsReclaimable(SubscriptionIndex_t *pxIndex,
+                             uint32_t ulRetiredSequence) {
+    /* Nothing can still be looking at an unlinked object if no dispatch was
+     * running when it was unlinked, or if that dispatch has returned since. */
+    return ((ulRetiredSequence & 1U) == 0U) ||
+           (__atomic_load_n(&(pxIndex->ulDispatchSequence), __ATOMIC_SEQ_CST) != ulRetiredSequence);
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvEdgeHomeSlot(uint16_t usParent,
+                                uint32_t ulLevelHash) {
+    return (ulLevelHash ^ ((uint32_t) usParent * 0x9E3779B1UL)) % TRIE_EDGE_SLOTS;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint16_t prvTrieFindChild(const SubscriptionIndex_t *pxIndex,
+                                 uint16_t usParent,
+                                 uint32_t ulLevelHash,
+                                 uint16_t usLevelLength) {
+    uint32_t ulSlot = prvEdgeHomeSlot(usParent, ulLevelHash);
+    uint32_t ulProbe;
+    uint16_t usEntry, usNode = TRIE_NODE_NONE;
+
+    for (ulProbe = 0U; ulProbe < TRIE_EDGE_SLOTS; ulProbe++) {
+        usEntry = LOAD_ACQUIRE(pxIndex->usEdges[ulSlot]);
+
+        if (usEntry == TRIE_NODE_NONE) {
+            break;
+        }
+
+        if ((usEntry != TRIE_EDGE_TOMBSTONE) &&
+            (pxIndex->xNodes[usEntry].usParent == usParent) &&
+            (pxIndex->xNodes[usEntry].ulLevelHash == ulLevelHash) &&
+            (pxIndex->xNodes[usEntry].usLevelLength == usLevelLength)) {
+            usNode = usEntry;
+            break;
+        }
+
+        ulSlot = (ulSlot + 1U) % TRIE_EDGE_SLOTS;
+    }
+
+    return usNode;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvTrieInsertEdge(SubscriptionIndex_t *pxIndex,
+                              uint16_t usNode) {
+    uint32_t ulSlot = prvEdgeHomeSlot(pxIndex->xNodes[usNode].usParent, pxIndex->xNodes[usNode].ulLevelHash);
+
+    /* The table has twice as many slots as there are nodes, so it never fills up. */
+    while ((pxIndex->usEdges[ulSlot] != TRIE_NODE_NONE) &&
+           (pxIndex->usEdges[ulSlot] != TRIE_EDGE_TOMBSTONE)) {
+        ulSlot = (ulSlot + 1U) % TRIE_EDGE_SLOTS;
+    }
+
+    STORE_RELEASE(pxIndex->usEdges[ulSlot], usNode);
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvTrieRemoveEdge(SubscriptionIndex_t *pxIndex,
+                              uint16_t usNode) {
+    uint32_t ulSlot = prvEdgeHomeSlot(pxIndex->xNodes[usNode].usParent, pxIndex->xNodes[usNode].ulLevelHash);
+
+    while (pxIndex->usEdges[ulSlot] != usNode) {
+        ulSlot = (ulSlot + 1U) % TRIE_EDGE_SLOTS;
+    }
+
+    STORE_RELEASE(pxIndex->usEdges[ulSlot], TRIE_EDGE_TOMBSTONE);
+
+    /* A lookup never probes across an empty slot, so the tombstones directly
+     * in front of one are not on the probe sequence of any entry and can be
+     * emptied as well. Entries are never moved, a reader probing concurrently
+     * could otherwise miss one. */
+    if (pxIndex->usEdges[(ulSlot + 1U) % TRIE_EDGE_SLOTS] == TRIE_NODE_NONE) {
+        while (pxIndex->usEdges[ulSlot] == TRIE_EDGE_TOMBSTONE) {
+            STORE_RELEASE(pxIndex->usEdges[ulSlot], TRIE_NODE_NONE);
+            ulSlot = (ulSlot + TRIE_EDGE_SLOTS - 1U) % TRIE_EDGE_SLOTS;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static uint16_t prvTrieAllocateNode(SubscriptionIndex_t *pxIndex,
+                                    uint16_t usParent,
+                                    uint32_t ulLevelHash,
+                                    uint16_t usLevelLength) {
+    uint16_t usNode, *pusLink = &(pxIndex->usRetiredHead);
+
+    /* Move the retired nodes no dispatch can reach anymore to the free list. */
+    while ((usNode = *pusLink) != TRIE_NODE_NONE) {
+        if (prvIsReclaimable(pxIndex, pxIndex->xNodes[usNode].ulRetiredSequence)) {
+            *pusLink = pxIndex->xNodes[usNode].usNextFree;
+            pxIndex->xNodes[usNode].usNextFree = pxIndex->usFreeHead;
+            pxIndex->usFreeHead = usNode;
+        } else {
+            pusLink = &(pxIndex->xNodes[usNode].usNextFree);
+        }
+    }
+
+    usNode = pxIndex->usFreeHead;
+
+    if (usNode != TRIE_NODE_NONE) {
+        pxIndex->usFreeHead = pxIndex->xNodes[usNode].usNextFree;
+        memset(&(pxIndex->xNodes[usNode]), 0x00, sizeof(TopicTrieNode_t));
+        pxIndex->xNodes[usNode].ulLevelHash = ulLevelHash;
+        pxIndex->xNodes[usNode].usLevelLength = usLevelLength;
+        pxIndex->xNodes[usNode].usParent = usParent;
+        pxIndex->xNodes[usParent].usRefCount++;
+    } else {
+        ESP_LOGE(TAG, "Topic trie is full, increase CONFIG_MQTT_SUBSCRIPTION_TRIE_MAX_NODES.");
+    }
+
+    return usNode;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvTriePrune(SubscriptionIndex_t *pxIndex,
+                         uint16_t usNode) {
+    uint16_t usParent;
+
+    /* Retire the node and its ancestors for as long as nothing is attached to them. */
+    while ((usNode != TRIE_ROOT_NODE) && (pxIndex->xNodes[usNode].usRefCount == 0U)) {
+        usParent = pxIndex->xNodes[usNode].usParent;
+
+        if (pxIndex->xNodes[usParent].usPlusChild == usNode) {
+            STORE_RELEASE(pxIndex->xNodes[usParent].usPlusChild, TRIE_NODE_NONE);
+        } else {
+            prvTrieRemoveEdge(pxIndex, usNode);
+        }
+
+        pxIndex->xNodes[usNode].ulRetiredSequence = prvGetRetiredSequence(pxIndex);
+        pxIndex->xNodes[usNode].usNextFree = pxIndex->usRetiredHead;
+        pxIndex->usRetiredHead = usNode;
+        pxIndex->xNodes[usParent].usRefCount--;
+        usNode = usParent;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvTrieFindNode(SubscriptionIndex_t *pxIndex,
+                            const char *pcTopicFilterString,
+                            uint16_t usTopicFilterLength,
+                            bool xCreate,
+                            uint16_t *pusNode,
+                            bool *pxMultiLevel) {
+    const char *pcLevel = pcTopicFilterString;
+    const char *pcFilterEnd = pcTopicFilterString + usTopicFilterLength;
+    const char *pcLevelEnd;
+    uint16_t usNode = TRIE_ROOT_NODE, usChild, usLevelLength;
+    uint32_t ulLevelHash;
+    bool xFound = true;
+
+    *pxMultiLevel = false;
+
+    for (;;) {
+        pcLevelEnd = memchr(pcLevel, '/', (size_t) (pcFilterEnd - pcLevel));
+
+        if (pcLevelEnd == NULL) {
+            pcLevelEnd = pcFilterEnd;
+        }
+
+        usLevelLength = (uint16_t) (pcLevelEnd - pcLevel);
+
+        if ((usLevelLength == 1U) && (*pcLevel == '#') && (pcLevelEnd == pcFilterEnd)) {
+            /* Multi-level wildcard, the filter is attached to the node in front of it. */
+            *pxMultiLevel = true;
+            break;
+        }
+
+        if ((usLevelLength == 1U) && (*pcLevel == '+')) {
+            usChild = pxIndex->xNodes[usNode].usPlusChild;
+
+            if ((usChild == TRIE_NODE_NONE) && xCreate) {
+                usChild = prvTrieAllocateNode(pxIndex, usNode, 0U, 0U);
+                STORE_RELEASE(pxIndex->xNodes[usNode].usPlusChild, usChild);
+            }
+        } else {
+            ulLevelHash = prvHashString(pcLevel, usLevelLength);
+            usChild = prvTrieFindChild(pxIndex, usNode, ulLevelHash, usLevelLength);
+
+            if ((usChild == TRIE_NODE_NONE) && xCreate) {
+                usChild = prvTrieAllocateNode(pxIndex, usNode, ulLevelHash, usLevelLength);
+
+                if (usChild != TRIE_NODE_NONE) {
+                    prvTrieInsertEdge(pxIndex, usChild);
+                }
+            }
+        }
+
+        if (usChild == TRIE_NODE_NONE) {
+            /* Release the nodes created for the levels in front of this one. */
+            if (xCreate) {
+                prvTriePrune(pxIndex, usNode);
+            }
+
+            xFound = false;
+            break;
+        }
+
+        usNode = usChild;
+
+        if (pcLevelEnd == pcFilterEnd) {
+            break;
+        }
+
+        pcLevel = pcLevelEnd + 1;
+    }
+
+    *pusNode = usNode;
+
+    return xFound;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvFindSubscriptionChain(SubscriptionIndex_t *pxIndex,
+                                     const char *pcTopicFilterString,
+                                     uint16_t usTopicFilterLength,
+                                     bool xCreate,
+                                     uint16_t **ppusHead,
+                                     uint16_t *pusNode,
+                                     uint32_t *pulFilterHash) {
+    uint16_t usShareGroupLength = prvShareGroupLength(pcTopicFilterString, usTopicFilterLength);
+    bool xMultiLevel, xFound = true;
+
+    /* Shared subscriptions are routed by the filter after their group. */
+    pcTopicFilterString += usShareGroupLength;
+    usTopicFilterLength = (uint16_t) (usTopicFilterLength - usShareGroupLength);
+
+    if (prvHasWildcard(pcTopicFilterString, usTopicFilterLength) == false) {
+        *pulFilterHash = prvHashString(pcTopicFilterString, usTopicFilterLength);
+        *pusNode = TRIE_NODE_NONE;
+        *ppusHead = &(pxIndex->usExactBuckets[*pulFilterHash % SUBSCRIPTION_MANAGER_EXACT_BUCKETS]);
+    } else if (prvTrieFindNode(pxIndex, pcTopicFilterString, usTopicFilterLength, xCreate, pusNode, &xMultiLevel)) {
+        *pulFilterHash = 0U;
+        *ppusHead = xMultiLevel ? &(pxIndex->xNodes[*pusNode].usMultiHead) : &(pxIndex->xNodes[*pusNode].usExactHead);
+    } else {
+        xFound = false;
+    }
+
+    return xFound;
+}
+
+/*-----------------------------------------------------------*/
+
+static SubscriptionElement_t *prvGetElement(const SubscriptionIndex_t *pxIndex,
+                                            uint32_t ulSlot) {
+    SubscriptionElement_t *pxSubscription;
+
+#if SUBSCRIPTION_MANAGER_USE_POOL
+    if (ulSlot >= SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS) {
+        ulSlot -= SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+        pxSubscription = &(pxIndex->pxChunks[ulSlot / SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE]
+                                            [ulSlot % SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE]);
+    } else
+#endif
+    {
+        pxSubscription = &(pxIndex->pxSubscriptionList[ulSlot]);
+    }
+
+    return pxSubscription;
+}
+
+/*-----------------------------------------------------------*/
+
+#if SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE > 0
+
+static const char *prvArenaAllocate(SubscriptionIndex_t *pxIndex,
+                                    const char *pcTopicFilterString,
+                                    uint16_t usTopicFilterLength) {
+    uint32_t ulSize = 1U + ((usTopicFilterLength + sizeof(FilterArenaRecord_t)) / sizeof(FilterArenaRecord_t));
+    uint32_t ulRecord = 0U;
+    FilterArenaRecord_t *pxRecord = NULL;
+
+    /* First fit among the free records, then the end of the arena. */
+    while (ulRecord < pxIndex->usArenaUsed) {
+        if ((pxIndex->xArena[ulRecord].usRefCount == 0U) && (pxIndex->xArena[ulRecord].usSize >= ulSize)) {
+            pxRecord = &(pxIndex->xArena[ulRecord]);
+
+            if (pxRecord->usSize > ulSize) {
+                pxRecord[ulSize].usSize = (uint16_t) (pxRecord->usSize - ulSize);
+                pxRecord[ulSize].usRefCount = 0U;
+                pxRecord->usSize = (uint16_t) ulSize;
+            }
+
+            break;
+        }
+
+        ulRecord += pxIndex->xArena[ulRecord].usSize;
+    }
+
+    if ((pxRecord == NULL) && (ulSize <= FILTER_ARENA_RECORDS - pxIndex->usArenaUsed)) {
+        pxRecord = &(pxIndex->xArena[pxIndex->usArenaUsed]);
+        pxRecord->usSize = (uint16_t) ulSize;
+        pxIndex->usArenaUsed += (uint16_t) ulSize;
+    }
+
+    if (pxRecord != NULL) {
+        pxRecord->usRefCount = 1U;
+        memcpy(&(pxRecord[1]), pcTopicFilterString, usTopicFilterLength);
+        ((char *) &(pxRecord[1]))[usTopicFilterLength] = '\0';
+    }
+
+    return (pxRecord != NULL) ? (const char *) &(pxRecord[1]) : NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvArenaRelease(SubscriptionIndex_t *pxIndex,
+                            const char *pcFilter) {
+    uint32_t ulRecord = (uint32_t) (((const FilterArenaRecord_t *) (const void *) pcFilter) - pxIndex->xArena) - 1U;
+    uint32_t ulNext;
+
+    pxIndex->xArena[ulRecord].usRefCount--;
+
+    if (pxIndex->xArena[ulRecord].usRefCount == 0U) {
+        /* Merge the free records following each other, and hand a free record
+         * at the end back to the arena. */
+        ulRecord = 0U;
+
+        while (ulRecord < pxIndex->usArenaUsed) {
+            ulNext = ulRecord + pxIndex->xArena[ulRecord].usSize;
+
+            if (pxIndex->xArena[ulRecord].usRefCount != 0U) {
+                ulRecord = ulNext;
+            } else if (ulNext >= pxIndex->usArenaUsed) {
+                pxIndex->usArenaUsed = (uint16_t) ulRecord;
+            } else if (pxIndex->xArena[ulNext].usRefCount == 0U) {
+                pxIndex->xArena[ulRecord].usSize += pxIndex->xArena[ulNext].usSize;
+            } else {
+                ulRecord = ulNext;
+            }
+        }
+    }
+}
+
+#endif /* if SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE > 0 */
+
+/*-----------------------------------------------------------*/
+
+static void prvReleaseFilter(SubscriptionIndex_t *pxIndex,
+                             const char *pcFilter) {
+#if SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE > 0
+    prvArenaRelease(pxIndex, pcFilter);
+#else
+    (void) pxIndex;
+    (void) pcFilter;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvReclaimSubscription(SubscriptionIndex_t *pxIndex,
+                                   SubscriptionElement_t *pxSubscription) {
+    prvReleaseFilter(pxIndex, pxSubscription->pcSubscriptionFilterString);
+    memset(pxSubscription, 0x00, sizeof(SubscriptionElement_t));
+}
+
+/*-----------------------------------------------------------*/
+
+static const char *prvInternFilter(SubscriptionIndex_t *pxIndex,
+                                   const char *pcTopicFilterString,
+                                   uint16_t usTopicFilterLength,
+                                   const char *pcSharedFilter) {
+#if SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE > 0
+    const char *pcFilter = pcSharedFilter;
+    SubscriptionElement_t *pxSubscription;
+    uint32_t ulSlot;
+
+    if (pcFilter != NULL) {
+        /* Another subscription has the same filter, share its copy. */
+        pxIndex->xArena[((const FilterArenaRecord_t *) (const void *) pcFilter - pxIndex->xArena) - 1].usRefCount++;
+    } else {
+        pcFilter = prvArenaAllocate(pxIndex, pcTopicFilterString, usTopicFilterLength);
+
+        if (pcFilter == NULL) {
+            /* Retired subscriptions only give their filter back once reused,
+             * reclaim all of them before giving up. */
+            for (ulSlot = 0U; ulSlot < pxIndex->usCapacity; ulSlot++) {
+                pxSubscription = prvGetElement(pxIndex, ulSlot);
+
+                if (pxSubscription->xRetired && prvIsReclaimable(pxIndex, pxSubscription->ulRetiredSequence)) {
+                    prvReclaimSubscription(pxIndex, pxSubscription);
+                }
+            }
+
+            pcFilter = prvArenaAllocate(pxIndex, pcTopicFilterString, usTopicFilterLength);
+        }
+
+        if (pcFilter == NULL) {
+            ESP_LOGE(TAG, "Topic filter arena is full, increase CONFIG_MQTT_SUBSCRIPTION_FILTER_ARENA_SIZE.");
+        }
+    }
+
+    return pcFilter;
+#else
+    (void) pxIndex;
+    (void) usTopicFilterLength;
+    (void) pcSharedFilter;
+
+    return pcTopicFilterString;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvAllocateSlot(SubscriptionIndex_t *pxIndex,
+                            uint32_t *pulSlot) {
+    SubscriptionElement_t *pxSubscription;
+    uint32_t ulSlot;
+    bool xAllocated = false;
+
+    for (ulSlot = 0U; ulSlot < pxIndex->usCapacity; ulSlot++) {
+        pxSubscription = prvGetElement(pxIndex, ulSlot);
+
+        if (pxSubscription->usFilterStringLength == 0) {
+            xAllocated = true;
+            break;
+        }
+
+        if (pxSubscription->xRetired && prvIsReclaimable(pxIndex, pxSubscription->ulRetiredSequence)) {
+            prvReclaimSubscription(pxIndex, pxSubscription);
+            xAllocated = true;
+            break;
+        }
+    }
+
+#if SUBSCRIPTION_MANAGER_USE_POOL
+    /* Grow the store by one chunk when the slots in use are all taken. */
+    if ((xAllocated == false) && (pxIndex->usCapacity < SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT)) {
+        SubscriptionElement_t *pxChunk = pvPortMalloc(sizeof(SubscriptionElement_t) *
+                                                      SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE);
+
+        if (pxChunk != NULL) {
+            memset(pxChunk, 0x00, sizeof(SubscriptionElement_t) * SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE);
+            pxIndex->pxChunks[(pxIndex->usCapacity - SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS) /
+                              SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE] = pxChunk;
+            ulSlot = pxIndex->usCapacity;
+            pxIndex->usCapacity += SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE;
+
+            if (pxIndex->usCapacity > SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT) {
+                pxIndex->usCapacity = SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT;
+            }
+
+            xAllocated = true;
+        } else {
+            ESP_LOGE(TAG, "Failed to allocate a chunk of %u subscriptions.",
+                     (unsigned int) SUBSCRIPTION_MANAGER_POOL_CHUNK_SIZE);
+        }
+    }
+#endif
+
+    *pulSlot = ulSlot;
+
+    return xAllocated;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvTrieCollectChain(const SubscriptionIndex_t *pxIndex,
+                                uint16_t usLink,
+                                uint16_t *pusMatchCount) {
+    while ((usLink != 0U) && (*pusMatchCount < SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT)) {
+        usMatchedSubscriptions[*pusMatchCount] = (uint16_t) (usLink - 1U);
+        (*pusMatchCount)++;
+        usLink = LOAD_ACQUIRE(prvGetElement(pxIndex, usLink - 1U)->usNextInNode);
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvTrieCollectMatches(const SubscriptionIndex_t *pxIndex,
+                                  uint16_t usNode,
+                                  const char *pcLevel,
+                                  const char *pcTopicEnd,
+                                  bool xTopicEnd,
+                                  uint16_t *pusMatchCount) {
+    const TopicTrieNode_t *pxNode = &(pxIndex->xNodes[usNode]);
+    const char *pcLevelEnd;
+    uint16_t usChild, usLevelLength;
+
+    /* A `#` following this node matches whatever is left of the topic,
+     * including nothing at all. */
+    prvTrieCollectChain(pxIndex, LOAD_ACQUIRE(pxNode->usMultiHead), pusMatchCount);
+
+    if (xTopicEnd) {
+        prvTrieCollectChain(pxIndex, LOAD_ACQUIRE(pxNode->usExactHead), pusMatchCount);
+    } else {
+        pcLevelEnd = memchr(pcLevel, '/', (size_t) (pcTopicEnd - pcLevel));
+
+        if (pcLevelEnd == NULL) {
+            pcLevelEnd = pcTopicEnd;
+        }
+
+        usLevelLength = (uint16_t) (pcLevelEnd - pcLevel);
+
+        usChild = prvTrieFindChild(pxIndex, usNode, prvHashString(pcLevel, usLevelLength), usLevelLength);
+
+        if (usChild != TRIE_NODE_NONE) {
+            prvTrieCollectMatches(pxIndex, usChild, pcLevelEnd + 1, pcTopicEnd,
+                                  pcLevelEnd == pcTopicEnd, pusMatchCount);
+        }
+
+        usChild = LOAD_ACQUIRE(pxNode->usPlusChild);
+
+        if (usChild != TRIE_NODE_NONE) {
+            prvTrieCollectMatches(pxIndex, usChild, pcLevelEnd + 1, pcTopicEnd,
+                                  pcLevelEnd == pcTopicEnd, pusMatchCount);
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvInvalidateMatchCache(SubscriptionIndex_t *pxIndex) {
+#if SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES > 0
+    /* Published after an addition, so a dispatch seeing the new generation
+     * also sees it. */
+    __atomic_fetch_add(&(pxIndex->ulCacheGeneration), 1U, __ATOMIC_RELEASE);
+#else
+    (void) pxIndex;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+#if SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES > 0
+
+static MatchCacheEntry_t *prvMatchCacheFind(SubscriptionIndex_t *pxIndex,
+                                            const MQTTPublishInfo_t *pxPublishInfo,
+                                            uint32_t ulTopicHash) {
+    MatchCacheEntry_t *pxEntry = NULL;
+    uint32_t ulEntry;
+
+    for (ulEntry = 0U; ulEntry < SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES; ulEntry++) {
+        if ((pxIndex->xMatchCache[ulEntry].ulTopicHash == ulTopicHash) &&
+            (pxIndex->xMatchCache[ulEntry].usTopicLength == pxPublishInfo->topicNameLength) &&
+            (memcmp(pxIndex->xMatchCache[ulEntry].cTopic, pxPublishInfo->pTopicName,
+                    pxPublishInfo->topicNameLength) == 0)) {
+            pxEntry = &(pxIndex->xMatchCache[ulEntry]);
+            break;
+        }
+    }
+
+    return pxEntry;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvMatchCacheStore(SubscriptionIndex_t *pxIndex,
+                               MatchCacheEntry_t *pxEntry,
+                               const MQTTPublishInfo_t *pxPublishInfo,
+                               uint32_t ulTopicHash,
+                               uint32_t ulGeneration,
+                               uint16_t usMatchCount) {
+    if ((pxPublishInfo->topicNameLength > 0U) &&
+        (pxPublishInfo->topicNameLength <= SUBSCRIPTION_MANAGER_MATCH_CACHE_TOPIC_LENGTH) &&
+        (usMatchCount <= SUBSCRIPTION_MANAGER_MATCH_CACHE_MATCHES)) {
+        if (pxEntry == NULL) {
+            /* Evict the first entry not hit since the hand last passed it. */
+            while (pxIndex->xMatchCache[pxIndex->usCacheHand].xReferenced) {
+                pxIndex->xMatchCache[pxIndex->usCacheHand].xReferenced = false;
+                pxIndex->usCacheHand = (uint16_t) ((pxIndex->usCacheHand + 1U) % SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES);
+            }
+
+            pxEntry = &(pxIndex->xMatchCache[pxIndex->usCacheHand]);
+            pxIndex->usCacheHand = (uint16_t) ((pxIndex->usCacheHand + 1U) % SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES);
+            memcpy(pxEntry->cTopic, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
+            pxEntry->ulTopicHash = ulTopicHash;
+            pxEntry->usTopicLength = pxPublishInfo->topicNameLength;
+        }
+
+        memcpy(pxEntry->usMatches, usMatchedSubscriptions, sizeof(uint16_t) * usMatchCount);
+        pxEntry->usMatchCount = usMatchCount;
+        pxEntry->ulGeneration = ulGeneration;
+        pxEntry->xReferenced = false;
+    }
+}
+
+#endif /* if SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES > 0 */
+
+/*-----------------------------------------------------------*/
+
+static SubscriptionIndex_t *prvGetSubscriptionIndex(SubscriptionElement_t *pxSubscriptionList) {
+    SubscriptionElement_t *pxBoundList = LOAD_ACQUIRE(xSubscriptionIndex.pxSubscriptionList);
+    uint16_t usNode;
+
+    if (pxBoundList == NULL) {
+        taskENTER_CRITICAL(&xSubscriptionIndexSpinlock);
+
+        if (xSubscriptionIndex.pxSubscriptionList == NULL) {
+            /* Chain all nodes except the root into the free list. */
+            for (usNode = 1U; usNode < SUBSCRIPTION_MANAGER_MAX_TRIE_NODES; usNode++) {
+                xSubscriptionIndex.xNodes[usNode].usNextFree = (uint16_t) ((usNode + 1U) % SUBSCRIPTION_MANAGER_MAX_TRIE_NODES);
+            }
+
+            xSubscriptionIndex.usFreeHead = (SUBSCRIPTION_MANAGER_MAX_TRIE_NODES > 1U) ? 1U : TRIE_NODE_NONE;
+            xSubscriptionIndex.usCapacity = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+            xSubscriptionIndex.xWriteMutex = xSemaphoreCreateMutexStatic(&(xSubscriptionIndex.xWriteMutexBuffer));
+            STORE_RELEASE(xSubscriptionIndex.pxSubscriptionList, pxSubscriptionList);
+        }
+
+        pxBoundList = xSubscriptionIndex.pxSubscriptionList;
+
+        taskEXIT_CRITICAL(&xSubscriptionIndexSpinlock);
+    }
+
+    return (pxBoundList == pxSubscriptionList) ? &xSubscriptionIndex : NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvIsSubscriber(const SubscriptionElement_t *pxSubscription,
+                            const SubscriptionRequest_t *pxRequest) {
+    return (pxSubscription->pxIncomingPublishCallback == pxRequest->pxIncomingPublishCallback) &&
+           (pxSubscription->pvIncomingPublishCallbackContext == pxRequest->pvIncomingPublishCallbackContext) &&
+           (pxSubscription->usFilterStringLength == pxRequest->usTopicFilterLength) &&
+           (strncmp(pxSubscription->pcSubscriptionFilterString, pxRequest->pcTopicFilterString,
+                    (size_t) pxRequest->usTopicFilterLength) == 0);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvIsPendingSubscriber(const SubscriptionElement_t *pxSubscription,
+                                   const SubscriptionRequest_t *pxRequest) {
+    return pxSubscription->xPending &&
+           (pxSubscription->xRetired == false) &&
+           prvIsSubscriber(pxSubscription, pxRequest);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvAddSubscriptionLinear(SubscriptionElement_t *pxSubscriptionList,
+                                     const SubscriptionRequest_t *pxRequest) {
+    const char *pcTopicFilterString = pxRequest->pcTopicFilterString;
+    uint16_t usTopicFilterLength = pxRequest->usTopicFilterLength;
+    int32_t lIndex = 0;
+    size_t xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+    MQTTQoS_t xGrantedQoS = pxRequest->xQoS;
+    bool xReturnStatus = false;
+
+    /* Start at end of array, so that we will insert at the first available index.
+     * Scans backwards to find duplicates. */
+    for (lIndex = (int32_t) SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS - 1; lIndex >= 0; lIndex--) {
+        if (pxSubscriptionList[lIndex].usFilterStringLength == 0) {
+            xAvailableIndex = lIndex;
+        } else if ((pxSubscriptionList[lIndex].usFilterStringLength == usTopicFilterLength) &&
+                   (strncmp(pcTopicFilterString, pxSubscriptionList[lIndex].pcSubscriptionFilterString,
+                            (size_t) usTopicFilterLength) == 0)) {
+            /* The broker granted the same QoS to every subscriber of the filter. */
+            xGrantedQoS = (MQTTQoS_t) pxSubscriptionList[lIndex].ucGrantedQoS;
+
+            /* If a subscription already exists, don't do anything. */
+            if ((pxSubscriptionList[lIndex].pxIncomingPublishCallback == pxRequest->pxIncomingPublishCallback) &&
+                (pxSubscriptionList[lIndex].pvIncomingPublishCallbackContext == pxRequest->pvIncomingPublishCallbackContext)) {
+                LogWarn(("Subscription already exists.\n"));
+                xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+                xReturnStatus = true;
+                break;
+            }
+        }
+    }
+
+    if (xAvailableIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS) {
+        pxSubscriptionList[xAvailableIndex].pcSubscriptionFilterString = pcTopicFilterString;
+        pxSubscriptionList[xAvailableIndex].usFilterStringLength = usTopicFilterLength;
+        pxSubscriptionList[xAvailableIndex].pxIncomingPublishCallback = pxRequest->pxIncomingPublishCallback;
+        pxSubscriptionList[xAvailableIndex].pvIncomingPublishCallbackContext = pxRequest->pvIncomingPublishCallbackContext;
+        pxSubscriptionList[xAvailableIndex].ucRequestedQoS = (uint8_t) pxRequest->xQoS;
+        pxSubscriptionList[xAvailableIndex].ucGrantedQoS = (uint8_t) xGrantedQoS;
+        pxSubscriptionList[xAvailableIndex].ucDispatchPool = pxRequest->ucDispatchPool;
+        pxSubscriptionList[xAvailableIndex].ucPriorityClass = pxRequest->ucPriorityClass;
+        pxSubscriptionList[xAvailableIndex].xCaptures = pxRequest->xCaptures;
+        pxSubscriptionList[xAvailableIndex].xBatch = pxRequest->xBatch;
+        pxSubscriptionList[xAvailableIndex].xStream = pxRequest->xStream;
+        pxSubscriptionList[xAvailableIndex].xManualAck = pxRequest->xManualAck;
+        pxSubscriptionList[xAvailableIndex].xPending = true;
+        prvCompileFilter(&(pxSubscriptionList[xAvailableIndex]));
+        xReturnStatus = true;
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvAddSubscriptionIndexed(SubscriptionIndex_t *pxIndex,
+                                      const SubscriptionRequest_t *pxRequest) {
+    SubscriptionElement_t *pxSubscription;
+    const char *pcTopicFilterString = pxRequest->pcTopicFilterString;
+    const char *pcFilter = NULL, *pcSharedFilter = NULL;
+    uint32_t ulSlot = 0, ulFilterHash;
+    uint16_t usTopicFilterLength = pxRequest->usTopicFilterLength;
+    uint16_t usNode, usLink, *pusHead;
+    MQTTQoS_t xGrantedQoS = pxRequest->xQoS;
+    bool xExists = false, xReturnStatus = false;
+
+    /* Subscriptions with the same filter all hang off the same chain, so
+     * duplicates and copies of the filter only need to be looked for there. */
+    if (prvFindSubscriptionChain(pxIndex, pcTopicFilterString, usTopicFilterLength, false,
+                                 &pusHead, &usNode, &ulFilterHash)) {
+        usLink = *pusHead;
+
+        while ((usLink != 0U) && (xExists == false)) {
+            pxSubscription = prvGetElement(pxIndex, usLink - 1U);
+
+            if ((pxSubscription->usFilterStringLength == usTopicFilterLength) &&
+                (strncmp(pcTopicFilterString, pxSubscription->pcSubscriptionFilterString,
+                         (size_t) usTopicFilterLength) == 0)) {
+                pcSharedFilter = pxSubscription->pcSubscriptionFilterString;
+                /* The broker granted the same QoS to every subscriber of the filter. */
+                xGrantedQoS = (MQTTQoS_t) pxSubscription->ucGrantedQoS;
+
+                if ((pxSubscription->pxIncomingPublishCallback == pxRequest->pxIncomingPublishCallback) &&
+                    (pxSubscription->pvIncomingPublishCallbackContext == pxRequest->pvIncomingPublishCallbackContext)) {
+                    /* If a subscription already exists, don't do anything. */
+                    LogWarn(("Subscription already exists.\n"));
+                    xExists = true;
+                    xReturnStatus = true;
+                }
+            }
+
+            usLink = pxSubscription->usNextInNode;
+        }
+    }
+
+    if (xExists == false) {
+        pcFilter = prvInternFilter(pxIndex, pcTopicFilterString, usTopicFilterLength, pcSharedFilter);
+    }
+
+    if ((pcFilter != NULL) &&
+        prvAllocateSlot(pxIndex, &ulSlot) &&
+        prvFindSubscriptionChain(pxIndex, pcTopicFilterString, usTopicFilterLength, true,
+                                 &pusHead, &usNode, &ulFilterHash)) {
+        pxSubscription = prvGetElement(pxIndex, ulSlot);
+        pxSubscription->pcSubscriptionFilterString = pcFilter;
+        pxSubscription->usFilterStringLength = usTopicFilterLength;
+        pxSubscription->pxIncomingPublishCallback = pxRequest->pxIncomingPublishCallback;
+        pxSubscription->pvIncomingPublishCallbackContext = pxRequest->pvIncomingPublishCallbackContext;
+        pxSubscription->ulFilterHash = ulFilterHash;
+        pxSubscription->ucRequestedQoS = (uint8_t) pxRequest->xQoS;
+        pxSubscription->ucGrantedQoS = (uint8_t) xGrantedQoS;
+        pxSubscription->ucDispatchPool = pxRequest->ucDispatchPool;
+        pxSubscription->ucPriorityClass = pxRequest->ucPriorityClass;
+        pxSubscription->xCaptures = pxRequest->xCaptures;
+        pxSubscription->xBatch = pxRequest->xBatch;
+        pxSubscription->xStream = pxRequest->xStream;
+        pxSubscription->xManualAck = pxRequest->xManualAck;
+        pxSubscription->xPending = true;
+        prvCompileFilter(pxSubscription);
+        pxSubscription->usNextInNode = *pusHead;
+
+        if (usNode != TRIE_NODE_NONE) {
+            pxSubscription->usTrieNode = (uint16_t) (usNode + 1U);
+            pxIndex->xNodes[usNode].usRefCount++;
+        }
+
+        /* Only now the element is complete it becomes visible to dispatch. */
+        STORE_RELEASE(*pusHead, (uint16_t) (ulSlot + 1U));
+        prvInvalidateMatchCache(pxIndex);
+
+        pxIndex->usActive++;
+
+        if (pxIndex->usActive > pxIndex->usHighWaterMark) {
+            pxIndex->usHighWaterMark = pxIndex->usActive;
+        }
+
+        xReturnStatus = true;
+    } else if (pcFilter != NULL) {
+        prvReleaseFilter(pxIndex, pcFilter);
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint16_t prvRemoveSubscriptionIndexed(SubscriptionIndex_t *pxIndex,
+                                             const char *pcTopicFilterString,
+                                             uint16_t usTopicFilterLength,
+                                             const SubscriptionRequest_t *pxSubscriber,
+                                             bool xPendingOnly) {
+    SubscriptionElement_t *pxSubscription;
+    uint16_t usNode, usLink, usRemoved = 0U, usRemaining = 0U, *pusLink;
+    uint32_t ulFilterHash;
+    bool xRemove;
+
+    if (prvFindSubscriptionChain(pxIndex, pcTopicFilterString, usTopicFilterLength, false,
+                                 &pusLink, &usNode, &ulFilterHash)) {
+        /* Invalidated ahead of the fence of prvGetRetiredSequence(), so that a
+         * dispatch either misses the cache or delays the reuse of what is
+         * removed, which a cached entry may still list. */
+        prvInvalidateMatchCache(pxIndex);
+
+        while ((usLink = *pusLink) != 0U) {
+            pxSubscription = prvGetElement(pxIndex, usLink - 1U);
+            xRemove = false;
+
+            if ((pxSubscription->usFilterStringLength == usTopicFilterLength) &&
+                (strncmp(pxSubscription->pcSubscriptionFilterString, pcTopicFilterString,
+                         usTopicFilterLength) == 0)) {
+                if (pxSubscriber == NULL) {
+                    xRemove = true;
+                } else if (xPendingOnly) {
+                    xRemove = prvIsPendingSubscriber(pxSubscription, pxSubscriber);
+                } else {
+                    xRemove = prvIsSubscriber(pxSubscription, pxSubscriber);
+                }
+
+                if (xRemove == false) {
+                    usRemaining++;
+                }
+            }
+
+            if (xRemove) {
+                /* The element keeps its contents, and so its place in the
+                 * store, until no dispatch can be walking over it anymore. */
+                __atomic_store_n(&(pxSubscription->xRetired), true, __ATOMIC_RELEASE);
+                STORE_RELEASE(*pusLink, pxSubscription->usNextInNode);
+                pxSubscription->ulRetiredSequence = prvGetRetiredSequence(pxIndex);
+                usRemoved++;
+            } else {
+                pusLink = &(pxSubscription->usNextInNode);
+            }
+        }
+
+        pxIndex->usActive -= usRemoved;
+
+        if ((usRemoved > 0U) && (usNode != TRIE_NODE_NONE)) {
+            pxIndex->xNodes[usNode].usRefCount -= usRemoved;
+            prvTriePrune(pxIndex, usNode);
+        }
+    }
+
+    return usRemaining;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint16_t prvRemoveSubscriptionLinear(SubscriptionElement_t *pxSubscriptionList,
+                                            const char *pcTopicFilterString,
+                                            uint16_t usTopicFilterLength,
+                                            const SubscriptionRequest_t *pxSubscriber,
+                                            bool xPendingOnly) {
+    uint32_t ulIndex = 0;
+    uint16_t usRemaining = 0U;
+    bool xRemove;
+
+    for (ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; ulIndex++) {
+        if (pxSubscriptionList[ulIndex].usFilterStringLength == usTopicFilterLength) {
+            if (strncmp(pxSubscriptionList[ulIndex].pcSubscriptionFilterString, pcTopicFilterString,
+                        usTopicFilterLength) == 0) {
+                if (pxSubscriber == NULL) {
+                    xRemove = true;
+                } else if (xPendingOnly) {
+                    xRemove = prvIsPendingSubscriber(&(pxSubscriptionList[ulIndex]), pxSubscriber);
+                } else {
+                    xRemove = prvIsSubscriber(&(pxSubscriptionList[ulIndex]), pxSubscriber);
+                }
+
+                if (xRemove) {
+                    memset(&(pxSubscriptionList[ulIndex]), 0x00, sizeof(SubscriptionElement_t));
+                } else {
+                    usRemaining++;
+                }
+            }
+        }
+    }
+
+    return usRemaining;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCommitSubscription(SubscriptionElement_t *pxSubscriptionList,
+                                  SubscriptionIndex_t *pxIndex,
+                                  const SubscriptionRequest_t *pxRequest) {
+    SubscriptionElement_t *pxSubscription;
+    uint32_t ulIndex, ulFilterHash;
+    uint16_t usNode, usLink, *pusHead;
+
+    if (pxIndex != NULL) {
+        if (prvFindSubscriptionChain(pxIndex, pxRequest->pcTopicFilterString, pxRequest->usTopicFilterLength,
+                                     false, &pusHead, &usNode, &ulFilterHash)) {
+            for (usLink = *pusHead; usLink != 0U; usLink = pxSubscription->usNextInNode) {
+                pxSubscription = prvGetElement(pxIndex, usLink - 1U);
+
+                if (prvIsPendingSubscriber(pxSubscription, pxRequest)) {
+                    pxSubscription->xPending = false;
+                }
+            }
+        }
+    } else {
+        for (ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; ulIndex++) {
+            if (prvIsPendingSubscriber(&(pxSubscriptionList[ulIndex]), pxRequest)) {
+                pxSubscriptionList[ulIndex].xPending = false;
+            }
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvIsValidRequest(SubscriptionElement_t *pxSubscriptionList,
+                              const SubscriptionRequest_t *pxRequest,
+                              bool xAdding) {
+    bool xReturnStatus = false;
+
+    if ((pxSubscriptionList == NULL) ||
+        (pxRequest->pcTopicFilterString == NULL) ||
+        (pxRequest->usTopicFilterLength == 0U) ||
+        (xAdding && (pxRequest->pxIncomingPublishCallback == NULL))) {
+        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p,"
+                      " usTopicFilterLength=%u, pxIncomingPublishCallback=%p.",
+                 pxSubscriptionList,
+                 pxRequest->pcTopicFilterString,
+                 (unsigned int) pxRequest->usTopicFilterLength,
+                 pxRequest->pxIncomingPublishCallback);
+    } else if (xAdding &&
+               (prvIsValidTopicFilter(pxRequest->pcTopicFilterString, pxRequest->usTopicFilterLength) == false)) {
+        ESP_LOGE(TAG, "Invalid topic filter %.*s.",
+                 (int) pxRequest->usTopicFilterLength,
+                 pxRequest->pcTopicFilterString);
+    } else if (xAdding && pxRequest->xCaptures && pxRequest->xBatch) {
+        ESP_LOGE(TAG, "Subscription to %.*s cannot both capture wildcards and take batches.",
+                 (int) pxRequest->usTopicFilterLength,
+                 pxRequest->pcTopicFilterString);
+    } else if (xAdding && pxRequest->xStream &&
+               (pxRequest->xCaptures || pxRequest->xBatch ||
+                (pxRequest->pxStreamCallbacks->pxBegin == NULL) ||
+                (pxRequest->pxStreamCallbacks->pxData == NULL) ||
+                (pxRequest->pxStreamCallbacks->pxEnd == NULL))) {
+        ESP_LOGE(TAG, "Subscription to %.*s needs all stream callbacks and cannot capture wildcards or take batches.",
+                 (int) pxRequest->usTopicFilterLength,
+                 pxRequest->pcTopicFilterString);
+    } else if (xAdding && pxRequest->xCaptures &&
+               (prvCountFilterLevels(pxRequest->pcTopicFilterString,
+                                     pxRequest->usTopicFilterLength) > SUBSCRIPTION_MANAGER_MAX_FILTER_LEVELS)) {
+        ESP_LOGE(TAG, "Topic filter %.*s has too many levels to capture its wildcards.",
+                 (int) pxRequest->usTopicFilterLength,
+                 pxRequest->pcTopicFilterString);
+    } else {
+        xReturnStatus = true;
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvAreValidRequests(SubscriptionElement_t *pxSubscriptionList,
+                                const SubscriptionRequest_t *pxRequests,
+                                size_t xNumRequests,
+                                bool xAdding) {
+    size_t xRequest;
+    bool xReturnStatus = (pxRequests != NULL) && (xNumRequests > 0U);
+
+    for (xRequest = 0U; xReturnStatus && (xRequest < xNumRequests); xRequest++) {
+        xReturnStatus = prvIsValidRequest(pxSubscriptionList, &(pxRequests[xRequest]), xAdding);
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+bool validateSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                           const SubscriptionRequest_t *pxRequests,
+                           size_t xNumRequests) {
+    return prvAreValidRequests(pxSubscriptionList, pxRequests, xNumRequests, true);
+}
+
+/*-----------------------------------------------------------*/
+
+bool addSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                      const SubscriptionRequest_t *pxRequests,
+                      size_t xNumRequests) {
+    SubscriptionIndex_t *pxIndex = NULL;
+    const SubscriptionRequest_t *pxRequest;
+    size_t xAdded = 0U, xRequest;
+    bool xReturnStatus = prvAreValidRequests(pxSubscriptionList, pxRequests, xNumRequests, true);
+
+    if (xReturnStatus) {
+        pxIndex = prvGetSubscriptionIndex(pxSubscriptionList);
+
+        if (pxIndex != NULL) {
+            xSemaphoreTake(pxIndex->xWriteMutex, portMAX_DELAY);
+        }
+
+        /* New subscriptions stay pending until the whole batch is in, so that a
+         * failure part way can take back exactly the ones added by this call. */
+        while (xReturnStatus && (xAdded < xNumRequests)) {
+            pxRequest = &(pxRequests[xAdded]);
+
+            if (pxIndex != NULL) {
+                xReturnStatus = prvAddSubscriptionIndexed(pxIndex, pxRequest);
+            } else {
+                xReturnStatus = prvAddSubscriptionLinear(pxSubscriptionList, pxRequest);
+            }
+
+            if (xReturnStatus) {
+                xAdded++;
+            }
+        }
+
+        for (xRequest = 0U; xRequest < xAdded; xRequest++) {
+            pxRequest = &(pxRequests[xRequest]);
+
+            if (xReturnStatus) {
+                prvCommitSubscription(pxSubscriptionList, pxIndex, pxRequest);
+            } else if (pxIndex != NULL) {
+                (void) prvRemoveSubscriptionIndexed(pxIndex, pxRequest->pcTopicFilterString,
+                                                    pxRequest->usTopicFilterLength, pxRequest, true);
+            } else {
+                (void) prvRemoveSubscriptionLinear(pxSubscriptionList, pxRequest->pcTopicFilterString,
+                                                   pxRequest->usTopicFilterLength, pxRequest, true);
+            }
+        }
+
+        if (pxIndex != NULL) {
+            xSemaphoreGive(pxIndex->xWriteMutex);
+        }
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+bool addSubscription(SubscriptionElement_t *pxSubscriptionList,
+                     const char *pcTopicFilterString,
+                     uint16_t usTopicFilterLength,
+                     IncomingPubCallback_t pxIncomingPublishCallback,
+                     void *pvIncomingPublishCallbackContext) {
+    SubscriptionRequest_t xRequest = {0};
+
+    xRequest.pcTopicFilterString = pcTopicFilterString;
+    xRequest.usTopicFilterLength = usTopicFilterLength;
+    xRequest.pxIncomingPublishCallback = pxIncomingPublishCallback;
+    xRequest.pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
+    /* The QoS all subscriptions used to be restored with. */
+    xRequest.xQoS = MQTTQoS1;
+
+    return addSubscriptions(pxSubscriptionList, &xRequest, 1U);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvRemoveSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                                   const SubscriptionRequest_t *pxRequests,
+                                   size_t xNumRequests,
+                                   bool xAnySubscriber,
+                                   bool *pxLastSubscriber) {
+    SubscriptionIndex_t *pxIndex;
+    const SubscriptionRequest_t *pxRequest;
+    size_t xRequest;
+    uint16_t usRemaining;
+    bool xValid = prvAreValidRequests(pxSubscriptionList, pxRequests, xNumRequests, false);
+
+    /* Nothing is removed unless the whole batch can be. */
+    if (xValid) {
+        pxIndex = prvGetSubscriptionIndex(pxSubscriptionList);
+
+        if (pxIndex != NULL) {
+            xSemaphoreTake(pxIndex->xWriteMutex, portMAX_DELAY);
+        }
+
+        for (xRequest = 0U; xRequest < xNumRequests; xRequest++) {
+            pxRequest = xAnySubscriber ? NULL : &(pxRequests[xRequest]);
+
+            if (pxIndex != NULL) {
+                usRemaining = prvRemoveSubscriptionIndexed(pxIndex, pxRequests[xRequest].pcTopicFilterString,
+                                                           pxRequests[xRequest].usTopicFilterLength,
+                                                           pxRequest, false);
+            } else {
+                usRemaining = prvRemoveSubscriptionLinear(pxSubscriptionList, pxRequests[xRequest].pcTopicFilterString,
+                                                          pxRequests[xRequest].usTopicFilterLength,
+                                                          pxRequest, false);
+            }
+
+            if (pxLastSubscriber != NULL) {
+                pxLastSubscriber[xRequest] = (usRemaining == 0U);
+            }
+        }
 
-bool addSubscription(SubscriptionElement_t *pxSubscriptionList,
-                     const char *pcTopicFilterString,
-                     uint16_t usTopicFilterLength,
-                     IncomingPubCallback_t pxIncomingPublishCallback,
-                     void *pvIncomingPublishCallbackContext) {
-    int32_t lIndex = 0;
-    size_t xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+        if (pxIndex != NULL) {
+            xSemaphoreGive(pxIndex->xWriteMutex);
+        }
+    }
+
+    return xValid;
+}
+
+/*-----------------------------------------------------------*/
+
+bool removeSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                         const SubscriptionRequest_t *pxRequests,
+                         size_t xNumRequests,
+                         bool *pxLastSubscriber) {
+    return prvRemoveSubscriptions(pxSubscriptionList, pxRequests, xNumRequests, false, pxLastSubscriber);
+}
+
+/*-----------------------------------------------------------*/
+
+void removeSubscription(SubscriptionElement_t *pxSubscriptionList,
+                        const char *pcTopicFilterString,
+                        uint16_t usTopicFilterLength) {
+    SubscriptionRequest_t xRequest = {0};
+
+    xRequest.pcTopicFilterString = pcTopicFilterString;
+    xRequest.usTopicFilterLength = usTopicFilterLength;
+
+    (void) prvRemoveSubscriptions(pxSubscriptionList, &xRequest, 1U, true, NULL);
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvDeliverStream(const SubscriptionDelivery_t *pxDelivery,
+                             MQTTPublishInfo_t *pxPublishInfo) {
+    MQTTPublishInfo_t xBegin = *pxPublishInfo;
+
+    /* A publish that fit the network buffer is its own single chunk. */
+    xBegin.pPayload = NULL;
+    pxDelivery->pxStreamCallbacks->pxBegin(pxDelivery->pvIncomingPublishCallbackContext, &xBegin);
+
+    if (pxPublishInfo->payloadLength > 0U) {
+        pxDelivery->pxStreamCallbacks->pxData(pxDelivery->pvIncomingPublishCallbackContext,
+                                              (const uint8_t *) pxPublishInfo->pPayload,
+                                              pxPublishInfo->payloadLength, 0U);
+    }
+
+    pxDelivery->pxStreamCallbacks->pxEnd(pxDelivery->pvIncomingPublishCallbackContext, true);
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvDeliver(const SubscriptionDelivery_t *pxDelivery,
+                       MQTTPublishInfo_t *pxPublishInfo,
+                       DeliveryHook_t pxHook,
+                       void *pvHookContext) {
+    if ((pxHook == NULL) ||
+        (pxHook(pvHookContext, pxDelivery, pxPublishInfo) == false)) {
+        if (pxDelivery->pxMatch != NULL) {
+            pxDelivery->pxCaptureCallback(pxDelivery->pvIncomingPublishCallbackContext, pxPublishInfo,
+                                          pxDelivery->pxMatch);
+        } else if (pxDelivery->xBatch) {
+            pxDelivery->pxBatchCallback(pxDelivery->pvIncomingPublishCallbackContext, pxPublishInfo, 1U);
+        } else if (pxDelivery->xStream) {
+            prvDeliverStream(pxDelivery, pxPublishInfo);
+        } else {
+            pxDelivery->pxIncomingPublishCallback(pxDelivery->pvIncomingPublishCallbackContext, pxPublishInfo);
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+#if SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS > 0
+
+static uint32_t prvCountStaticSubscribers(const SubscriptionIndex_t *pxIndex,
+                                          const char *pcTopicFilterString,
+                                          uint16_t usTopicFilterLength,
+                                          MQTTQoS_t *pxRequestedQoS) {
+    const StaticSubscription_t *pxEntry;
+    uint32_t ulCount = 0U;
+    uint16_t usEntry;
+
+    for (usEntry = 0U; (pxIndex->pxStaticSubscriptions != NULL) && (usEntry < pxIndex->usStaticSubscriptions); usEntry++) {
+        pxEntry = &(pxIndex->pxStaticSubscriptions[usEntry]);
+
+        if ((pxEntry->usTopicFilterLength == usTopicFilterLength) &&
+            (memcmp(pxEntry->pcTopicFilterString, pcTopicFilterString, usTopicFilterLength) == 0)) {
+            if (pxEntry->xQoS > *pxRequestedQoS) {
+                *pxRequestedQoS = pxEntry->xQoS;
+            }
+
+            ulCount++;
+        }
+    }
+
+    return ulCount;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvDeliverStaticSubscription(const StaticSubscription_t *pxEntry,
+                                         MQTTPublishInfo_t *pxPublishInfo,
+                                         DeliveryHook_t pxHook,
+                                         void *pvHookContext) {
+    SubscriptionDelivery_t xDelivery;
+
+    xDelivery.pxIncomingPublishCallback = pxEntry->pxIncomingPublishCallback;
+    xDelivery.pvIncomingPublishCallbackContext = pxEntry->pvIncomingPublishCallbackContext;
+    xDelivery.pxMatch = NULL;
+    xDelivery.xBatch = false;
+    xDelivery.xStream = false;
+    xDelivery.xManualAck = false;
+    xDelivery.ucDispatchPool = pxEntry->ucDispatchPool;
+    xDelivery.ucPriorityClass = pxEntry->ucPriorityClass;
+    prvDeliver(&xDelivery, pxPublishInfo, pxHook, pvHookContext);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvInvokeStaticSubscriptions(const SubscriptionIndex_t *pxIndex,
+                                         MQTTPublishInfo_t *pxPublishInfo,
+                                         uint32_t ulTopicHash,
+                                         DeliveryHook_t pxHook,
+                                         void *pvHookContext) {
+    const StaticSubscription_t *pxTable = LOAD_ACQUIRE(pxIndex->pxStaticSubscriptions);
+    const StaticSubscription_t *pxEntry;
+    uint16_t usEntry, usLink;
+    bool isMatched, publishHandled = false;
+
+    if (pxTable != NULL) {
+        /* A filter without wildcards can only be equal to the topic. */
+        usLink = pxIndex->usStaticBuckets[ulTopicHash % SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS];
+
+        while (usLink != 0U) {
+            pxEntry = &(pxTable[usLink - 1U]);
+
+            if ((pxIndex->ulStaticHashes[usLink - 1U] == ulTopicHash) &&
+                (pxEntry->usTopicFilterLength == pxPublishInfo->topicNameLength) &&
+                (memcmp(pxEntry->pcTopicFilterString, pxPublishInfo->pTopicName,
+                        pxPublishInfo->topicNameLength) == 0)) {
+                prvDeliverStaticSubscription(pxEntry, pxPublishInfo, pxHook, pvHookContext);
+                publishHandled = true;
+            }
+
+            usLink = pxIndex->usStaticNext[usLink - 1U];
+        }
+
+        for (usEntry = 0U; usEntry < pxIndex->usStaticWildcardCount; usEntry++) {
+            pxEntry = &(pxTable[pxIndex->usStaticWildcards[usEntry]]);
+            isMatched = false;
+            MQTT_MatchTopic(pxPublishInfo->pTopicName,
+                            pxPublishInfo->topicNameLength,
+                            pxEntry->pcTopicFilterString,
+                            pxEntry->usTopicFilterLength,
+                            &isMatched);
+
+            if (isMatched) {
+                prvDeliverStaticSubscription(pxEntry, pxPublishInfo, pxHook, pvHookContext);
+                publishHandled = true;
+            }
+        }
+    }
+
+    return publishHandled;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvIndexStaticSubscriptions(SubscriptionIndex_t *pxIndex,
+                                        const StaticSubscription_t *pxTable,
+                                        uint16_t usNumEntries) {
+    uint16_t *pusLink;
+    uint16_t usEntry;
+
+    memset(pxIndex->usStaticBuckets, 0x00, sizeof(pxIndex->usStaticBuckets));
+    pxIndex->usStaticWildcardCount = 0U;
+
+    for (usEntry = 0U; usEntry < usNumEntries; usEntry++) {
+        if (prvHasWildcard(pxTable[usEntry].pcTopicFilterString, pxTable[usEntry].usTopicFilterLength)) {
+            pxIndex->usStaticWildcards[pxIndex->usStaticWildcardCount] = usEntry;
+            pxIndex->usStaticWildcardCount++;
+        } else {
+            /* Appended, so that a bucket keeps the order of the table. */
+            pxIndex->ulStaticHashes[usEntry] = prvHashString(pxTable[usEntry].pcTopicFilterString,
+                                                             pxTable[usEntry].usTopicFilterLength);
+            pusLink = &(pxIndex->usStaticBuckets[pxIndex->ulStaticHashes[usEntry] %
+                                                 SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS]);
+
+            while (*pusLink != 0U) {
+                pusLink = &(pxIndex->usStaticNext[*pusLink - 1U]);
+            }
+
+            pxIndex->usStaticNext[usEntry] = 0U;
+            *pusLink = usEntry + 1U;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+#endif /* if SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS > 0 */
+
+bool setStaticSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                            const StaticSubscription_t *pxTable,
+                            size_t xNumEntries) {
+    SubscriptionIndex_t *pxIndex = NULL;
+    const StaticSubscription_t *pxEntry;
+    size_t xEntry;
     bool xReturnStatus = false;
 
-    if ((pxSubscriptionList == NULL) ||
-        (pcTopicFilterString == NULL) ||
-        (usTopicFilterLength == 0U) ||
-        (pxIncomingPublishCallback == NULL)) {
-        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p,"
-                      " usTopicFilterLength=%u, pxIncomingPublishCallback=%p.",
+    if ((pxSubscriptionList == NULL) || (pxTable == NULL) || (xNumEntries == 0U) ||
+        (xNumEntries > SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pxTable=%p, xNumEntries=%u.",
                  pxSubscriptionList,
-                 pcTopicFilterString,
-                 (unsigned int) usTopicFilterLength,
-                 pxIncomingPublishCallback);
+                 pxTable,
+                 (unsigned int) xNumEntries);
+    } else if ((pxIndex = prvGetSubscriptionIndex(pxSubscriptionList)) == NULL) {
+        ESP_LOGE(TAG, "Static subscriptions are only supported by the subscription list of the MQTT agent.");
     } else {
-        /* Start at end of array, so that we will insert at the first available index.
-         * Scans backwards to find duplicates. */
-        for (lIndex = (int32_t) SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS - 1; lIndex >= 0; lIndex--) {
-            if (pxSubscriptionList[lIndex].usFilterStringLength == 0) {
-                xAvailableIndex = lIndex;
-            } else if ((pxSubscriptionList[lIndex].usFilterStringLength == usTopicFilterLength) &&
-                       (strncmp(pcTopicFilterString, pxSubscriptionList[lIndex].pcSubscriptionFilterString,
-                                (size_t) usTopicFilterLength) == 0)) {
-                /* If a subscription already exists, don't do anything. */
-                if ((pxSubscriptionList[lIndex].pxIncomingPublishCallback == pxIncomingPublishCallback) &&
-                    (pxSubscriptionList[lIndex].pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext)) {
-                    LogWarn(("Subscription already exists.\n"));
-                    xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
-                    xReturnStatus = true;
-                    break;
-                }
+        xReturnStatus = true;
+
+        for (xEntry = 0U; xReturnStatus && (xEntry < xNumEntries); xEntry++) {
+            pxEntry = &(pxTable[xEntry]);
+            xReturnStatus = (pxEntry->pcTopicFilterString != NULL) &&
+                            (pxEntry->usTopicFilterLength > 0U) &&
+                            (pxEntry->pxIncomingPublishCallback != NULL) &&
+                            (pxEntry->xQoS <= MQTTQoS2) &&
+                            prvIsValidTopicFilter(pxEntry->pcTopicFilterString, pxEntry->usTopicFilterLength) &&
+                            (prvShareGroupLength(pxEntry->pcTopicFilterString, pxEntry->usTopicFilterLength) == 0U);
+
+            if (xReturnStatus == false) {
+                ESP_LOGE(TAG, "Invalid static subscription %u.", (unsigned int) xEntry);
             }
         }
+    }
 
-        if (xAvailableIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS) {
-            pxSubscriptionList[xAvailableIndex].pcSubscriptionFilterString = pcTopicFilterString;
-            pxSubscriptionList[xAvailableIndex].usFilterStringLength = usTopicFilterLength;
-            pxSubscriptionList[xAvailableIndex].pxIncomingPublishCallback = pxIncomingPublishCallback;
-            pxSubscriptionList[xAvailableIndex].pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
-            xReturnStatus = true;
+#if SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS > 0
+    if (xReturnStatus) {
+        xSemaphoreTake(pxIndex->xWriteMutex, portMAX_DELAY);
+
+        if (pxIndex->pxStaticSubscriptions == NULL) {
+            /* The dispatch reads the count and the index once it sees the table. */
+            pxIndex->usStaticSubscriptions = (uint16_t) xNumEntries;
+            prvIndexStaticSubscriptions(pxIndex, pxTable, (uint16_t) xNumEntries);
+            STORE_RELEASE(pxIndex->pxStaticSubscriptions, pxTable);
+        } else {
+            ESP_LOGE(TAG, "The static subscriptions are already set.");
+            xReturnStatus = false;
         }
+
+        xSemaphoreGive(pxIndex->xWriteMutex);
     }
+#endif
 
     return xReturnStatus;
 }
 
 /*-----------------------------------------------------------*/
 
-void removeSubscription(SubscriptionElement_t *pxSubscriptionList,
-                        const char *pcTopicFilterString,
-                        uint16_t usTopicFilterLength) {
-    uint32_t ulIndex = 0;
+const StaticSubscription_t *getStaticSubscriptions(SubscriptionElement_t *pxSubscriptionList,
+                                                   size_t *pxNumEntries) {
+    const StaticSubscription_t *pxTable = NULL;
+    SubscriptionIndex_t *pxIndex;
 
-    if ((pxSubscriptionList == NULL) ||
-        (pcTopicFilterString == NULL) ||
-        (usTopicFilterLength == 0U)) {
+    if ((pxSubscriptionList == NULL) || (pxNumEntries == NULL)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pxNumEntries=%p.",
+                 pxSubscriptionList,
+                 pxNumEntries);
+    } else {
+        *pxNumEntries = 0U;
+        pxIndex = prvGetSubscriptionIndex(pxSubscriptionList);
+
+#if SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS > 0
+        if (pxIndex != NULL) {
+            pxTable = LOAD_ACQUIRE(pxIndex->pxStaticSubscriptions);
+            *pxNumEntries = (pxTable != NULL) ? pxIndex->usStaticSubscriptions : 0U;
+        }
+#else
+        (void) pxIndex;
+#endif
+    }
+
+    return pxTable;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvVisitSubscribers(SubscriptionElement_t *pxSubscriptionList,
+                                    const char *pcTopicFilterString,
+                                    uint16_t usTopicFilterLength,
+                                    MQTTQoS_t *pxRequestedQoS,
+                                    const MQTTQoS_t *pxGrantedQoS) {
+    SubscriptionIndex_t *pxIndex;
+    SubscriptionElement_t *pxSubscription = NULL;
+    uint32_t ulIndex = 0U, ulFilterHash, ulCount = 0U;
+    uint16_t usNode, usLink = 0U, *pusHead;
+    MQTTQoS_t xRequestedQoS = MQTTQoS0;
+
+    if ((pxSubscriptionList == NULL) || (pcTopicFilterString == NULL) || (usTopicFilterLength == 0U)) {
         ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p,"
                       " usTopicFilterLength=%u.",
                  pxSubscriptionList,
                  pcTopicFilterString,
                  (unsigned int) usTopicFilterLength);
     } else {
-        for (ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; ulIndex++) {
-            if (pxSubscriptionList[ulIndex].usFilterStringLength == usTopicFilterLength) {
-                if (strncmp(pxSubscriptionList[ulIndex].pcSubscriptionFilterString, pcTopicFilterString,
-                            usTopicFilterLength) == 0) {
-                    memset(&(pxSubscriptionList[ulIndex]), 0x00, sizeof(SubscriptionElement_t));
+        pxIndex = prvGetSubscriptionIndex(pxSubscriptionList);
+
+        if (pxIndex != NULL) {
+            xSemaphoreTake(pxIndex->xWriteMutex, portMAX_DELAY);
+
+            if (prvFindSubscriptionChain(pxIndex, pcTopicFilterString, usTopicFilterLength, false,
+                                         &pusHead, &usNode, &ulFilterHash)) {
+                usLink = *pusHead;
+            }
+        }
+
+        /* Walk the chain of the filter in the index, or the whole list. */
+        while ((pxIndex != NULL) ? (usLink != 0U) : (ulIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS)) {
+            if (pxIndex != NULL) {
+                pxSubscription = prvGetElement(pxIndex, usLink - 1U);
+                usLink = pxSubscription->usNextInNode;
+            } else {
+                pxSubscription = &(pxSubscriptionList[ulIndex++]);
+            }
+
+            if ((pxSubscription->usFilterStringLength == usTopicFilterLength) &&
+                (strncmp(pxSubscription->pcSubscriptionFilterString, pcTopicFilterString,
+                         usTopicFilterLength) == 0)) {
+                if (pxSubscription->ucRequestedQoS > xRequestedQoS) {
+                    xRequestedQoS = (MQTTQoS_t) pxSubscription->ucRequestedQoS;
+                }
+
+                if (pxGrantedQoS != NULL) {
+                    pxSubscription->ucGrantedQoS = (uint8_t) *pxGrantedQoS;
                 }
+
+                ulCount++;
             }
         }
+
+#if SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS > 0
+        if (pxIndex != NULL) {
+            ulCount += prvCountStaticSubscribers(pxIndex, pcTopicFilterString, usTopicFilterLength,
+                                                 &xRequestedQoS);
+            xSemaphoreGive(pxIndex->xWriteMutex);
+        }
+#else
+        if (pxIndex != NULL) {
+            xSemaphoreGive(pxIndex->xWriteMutex);
+        }
+#endif
+    }
+
+    if (pxRequestedQoS != NULL) {
+        *pxRequestedQoS = xRequestedQoS;
     }
+
+    return ulCount;
 }
 
 /*-----------------------------------------------------------*/
 
-bool handleIncomingPublishes(SubscriptionElement_t *pxSubscriptionList,
-                             MQTTPublishInfo_t *pxPublishInfo) {
-    uint32_t ulIndex = 0;
-    bool isMatched = false, publishHandled = false;
+uint32_t getSubscriberCount(SubscriptionElement_t *pxSubscriptionList,
+                            const char *pcTopicFilterString,
+                            uint16_t usTopicFilterLength,
+                            MQTTQoS_t *pxRequestedQoS) {
+    return prvVisitSubscribers(pxSubscriptionList, pcTopicFilterString, usTopicFilterLength,
+                               pxRequestedQoS, NULL);
+}
+
+/*-----------------------------------------------------------*/
+
+void setGrantedQoS(SubscriptionElement_t *pxSubscriptionList,
+                   const char *pcTopicFilterString,
+                   uint16_t usTopicFilterLength,
+                   MQTTQoS_t xGrantedQoS) {
+    (void) prvVisitSubscribers(pxSubscriptionList, pcTopicFilterString, usTopicFilterLength,
+                               NULL, &xGrantedQoS);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvIsEqual(const SubscriptionElement_t *pxSubscription,
+                       const MQTTPublishInfo_t *pxPublishInfo) {
+    return (__atomic_load_n(&(pxSubscription->xRetired), __ATOMIC_ACQUIRE) == false) &&
+           ((pxSubscription->usFilterStringLength - pxSubscription->usShareGroupLength) == pxPublishInfo->topicNameLength) &&
+           (memcmp(pxSubscription->pcSubscriptionFilterString + pxSubscription->usShareGroupLength,
+                   pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength) == 0);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvIsMatched(const SubscriptionElement_t *pxSubscription,
+                         const MQTTPublishInfo_t *pxPublishInfo,
+                         const TopicLevels_t *pxTopicLevels) {
+    bool isMatched = false;
+
+    if ((pxSubscription->usFilterStringLength > 0) &&
+        (__atomic_load_n(&(pxSubscription->xRetired), __ATOMIC_ACQUIRE) == false)) {
+        if (pxSubscription->xFilterCompiled) {
+            isMatched = prvMatchCompiledFilter(pxSubscription, pxPublishInfo, pxTopicLevels);
+        } else {
+            MQTT_MatchTopic(pxPublishInfo->pTopicName,
+                            pxPublishInfo->topicNameLength,
+                            pxSubscription->pcSubscriptionFilterString + pxSubscription->usShareGroupLength,
+                            (uint16_t) (pxSubscription->usFilterStringLength - pxSubscription->usShareGroupLength),
+                            &isMatched);
+        }
+    }
+
+    return isMatched;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvIsSharePeerFirst(const SubscriptionElement_t *pxSubscription,
+                                const SubscriptionElement_t *pxPeer,
+                                uint32_t ulDispatchStart) {
+    /* Members of a group served the longest time ago go first, so that the
+     * publishes go round the group. One served by this dispatch already took
+     * the turn of the group. */
+    return (pxPeer != pxSubscription) &&
+           (__atomic_load_n(&(pxPeer->xRetired), __ATOMIC_ACQUIRE) == false) &&
+           (pxPeer->usFilterStringLength == pxSubscription->usFilterStringLength) &&
+           (memcmp(pxPeer->pcSubscriptionFilterString, pxSubscription->pcSubscriptionFilterString,
+                   pxSubscription->usFilterStringLength) == 0) &&
+           (((int32_t) (pxPeer->ulLastDelivery - ulDispatchStart) > 0) ||
+            ((int32_t) (pxPeer->ulLastDelivery - pxSubscription->ulLastDelivery) < 0) ||
+            ((pxPeer->ulLastDelivery == pxSubscription->ulLastDelivery) && (pxPeer < pxSubscription)));
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvInvoke(SubscriptionElement_t *pxSubscription,
+                      MQTTPublishInfo_t *pxPublishInfo,
+                      TopicLevels_t *pxTopicLevels,
+                      DeliveryHook_t pxHook,
+                      void *pvHookContext) {
+    SubscriptionDelivery_t xDelivery;
+    SubscriptionMatch_t xMatch;
+
+    if (pxSubscription->usShareGroupLength > 0U) {
+        pxSubscription->ulLastDelivery = __atomic_add_fetch(&ulShareSequence, 1U, __ATOMIC_RELAXED);
+    }
+
+    xDelivery.pxIncomingPublishCallback = pxSubscription->pxIncomingPublishCallback;
+    xDelivery.pvIncomingPublishCallbackContext = pxSubscription->pvIncomingPublishCallbackContext;
+    xDelivery.pxMatch = NULL;
+    xDelivery.xBatch = pxSubscription->xBatch;
+    xDelivery.xStream = pxSubscription->xStream;
+    xDelivery.xManualAck = pxSubscription->xManualAck;
+    xDelivery.ucDispatchPool = pxSubscription->ucDispatchPool;
+    xDelivery.ucPriorityClass = pxSubscription->ucPriorityClass;
+
+    if (pxSubscription->xCaptures) {
+        /* Publishes answered from the match cache were not split yet. */
+        if (pxTopicLevels->usLevelCount == 0U) {
+            prvSplitTopic(pxPublishInfo, pxTopicLevels);
+        }
+
+        prvCaptureWildcards(pxSubscription, pxPublishInfo, pxTopicLevels, &xMatch);
+        xDelivery.pxMatch = &xMatch;
+    }
+
+    prvDeliver(&xDelivery, pxPublishInfo, pxHook, pvHookContext);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvDeliverMatches(const SubscriptionIndex_t *pxIndex,
+                              const uint16_t *pusMatches,
+                              uint16_t usMatchCount,
+                              MQTTPublishInfo_t *pxPublishInfo,
+                              TopicLevels_t *pxTopicLevels,
+                              DeliveryHook_t pxHook,
+                              void *pvHookContext) {
+    SubscriptionElement_t *pxSubscription;
+    uint32_t ulDispatchStart = __atomic_load_n(&ulShareSequence, __ATOMIC_RELAXED);
+    uint16_t usMatch, usPeer;
+    bool xTurn, publishHandled = false;
+
+    for (usMatch = 0U; usMatch < usMatchCount; usMatch++) {
+        pxSubscription = prvGetElement(pxIndex, pusMatches[usMatch]);
+        xTurn = (__atomic_load_n(&(pxSubscription->xRetired), __ATOMIC_ACQUIRE) == false);
+
+        /* Every member of a group matches the same topics, so the other
+         * members are all in the list. */
+        for (usPeer = 0U; xTurn && (pxSubscription->usShareGroupLength > 0U) && (usPeer < usMatchCount); usPeer++) {
+            xTurn = (prvIsSharePeerFirst(pxSubscription, prvGetElement(pxIndex, pusMatches[usPeer]),
+                                         ulDispatchStart) == false);
+        }
+
+        if (xTurn) {
+            prvInvoke(pxSubscription, pxPublishInfo, pxTopicLevels, pxHook, pvHookContext);
+            publishHandled = true;
+        }
+    }
+
+    return publishHandled;
+}
+
+/*-----------------------------------------------------------*/
+
+bool deliverIncomingPublishes(SubscriptionElement_t *pxSubscriptionList,
+                              MQTTPublishInfo_t *pxPublishInfo,
+                              DeliveryHook_t pxHook,
+                              void *pvHookContext) {
+    uint32_t ulIndex = 0, ulPeer, ulTopicHash, ulDispatchStart;
+    uint16_t usMatchCount = 0U, usExactCount, usHandledCount = 0U, usLink;
+    SubscriptionElement_t *pxSubscription;
+    SubscriptionIndex_t *pxIndex;
+    TopicLevels_t xTopicLevels = {0};
+    bool xTurn, publishHandled = false;
+#if SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES > 0
+    MatchCacheEntry_t *pxEntry;
+    uint32_t ulGeneration;
+#endif
 
     if ((pxSubscriptionList == NULL) ||
         (pxPublishInfo == NULL)) {
         ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pxPublishInfo=%p.",
                  pxSubscriptionList,
                  pxPublishInfo);
+    } else if ((pxIndex = prvGetSubscriptionIndex(pxSubscriptionList)) != NULL) {
+        /* Tell writers a dispatch is walking the index, so that they hold on to
+         * whatever they unlink until it returns. */
+        __atomic_fetch_add(&(pxIndex->ulDispatchSequence), 1U, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        ulTopicHash = prvHashString(pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
+
+#if SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES > 0
+        /* Read before the lookup, so that any change the lookup misses leaves
+         * the entry it stores out of date. */
+        ulGeneration = __atomic_load_n(&(pxIndex->ulCacheGeneration), __ATOMIC_ACQUIRE);
+        pxEntry = prvMatchCacheFind(pxIndex, pxPublishInfo, ulTopicHash);
+
+        if ((pxEntry != NULL) && (pxEntry->ulGeneration == ulGeneration)) {
+            /* No subscription changed since the entry was stored, so its
+             * subscriptions are exactly the ones matching the topic. */
+            pxEntry->xReferenced = true;
+            __atomic_fetch_add(&(pxIndex->ulCacheHits), 1U, __ATOMIC_RELAXED);
+
+            publishHandled = prvDeliverMatches(pxIndex, pxEntry->usMatches, pxEntry->usMatchCount, pxPublishInfo,
+                                               &xTopicLevels, pxHook, pvHookContext);
+        } else
+#endif
+        {
+            /* Wildcard-free filters first, they can only be equal to the topic. */
+            usLink = LOAD_ACQUIRE(pxIndex->usExactBuckets[ulTopicHash % SUBSCRIPTION_MANAGER_EXACT_BUCKETS]);
+
+            while ((usLink != 0U) && (usMatchCount < SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT)) {
+                pxSubscription = prvGetElement(pxIndex, usLink - 1U);
+
+                if ((pxSubscription->ulFilterHash == ulTopicHash) &&
+                    ((pxSubscription->usFilterStringLength - pxSubscription->usShareGroupLength) ==
+                     pxPublishInfo->topicNameLength)) {
+                    usMatchedSubscriptions[usMatchCount] = (uint16_t) (usLink - 1U);
+                    usMatchCount++;
+                }
+
+                usLink = LOAD_ACQUIRE(pxSubscription->usNextInNode);
+            }
+
+            usExactCount = usMatchCount;
+
+            prvSplitTopic(pxPublishInfo, &xTopicLevels);
+            prvTrieCollectMatches(pxIndex,
+                                  TRIE_ROOT_NODE,
+                                  pxPublishInfo->pTopicName,
+                                  pxPublishInfo->pTopicName + pxPublishInfo->topicNameLength,
+                                  false,
+                                  &usMatchCount);
+
+            /* Keep the subscriptions actually matched at the front of the list. */
+            for (ulIndex = 0U; ulIndex < usExactCount; ulIndex++) {
+                if (prvIsEqual(prvGetElement(pxIndex, usMatchedSubscriptions[ulIndex]), pxPublishInfo)) {
+                    usMatchedSubscriptions[usHandledCount] = usMatchedSubscriptions[ulIndex];
+                    usHandledCount++;
+                }
+            }
+
+            for (; ulIndex < usMatchCount; ulIndex++) {
+                if (prvIsMatched(prvGetElement(pxIndex, usMatchedSubscriptions[ulIndex]), pxPublishInfo, &xTopicLevels)) {
+                    usMatchedSubscriptions[usHandledCount] = usMatchedSubscriptions[ulIndex];
+                    usHandledCount++;
+                }
+            }
+
+#if SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES > 0
+            __atomic_fetch_add(&(pxIndex->ulCacheMisses), 1U, __ATOMIC_RELAXED);
+            prvMatchCacheStore(pxIndex, pxEntry, pxPublishInfo, ulTopicHash, ulGeneration, usHandledCount);
+#endif
+
+            publishHandled = prvDeliverMatches(pxIndex, usMatchedSubscriptions, usHandledCount, pxPublishInfo,
+                                               &xTopicLevels, pxHook, pvHookContext);
+        }
+
+#if SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS > 0
+        /* The static subscriptions are not in the index, nor in the cache. */
+        if (prvInvokeStaticSubscriptions(pxIndex, pxPublishInfo, ulTopicHash, pxHook, pvHookContext)) {
+            publishHandled = true;
+        }
+#endif
+
+        __atomic_fetch_add(&(pxIndex->ulDispatchSequence), 1U, __ATOMIC_SEQ_CST);
     } else {
+        prvSplitTopic(pxPublishInfo, &xTopicLevels);
+        ulDispatchStart = __atomic_load_n(&ulShareSequence, __ATOMIC_RELAXED);
+
         for (ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; ulIndex++) {
-            if (pxSubscriptionList[ulIndex].usFilterStringLength > 0) {
-                MQTT_MatchTopic(pxPublishInfo->pTopicName,
-                                pxPublishInfo->topicNameLength,
-                                pxSubscriptionList[ulIndex].pcSubscriptionFilterString,
-                                pxSubscriptionList[ulIndex].usFilterStringLength,
-                                &isMatched);
-
-                if (isMatched == true) {
-                    pxSubscriptionList[ulIndex].pxIncomingPublishCallback(
-                            pxSubscriptionList[ulIndex].pvIncomingPublishCallbackContext,
-                            pxPublishInfo);
-                    publishHandled = true;
-                }
+            pxSubscription = &(pxSubscriptionList[ulIndex]);
+            xTurn = prvIsMatched(pxSubscription, pxPublishInfo, &xTopicLevels);
+
+            for (ulPeer = 0U; xTurn && (pxSubscription->usShareGroupLength > 0U) &&
+                              (ulPeer < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS); ulPeer++) {
+                xTurn = (prvIsSharePeerFirst(pxSubscription, &(pxSubscriptionList[ulPeer]), ulDispatchStart) == false);
+            }
+
+            if (xTurn) {
+                prvInvoke(pxSubscription, pxPublishInfo, &xTopicLevels, pxHook, pvHookContext);
+                publishHandled = true;
             }
         }
     }
 
     return publishHandled;
-}
\ No newline at end of file
+}
+
+/*-----------------------------------------------------------*/
+
+bool handleIncomingPublishes(SubscriptionElement_t *pxSubscriptionList,
+                             MQTTPublishInfo_t *pxPublishInfo) {
+    return deliverIncomingPublishes(pxSubscriptionList, pxPublishInfo, NULL, NULL);
+}
+
+/*-----------------------------------------------------------*/
+
+bool getSubscription(SubscriptionElement_t *pxSubscriptionList,
+                     uint32_t *pulSlot,
+                     SubscriptionElement_t *pxSubscription) {
+    SubscriptionElement_t *pxElement;
+    SubscriptionIndex_t *pxIndex;
+    uint32_t ulSlot;
+    bool xFound = false;
+
+    if ((pxSubscriptionList == NULL) ||
+        (pulSlot == NULL) ||
+        (pxSubscription == NULL)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pulSlot=%p, pxSubscription=%p.",
+                 pxSubscriptionList,
+                 pulSlot,
+                 pxSubscription);
+    } else if ((pxIndex = prvGetSubscriptionIndex(pxSubscriptionList)) != NULL) {
+        xSemaphoreTake(pxIndex->xWriteMutex, portMAX_DELAY);
+
+        for (ulSlot = *pulSlot; (ulSlot < pxIndex->usCapacity) && (xFound == false); ulSlot++) {
+            pxElement = prvGetElement(pxIndex, ulSlot);
+
+            if ((pxElement->usFilterStringLength != 0) && (pxElement->xRetired == false)) {
+                memcpy(pxSubscription, pxElement, sizeof(SubscriptionElement_t));
+                *pulSlot = ulSlot + 1U;
+                xFound = true;
+            }
+        }
+
+        xSemaphoreGive(pxIndex->xWriteMutex);
+    } else {
+        for (ulSlot = *pulSlot; (ulSlot < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS) && (xFound == false); ulSlot++) {
+            if (pxSubscriptionList[ulSlot].usFilterStringLength != 0) {
+                memcpy(pxSubscription, &(pxSubscriptionList[ulSlot]), sizeof(SubscriptionElement_t));
+                *pulSlot = ulSlot + 1U;
+                xFound = true;
+            }
+        }
+    }
+
+    return xFound;
+}
+
+/*-----------------------------------------------------------*/
+
+void getSubscriptionStats(SubscriptionElement_t *pxSubscriptionList,
+                          SubscriptionStats_t *pxStats) {
+    SubscriptionIndex_t *pxIndex;
+    uint32_t ulSlot;
+
+    if ((pxSubscriptionList == NULL) ||
+        (pxStats == NULL)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxSubscriptionList=%p, pxStats=%p.",
+                 pxSubscriptionList,
+                 pxStats);
+    } else if ((pxIndex = prvGetSubscriptionIndex(pxSubscriptionList)) != NULL) {
+        xSemaphoreTake(pxIndex->xWriteMutex, portMAX_DELAY);
+        pxStats->ulActive = pxIndex->usActive;
+        pxStats->ulCapacity = pxIndex->usCapacity;
+        pxStats->ulHighWaterMark = pxIndex->usHighWaterMark;
+        pxStats->ulLimit = SUBSCRIPTION_MANAGER_SUBSCRIPTION_LIMIT;
+#if SUBSCRIPTION_MANAGER_MATCH_CACHE_ENTRIES > 0
+        pxStats->ulCacheHits = __atomic_load_n(&(pxIndex->ulCacheHits), __ATOMIC_RELAXED);
+        pxStats->ulCacheMisses = __atomic_load_n(&(pxIndex->ulCacheMisses), __ATOMIC_RELAXED);
+#else
+        pxStats->ulCacheHits = 0U;
+        pxStats->ulCacheMisses = 0U;
+#endif
+        xSemaphoreGive(pxIndex->xWriteMutex);
+    } else {
+        memset(pxStats, 0x00, sizeof(SubscriptionStats_t));
+
+        for (ulSlot = 0U; ulSlot < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; ulSlot++) {
+            if (pxSubscriptionList[ulSlot].usFilterStringLength != 0) {
+                pxStats->ulActive++;
+            }
+        }
+
+        pxStats->ulCapacity = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+        pxStats->ulLimit = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+    }
+}
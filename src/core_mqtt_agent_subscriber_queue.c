@@ -0,0 +1,340 @@
+/**
+ * @file core_mqtt_agent_subscriber_queue.c
+ * @brief Bounded queues and latest-value mailboxes of incoming publishes, one
+ * per subscriber.
+ */
+
+/* Standard includes. */
+#include <string.h>
+
+/* Kernel includes. */
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+
+#include "core_mqtt_agent_subscriber_queue.h"
+
+/**
+ * @brief Logging tag.
+ */
+static const char *TAG = "coreMQTTAgentSubscriberQueue";
+
+/*-----------------------------------------------------------*/
+
+static SubscriberMessage_t *prvLeasePublish(const MQTTPublishInfo_t *pxPublishInfo) {
+    SubscriberMessage_t *pxMessage;
+
+    pxMessage = (SubscriberMessage_t *) pvPortMalloc(sizeof(SubscriberMessage_t));
+
+    if (pxMessage != NULL) {
+        /* The copy the dispatch made for a pool, or makes for the first lease
+         * on the agent task, is shared rather than copied again. */
+        pxMessage->pxLease = leasePublish(pxPublishInfo);
+
+        if (pxMessage->pxLease == NULL) {
+            vPortFree(pxMessage);
+            pxMessage = NULL;
+        } else {
+            pxMessage->xPublishInfo = *getLeasedPublish(pxMessage->pxLease);
+        }
+    }
+
+    return pxMessage;
+}
+
+/*-----------------------------------------------------------*/
+
+bool createSubscriberQueue(SubscriberQueue_t *pxQueue,
+                           UBaseType_t uxLength,
+                           SubscriberQueuePolicy_t xPolicy,
+                           TickType_t xBlockTime) {
+    bool xReturnStatus = false;
+
+    if ((pxQueue == NULL) ||
+        (uxLength == 0U) ||
+        (xPolicy > SUBSCRIBER_QUEUE_BLOCK)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxQueue=%p, uxLength=%u, xPolicy=%d.",
+                 pxQueue,
+                 (unsigned int) uxLength,
+                 (int) xPolicy);
+    } else {
+        memset(pxQueue, 0x00, sizeof(SubscriberQueue_t));
+        pxQueue->xPolicy = xPolicy;
+        pxQueue->xBlockTime = xBlockTime;
+        pxQueue->xMessages = xQueueCreate(uxLength, sizeof(SubscriberMessage_t *));
+
+        if (pxQueue->xMessages == NULL) {
+            ESP_LOGE(TAG, "Failed to allocate a subscriber queue of %u publishes.", (unsigned int) uxLength);
+        } else {
+            xReturnStatus = true;
+        }
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+void deleteSubscriberQueue(SubscriberQueue_t *pxQueue) {
+    SubscriberMessage_t *pxMessage;
+
+    if ((pxQueue == NULL) ||
+        (pxQueue->xMessages == NULL)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxQueue=%p.", pxQueue);
+    } else {
+        while (xQueueReceive(pxQueue->xMessages, &pxMessage, 0U) == pdPASS) {
+            releaseSubscriberMessage(pxMessage);
+        }
+
+        vQueueDelete(pxQueue->xMessages);
+        pxQueue->xMessages = NULL;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void subscriberQueueCallback(void *pvIncomingPublishCallbackContext,
+                             MQTTPublishInfo_t *pxPublishInfo) {
+    SubscriberQueue_t *pxQueue = (SubscriberQueue_t *) pvIncomingPublishCallbackContext;
+    SubscriberMessage_t *pxMessage, *pxOldest;
+    bool xQueued = false;
+
+    pxMessage = prvLeasePublish(pxPublishInfo);
+
+    if (pxMessage == NULL) {
+        ESP_LOGW(TAG, "Out of memory for a publish on %.*s.",
+                 (int) pxPublishInfo->topicNameLength,
+                 pxPublishInfo->pTopicName);
+    } else if (pxQueue->xPolicy == SUBSCRIBER_QUEUE_DROP_OLDEST) {
+        /* The same task delivers every publish of the subscriber, so the room
+         * made can only be taken by the consumer emptying the queue further. */
+        while (xQueued == false) {
+            xQueued = (xQueueSendToBack(pxQueue->xMessages, &pxMessage, 0U) == pdPASS);
+
+            if ((xQueued == false) &&
+                (xQueueReceive(pxQueue->xMessages, &pxOldest, 0U) == pdPASS)) {
+                releaseSubscriberMessage(pxOldest);
+                __atomic_fetch_add(&(pxQueue->ulDropped), 1U, __ATOMIC_RELAXED);
+            }
+        }
+    } else {
+        xQueued = (xQueueSendToBack(pxQueue->xMessages, &pxMessage,
+                                    (pxQueue->xPolicy == SUBSCRIBER_QUEUE_BLOCK) ? pxQueue->xBlockTime : 0U) == pdPASS);
+
+        if (xQueued == false) {
+            releaseSubscriberMessage(pxMessage);
+        }
+    }
+
+    if (xQueued) {
+        __atomic_fetch_add(&(pxQueue->ulQueued), 1U, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&(pxQueue->ulDropped), 1U, __ATOMIC_RELAXED);
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+SubscriberMessage_t *receiveSubscriberMessage(SubscriberQueue_t *pxQueue,
+                                              TickType_t xTicksToWait) {
+    SubscriberMessage_t *pxMessage = NULL;
+
+    if ((pxQueue == NULL) ||
+        (pxQueue->xMessages == NULL)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxQueue=%p.", pxQueue);
+    } else if (xQueueReceive(pxQueue->xMessages, &pxMessage, xTicksToWait) != pdPASS) {
+        pxMessage = NULL;
+    }
+
+    return pxMessage;
+}
+
+/*-----------------------------------------------------------*/
+
+void releaseSubscriberMessage(SubscriberMessage_t *pxMessage) {
+    if (pxMessage != NULL) {
+        releasePublishLease(pxMessage->pxLease);
+        vPortFree(pxMessage);
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void getSubscriberQueueStats(SubscriberQueue_t *pxQueue,
+                             SubscriberQueueStats_t *pxStats) {
+    if ((pxQueue == NULL) ||
+        (pxQueue->xMessages == NULL) ||
+        (pxStats == NULL)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxQueue=%p, pxStats=%p.",
+                 pxQueue,
+                 pxStats);
+    } else {
+        pxStats->ulQueued = __atomic_load_n(&(pxQueue->ulQueued), __ATOMIC_RELAXED);
+        pxStats->ulDropped = __atomic_load_n(&(pxQueue->ulDropped), __ATOMIC_RELAXED);
+        pxStats->ulWaiting = (uint32_t) uxQueueMessagesWaiting(pxQueue->xMessages);
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static SubscriberMailboxSlot_t *prvFindMailboxSlot(SubscriberMailbox_t *pxMailbox,
+                                                   const MQTTPublishInfo_t *pxPublishInfo) {
+    SubscriberMailboxSlot_t *pxSlot = NULL;
+    UBaseType_t uxIndex;
+
+    /* Only the task delivering to the mailbox assigns the slots, so they need
+     * no lock. The first unused slot is taken for a new topic. */
+    for (uxIndex = 0U; (uxIndex < pxMailbox->uxSlots) && (pxSlot == NULL); uxIndex++) {
+        if (pxMailbox->pxSlots[uxIndex].pcTopicName == NULL) {
+            pxSlot = &(pxMailbox->pxSlots[uxIndex]);
+            pxSlot->pcTopicName = (char *) pvPortMalloc(pxPublishInfo->topicNameLength + 1U);
+
+            if (pxSlot->pcTopicName == NULL) {
+                pxSlot = NULL;
+                uxIndex = pxMailbox->uxSlots;
+            } else {
+                memcpy(pxSlot->pcTopicName, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
+                pxSlot->usTopicNameLength = pxPublishInfo->topicNameLength;
+            }
+        } else if ((pxMailbox->pxSlots[uxIndex].usTopicNameLength == pxPublishInfo->topicNameLength) &&
+                   (memcmp(pxMailbox->pxSlots[uxIndex].pcTopicName, pxPublishInfo->pTopicName,
+                           pxPublishInfo->topicNameLength) == 0)) {
+            pxSlot = &(pxMailbox->pxSlots[uxIndex]);
+        }
+    }
+
+    return pxSlot;
+}
+
+/*-----------------------------------------------------------*/
+
+bool createSubscriberMailbox(SubscriberMailbox_t *pxMailbox,
+                             UBaseType_t uxTopics) {
+    bool xReturnStatus = false;
+
+    if ((pxMailbox == NULL) ||
+        (uxTopics == 0U)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxMailbox=%p, uxTopics=%u.",
+                 pxMailbox,
+                 (unsigned int) uxTopics);
+    } else {
+        memset(pxMailbox, 0x00, sizeof(SubscriberMailbox_t));
+        pxMailbox->pxSlots = (SubscriberMailboxSlot_t *) pvPortMalloc(uxTopics * sizeof(SubscriberMailboxSlot_t));
+
+        /* A slot is only queued when it goes from empty to holding a publish,
+         * so the queue of ready slots can never be full. */
+        pxMailbox->xReady = xQueueCreate(uxTopics, sizeof(UBaseType_t));
+
+        if ((pxMailbox->pxSlots == NULL) ||
+            (pxMailbox->xReady == NULL)) {
+            ESP_LOGE(TAG, "Failed to allocate a subscriber mailbox of %u topics.", (unsigned int) uxTopics);
+            vPortFree(pxMailbox->pxSlots);
+            pxMailbox->pxSlots = NULL;
+
+            if (pxMailbox->xReady != NULL) {
+                vQueueDelete(pxMailbox->xReady);
+                pxMailbox->xReady = NULL;
+            }
+        } else {
+            memset(pxMailbox->pxSlots, 0x00, uxTopics * sizeof(SubscriberMailboxSlot_t));
+            pxMailbox->uxSlots = uxTopics;
+            xReturnStatus = true;
+        }
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+void deleteSubscriberMailbox(SubscriberMailbox_t *pxMailbox) {
+    UBaseType_t uxIndex;
+
+    if ((pxMailbox == NULL) ||
+        (pxMailbox->pxSlots == NULL)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxMailbox=%p.", pxMailbox);
+    } else {
+        for (uxIndex = 0U; uxIndex < pxMailbox->uxSlots; uxIndex++) {
+            releaseSubscriberMessage(pxMailbox->pxSlots[uxIndex].pxMessage);
+            vPortFree(pxMailbox->pxSlots[uxIndex].pcTopicName);
+        }
+
+        vQueueDelete(pxMailbox->xReady);
+        vPortFree(pxMailbox->pxSlots);
+        pxMailbox->xReady = NULL;
+        pxMailbox->pxSlots = NULL;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void subscriberMailboxCallback(void *pvIncomingPublishCallbackContext,
+                               MQTTPublishInfo_t *pxPublishInfo) {
+    SubscriberMailbox_t *pxMailbox = (SubscriberMailbox_t *) pvIncomingPublishCallbackContext;
+    SubscriberMailboxSlot_t *pxSlot;
+    SubscriberMessage_t *pxMessage = NULL, *pxPrevious;
+    UBaseType_t uxIndex;
+
+    pxSlot = prvFindMailboxSlot(pxMailbox, pxPublishInfo);
+
+    if (pxSlot != NULL) {
+        pxMessage = prvLeasePublish(pxPublishInfo);
+    }
+
+    if (pxMessage == NULL) {
+        ESP_LOGW(TAG, "No mailbox slot or out of memory for a publish on %.*s.",
+                 (int) pxPublishInfo->topicNameLength,
+                 pxPublishInfo->pTopicName);
+        __atomic_fetch_add(&(pxMailbox->ulDropped), 1U, __ATOMIC_RELAXED);
+    } else {
+        /* The consumer only empties a slot after taking its index from the
+         * queue, so whoever fills an empty slot queues its index once and the
+         * publish it replaces, if any, was never handed out. */
+        pxPrevious = __atomic_exchange_n(&(pxSlot->pxMessage), pxMessage, __ATOMIC_ACQ_REL);
+        __atomic_fetch_add(&(pxMailbox->ulQueued), 1U, __ATOMIC_RELAXED);
+
+        if (pxPrevious != NULL) {
+            releaseSubscriberMessage(pxPrevious);
+            __atomic_fetch_add(&(pxMailbox->ulCoalesced), 1U, __ATOMIC_RELAXED);
+        } else {
+            uxIndex = (UBaseType_t) (pxSlot - pxMailbox->pxSlots);
+            (void) xQueueSendToBack(pxMailbox->xReady, &uxIndex, 0U);
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+SubscriberMessage_t *receiveMailboxMessage(SubscriberMailbox_t *pxMailbox,
+                                           TickType_t xTicksToWait) {
+    SubscriberMessage_t *pxMessage = NULL;
+    UBaseType_t uxIndex;
+
+    if ((pxMailbox == NULL) ||
+        (pxMailbox->pxSlots == NULL)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxMailbox=%p.", pxMailbox);
+    } else if (xQueueReceive(pxMailbox->xReady, &uxIndex, xTicksToWait) == pdPASS) {
+        pxMessage = __atomic_exchange_n(&(pxMailbox->pxSlots[uxIndex].pxMessage), NULL, __ATOMIC_ACQ_REL);
+    }
+
+    return pxMessage;
+}
+
+/*-----------------------------------------------------------*/
+
+void getSubscriberMailboxStats(SubscriberMailbox_t *pxMailbox,
+                               SubscriberMailboxStats_t *pxStats) {
+    if ((pxMailbox == NULL) ||
+        (pxMailbox->pxSlots == NULL) ||
+        (pxStats == NULL)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxMailbox=%p, pxStats=%p.",
+                 pxMailbox,
+                 pxStats);
+    } else {
+        pxStats->ulQueued = __atomic_load_n(&(pxMailbox->ulQueued), __ATOMIC_RELAXED);
+        pxStats->ulCoalesced = __atomic_load_n(&(pxMailbox->ulCoalesced), __ATOMIC_RELAXED);
+        pxStats->ulDropped = __atomic_load_n(&(pxMailbox->ulDropped), __ATOMIC_RELAXED);
+        pxStats->ulWaiting = (uint32_t) uxQueueMessagesWaiting(pxMailbox->xReady);
+    }
+}
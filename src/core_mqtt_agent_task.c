@@ -55,6 +55,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "freertos/event_groups.h"
 
 /* MQTT library includes. */
@@ -76,6 +77,8 @@
 #include "esp_random.h"
 #include "esp_log.h"
 #include "core_mqtt_agent_subs_manager.h"
+#include "core_mqtt_agent_dispatch.h"
+#include "core_mqtt_agent_stream.h"
 
 #include "core_mqtt_agent_task.h"
 
@@ -104,6 +107,17 @@ static StaticSemaphore_t xTlsContextSemaphoreBuffer;
  */
 static NetworkContext_t networkContext = {0};
 
+/**
+ * @brief The transport the publishes too large for the network buffer are
+ * streamed from, bypassing the wrappers coreMQTT is given.
+ */
+static const TransportInterface_t xStreamTransport = {
+        .recv = espTlsTransportRecv,
+        .send = espTlsTransportSend,
+        .writev = NULL,
+        .pNetworkContext = &networkContext
+};
+
 MQTTAgentContext_t xGlobalMqttAgentContext;
 
 static uint8_t xNetworkBuffer[MQTT_AGENT_NETWORK_BUFFER_SIZE];
@@ -115,14 +129,109 @@ static StaticEventGroup_t prvMQTTAgentEventGroup;
 /**
  * @brief The global array of subscription elements.
  *
- * @note No thread safety is required to this array, since the updates the array
- * elements are done only from one task at a time. The subscription manager
+ * @note The subscription manager synchronises the updates made by application
+ * tasks with the dispatch of incoming publishes on the agent task, so the array
+ * may be passed to addSubscription() and removeSubscription() from any task.
+ * It must not be accessed directly. The subscription manager
  * implementation expects that the array of the subscription elements used for
  * storing subscriptions to be initialized to 0. As this is a global array, it
  * will be initialized to 0 by default.
  */
 SubscriptionElement_t xGlobalSubscriptionList[SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS];
 
+/**
+ * @brief Serialises subscribeToTopics() and unsubscribeFromTopics().
+ *
+ * Whether a SUBSCRIBE or UNSUBSCRIBE has to be sent depends on the subscribers
+ * already registered, so each call holds it until its packet is acknowledged.
+ */
+static SemaphoreHandle_t xSubscriptionChangeMutex;
+
+static StaticSemaphore_t xSubscriptionChangeMutexBuffer;
+
+/**
+ * @brief A subscribe or unsubscribe sent by subscribeToTopics() or
+ * unsubscribeFromTopics().
+ *
+ * It is allocated together with the subscribe info, the copy of the requests,
+ * one flag per request and a copy of the topic filters sent, and freed by
+ * whichever of the calling task and the command callback is done with it last,
+ * so that the calling task may give up waiting. xSettled is set by whichever of
+ * the two gets to it first: once the calling task gave up, the callback leaves
+ * the requests, whose strings and contexts may be gone, alone, and queues a
+ * subscribe on pxAbandonedBatches through pxNextAbandoned to be undone.
+ */
+typedef struct subscriptionBatch {
+    struct subscriptionBatch *pxNextAbandoned;
+    MQTTAgentSubscribeArgs_t xSubscribeArgs;
+    SubscriptionRequest_t *pxRequests;
+    size_t xNumRequests;
+    bool *pxLastSubscriber;
+    char *pcFilters;
+    bool xSubscribe;
+    bool xReturnStatus;
+    bool xSettled;
+    uint32_t ulReferences;
+    SemaphoreHandle_t xDone;
+    StaticSemaphore_t xDoneBuffer;
+} SubscriptionBatch_t;
+
+/**
+ * @brief Subscribe batches acknowledged after their calling task gave up,
+ * whose topic filters prvGiveSubscriptionChangeMutex() unsubscribes from.
+ *
+ * Whether a topic filter is still needed is only known while holding
+ * xSubscriptionChangeMutex, since the task holding it may have subscribed to
+ * the same topic filter without having registered its callback yet.
+ */
+static SubscriptionBatch_t *pxAbandonedBatches;
+
+/**
+ * @brief Handler and counters of the publishes no subscriber matched.
+ *
+ * The counters are only updated by the agent task, and read by
+ * getUnsolicitedPublishStats() from any task.
+ */
+typedef struct unsolicitedPublishes {
+    IncomingPubCallback_t pxHandler;
+    void *pvHandlerContext;
+    uint32_t ulLastReportMs;
+    uint32_t ulUnreported;
+    UnsolicitedPublishStats_t xStats;
+} UnsolicitedPublishes_t;
+
+static UnsolicitedPublishes_t xUnsolicitedPublishes;
+
+/**
+ * @brief The PUBACKs held for subscribers that acknowledge their publishes
+ * themselves.
+ *
+ * coreMQTT sends the PUBACK of a publish as soon as its callback returns, so
+ * the transport holds back the one of usHeldPacketId. The publishes released
+ * since, identified by the connection in the upper half of their token and
+ * their packet ID in the lower one, wait in xReleased for the agent task to
+ * send their PUBACK. xWakePending is set by the release that woke the agent
+ * task, until it sends them. Once ulUnacked reaches
+ * MQTT_AGENT_MAX_UNACKED_PUBLISHES the socket is left unread, the publishes
+ * already read being held all the same, so xReleased may fill up: the agent
+ * task, xAgentTask, then sends the PUBACKs waiting, and the other tasks wait
+ * for it to. Only the agent task updates the fields, other than xWakePending
+ * and the counters of ulUnacked and xStats, which getDeferredAckStats() reads.
+ */
+typedef struct deferredAcks {
+    QueueHandle_t xReleased;
+    StaticQueue_t xReleasedBuffer;
+    uint8_t ucReleasedStorage[MQTT_AGENT_MAX_UNACKED_PUBLISHES * sizeof(uint32_t)];
+    uint16_t usHeldPacketId;
+    uint16_t usConnection;
+    uint32_t ulUnacked;
+    bool xWakePending;
+    TaskHandle_t xAgentTask;
+    DeferredAckStats_t xStats;
+} DeferredAcks_t;
+
+static DeferredAcks_t xDeferredAcks;
+
 /**
  * @brief Logging tag.
  */
@@ -151,6 +260,105 @@ static void prvIncomingPublishCallback(MQTTAgentContext_t *pMqttAgentContext,
                                        uint16_t packetId,
                                        MQTTPublishInfo_t *pxPublishInfo);
 
+/**
+ * @brief Fan out a publish too large for the network buffer, read into a spill
+ * buffer, as prvIncomingPublishCallback() does for those coreMQTT received.
+ *
+ * @param[in] usPacketId Packet ID of the publish.
+ * @param[in] pxPublishInfo The publish.
+ *
+ * @return `true` if its PUBACK is held until the subscribers release it.
+ */
+static bool prvHandleSpilledPublish(uint16_t usPacketId,
+                                    MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Count a publish no subscriber matched and pass it to the unsolicited
+ * publish handler, or report it in a warning at most every
+ * MQTT_AGENT_UNSOLICITED_LOG_INTERVAL_MS.
+ *
+ * @param[in] pxPublishInfo The publish.
+ */
+static void prvHandleUnsolicitedPublish(MQTTPublishInfo_t *pxPublishInfo);
+
+/**
+ * @brief Queue the PUBACK of a released publish, from any task, and wake the
+ * agent task to send it.
+ *
+ * @param[in] ulAckToken Connection and packet ID of the publish.
+ */
+static void prvQueueReleasedAck(uint32_t ulAckToken);
+
+/**
+ * @brief Send the PUBACKs of the publishes released, on the agent task.
+ */
+static void prvSendReleasedAcks(void);
+
+/**
+ * @brief Send through the TLS transport, holding back the PUBACK of the
+ * publish just delivered to subscribers that acknowledge it themselves.
+ *
+ * @param[in] pNetworkContext The network context.
+ * @param[in] pBuffer The data to send.
+ * @param[in] bytesToSend Length of the data.
+ *
+ * @return The number of bytes sent, or a negative value on error.
+ */
+static int32_t prvTransportSend(NetworkContext_t *pNetworkContext,
+                                const void *pBuffer,
+                                size_t bytesToSend);
+
+/**
+ * @brief Tell whether the socket is left unread, while connected and either
+ * the dispatch pools are saturated or MQTT_AGENT_MAX_UNACKED_PUBLISHES PUBACKs
+ * are held.
+ *
+ * TCP flow control then holds the broker back, while the agent keeps
+ * processing its commands and keep-alives. A PINGRESP being awaited is read
+ * nonetheless, along with whatever precedes it, and so is the CONNACK of a
+ * reconnect. The SUBACKs, UNSUBACKs and the PUBACKs of outgoing publishes wait
+ * until the reads resume.
+ *
+ * @return `true` if the reads are paused.
+ */
+static bool prvIsReadPaused(void);
+
+/**
+ * @brief Receive through the TLS transport, unless the reads are paused, see
+ * prvIsReadPaused().
+ *
+ * The publishes too large for the network buffer are streamed to their
+ * subscribers on the way, see receivePublishStreams().
+ *
+ * @param[in] pNetworkContext The network context.
+ * @param[out] pBuffer Filled with the data received.
+ * @param[in] bytesToRecv Most bytes to receive.
+ *
+ * @return The number of bytes received, 0 if none, or a negative value on
+ * error.
+ */
+static int32_t prvTransportRecv(NetworkContext_t *pNetworkContext,
+                                void *pBuffer,
+                                size_t bytesToRecv);
+
+/**
+ * @brief Wait for the next command of the agent, once the publishes it
+ * received have been delivered.
+ *
+ * MQTTAgent_CommandLoop() waits here after each receive cycle, so the batches
+ * of publishes collected during the cycle are delivered first, and the
+ * PUBACKs of the publishes released sent.
+ *
+ * @param[in] pMsgCtx The message context of the agent.
+ * @param[out] pReceivedCommand The command received.
+ * @param[in] blockTimeMs Time to wait for a command.
+ *
+ * @return `true` if a command was received, `false` otherwise.
+ */
+static bool prvAgentMessageReceive(MQTTAgentMessageContext_t *pMsgCtx,
+                                   MQTTAgentCommand_t **pReceivedCommand,
+                                   uint32_t blockTimeMs);
+
 /**
  * @brief Connect to MQTT broker with reconnection retries.
  * @param pNetworkContext
@@ -179,6 +387,16 @@ static int connectToServerWithBackoffRetries(NetworkContext_t *pNetworkContext);
  */
 static MQTTStatus_t prvMQTTInit();
 
+/**
+ * @brief Record the QoS granted in a SUBACK for each topic filter of a
+ * subscribe command in the subscription list.
+ *
+ * @param[in] pxSubscribeArgs The topic filters of the subscribe command.
+ * @param[in] pucSubackCodes The SUBACK codes, one per topic filter.
+ */
+static void prvRecordGrantedQoS(const MQTTAgentSubscribeArgs_t *pxSubscribeArgs,
+                                const uint8_t *pucSubackCodes);
+
 /**
  * @brief Passed into MQTTAgent_Subscribe() as the callback to execute when the
  * broker ACKs the SUBSCRIBE message. This callback implementation is used for
@@ -193,6 +411,75 @@ static MQTTStatus_t prvMQTTInit();
 static void prvSubscriptionCommandCallback(MQTTAgentCommandContext_t *pxCommandContext,
                                            MQTTAgentReturnInfo_t *pxReturnInfo);
 
+/**
+ * @brief Passed into MQTTAgent_Subscribe() and MQTTAgent_Unsubscribe() by
+ * prvSendSubscriptionBatch() as the callback to execute when the broker ACKs
+ * the batch. Registers the callbacks of a subscribe batch in one step and wakes
+ * up the calling task, or hands its topic filters to
+ * prvAbandonSubscriptionBatch() if the calling task gave up waiting.
+ *
+ * @param[in] pxCommandContext The SubscriptionBatch_t of the command.
+ * @param[in] pxReturnInfo The result of the command.
+ */
+static void prvSubscriptionBatchCallback(MQTTAgentCommandContext_t *pxCommandContext,
+                                         MQTTAgentReturnInfo_t *pxReturnInfo);
+
+/**
+ * @brief Allocate a batch holding a copy of the requests and room for one
+ * topic filter per request in its subscribe info, which starts out empty, and
+ * for a copy of the topic filters.
+ *
+ * @param[in] pxRequests The topic filters and their callbacks.
+ * @param[in] xNumRequests Number of entries in pxRequests.
+ * @param[in] xSubscribe `true` to subscribe, `false` to unsubscribe.
+ *
+ * @return The batch, or NULL if the parameters are invalid or out of memory.
+ */
+static SubscriptionBatch_t *prvCreateSubscriptionBatch(const SubscriptionRequest_t *pxRequests,
+                                                       size_t xNumRequests,
+                                                       bool xSubscribe);
+
+/**
+ * @brief Add a copy of the topic filter of a request to the subscribe info of
+ * a batch, unless it is there already.
+ *
+ * @param[in] pxBatch The batch.
+ * @param[in] pxRequest The request.
+ */
+static void prvAddFilterToBatch(SubscriptionBatch_t *pxBatch,
+                                const SubscriptionRequest_t *pxRequest);
+
+/**
+ * @brief Send the subscribe info of a batch in a single SUBSCRIBE or
+ * UNSUBSCRIBE packet, wait for the broker to acknowledge it and release the
+ * batch. A subscribe acknowledged after the wait timed out is undone.
+ *
+ * @param[in] pxBatch The batch, with at least one topic filter.
+ *
+ * @return `true` if the batch was acknowledged and, for a subscribe, its
+ * callbacks registered, `false` otherwise.
+ */
+static bool prvSendSubscriptionBatch(SubscriptionBatch_t *pxBatch);
+
+/**
+ * @brief Queue a subscribe batch acknowledged after its calling task gave up,
+ * and undo it right away unless another task holds xSubscriptionChangeMutex,
+ * which then undoes it as it gives the mutex.
+ *
+ * @param[in] pxBatch The batch, holding the topic filters the broker granted.
+ */
+static void prvAbandonSubscriptionBatch(SubscriptionBatch_t *pxBatch);
+
+/**
+ * @brief Unsubscribe from the topic filters of the abandoned batches that no
+ * subscriber registered since, and give xSubscriptionChangeMutex.
+ *
+ * The UNSUBSCRIBE packets are not waited for, as the caller may be the agent
+ * task. A SUBSCRIBE to the same topic filter queued afterwards reaches the
+ * broker after them.
+ */
+static void prvGiveSubscriptionChangeMutex(void);
+
 /**
  * @brief Function to attempt to resubscribe to the topics already present in the
  * subscription list.
@@ -207,6 +494,19 @@ static void prvSubscriptionCommandCallback(MQTTAgentCommandContext_t *pxCommandC
  * */
 static MQTTStatus_t prvHandleResubscribe();
 
+/**
+ * @brief Add the topic filter of a subscription to the subscribe info of a
+ * resubscribe, unless it is already there, in which case the highest of the
+ * QoS requested is kept.
+ *
+ * @param[in] pxSubInfo The subscribe info of the resubscribe.
+ * @param[in,out] pusNumSubscriptions Number of topic filters in pxSubInfo.
+ * @param[in] pxSubscription The subscription to resubscribe.
+ */
+static void prvAddResubscribeFilter(MQTTSubscribeInfo_t *pxSubInfo,
+                                    uint16_t *pusNumSubscriptions,
+                                    const SubscriptionElement_t *pxSubscription);
+
 /**
  * @brief Sends an MQTT Connect packet over the already connected TCP socket.
  *
@@ -256,26 +556,216 @@ uint32_t prvGetTimeMs() {
 static void prvIncomingPublishCallback(MQTTAgentContext_t *pMqttAgentContext,
                                        uint16_t packetId,
                                        MQTTPublishInfo_t *pxPublishInfo) {
-    bool xPublishHandled = false;
-    char cOriginalChar, *pcLocation;
+    bool xPublishHandled = false, xAckDeferred = false;
+    uint32_t ulAckToken = 0U;
 
-    (void) packetId;
+    if (pxPublishInfo->qos == MQTTQoS1) {
+        ulAckToken = ((uint32_t) xDeferredAcks.usConnection << 16U) | packetId;
+    }
 
     /* Fan out the incoming publishes to the callbacks registered using
-     * subscription manager. */
-    xPublishHandled = handleIncomingPublishes((SubscriptionElement_t *) pMqttAgentContext->pIncomingCallbackContext,
-                                              pxPublishInfo);
+     * subscription manager, or to the dispatch pools they were added to. */
+    xPublishHandled = dispatchIncomingPublishesDeferringAck(
+        (SubscriptionElement_t *) pMqttAgentContext->pIncomingCallbackContext,
+        pxPublishInfo,
+        ulAckToken,
+        &xAckDeferred);
+
+    /* coreMQTT sends the PUBACK once this callback returns. Past the cap, the
+     * reads are paused, see prvIsReadPaused(). */
+    if (xAckDeferred) {
+        xDeferredAcks.usHeldPacketId = packetId;
+
+        if (__atomic_fetch_add(&(xDeferredAcks.ulUnacked), 1U, __ATOMIC_RELAXED) >= MQTT_AGENT_MAX_UNACKED_PUBLISHES) {
+            __atomic_store_n(&(xDeferredAcks.xStats.ulOverCap), xDeferredAcks.xStats.ulOverCap + 1U,
+                             __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&(xDeferredAcks.xStats.ulDeferred), xDeferredAcks.xStats.ulDeferred + 1U,
+                         __ATOMIC_RELAXED);
+    }
 
     /* If there are no callbacks to handle the incoming publishes,
      * handle it as an unsolicited publish. */
     if (xPublishHandled != true) {
-        /* Ensure the topic string is terminated for printing.  This will over-
-         * write the message ID, which is restored afterwards. */
-        pcLocation = (char *) &(pxPublishInfo->pTopicName[pxPublishInfo->topicNameLength]);
-        cOriginalChar = *pcLocation;
-        *pcLocation = 0x00;
-        ESP_LOGW(TAG, "WARN:  Received an unsolicited publish from topic %s", pxPublishInfo->pTopicName);
-        *pcLocation = cOriginalChar;
+        prvHandleUnsolicitedPublish(pxPublishInfo);
+    }
+}
+
+static bool prvHandleSpilledPublish(uint16_t usPacketId,
+                                    MQTTPublishInfo_t *pxPublishInfo) {
+    bool xAckDeferred;
+
+    prvIncomingPublishCallback(&xGlobalMqttAgentContext, usPacketId, pxPublishInfo);
+
+    /* coreMQTT sends no PUBACK for it to hold back. */
+    xAckDeferred = (xDeferredAcks.usHeldPacketId != 0U);
+    xDeferredAcks.usHeldPacketId = 0U;
+
+    return xAckDeferred;
+}
+
+static bool prvAgentMessageReceive(MQTTAgentMessageContext_t *pMsgCtx,
+                                   MQTTAgentCommand_t **pReceivedCommand,
+                                   uint32_t blockTimeMs) {
+    flushDispatchBatches();
+    prvSendReleasedAcks();
+
+    return Agent_MessageReceive(pMsgCtx, pReceivedCommand, blockTimeMs);
+}
+
+static void prvQueueReleasedAck(uint32_t ulAckToken) {
+    MQTTAgentCommandInfo_t xCommandInfo = {0};
+    DeferredAckStats_t *pxStats = &(xDeferredAcks.xStats);
+    BaseType_t xQueued;
+
+    /* The queue is only full past the cap. The agent task is only woken by
+     * the first release since it last sent the PUBACKs, and sends all those
+     * waiting at once. */
+    xQueued = xQueueSendToBack(xDeferredAcks.xReleased, &ulAckToken, 0U);
+
+    if (xQueued != pdPASS) {
+        if (xTaskGetCurrentTaskHandle() == xDeferredAcks.xAgentTask) {
+            prvSendReleasedAcks();
+            xQueued = xQueueSendToBack(xDeferredAcks.xReleased, &ulAckToken, 0U);
+        } else {
+            xQueued = xQueueSendToBack(xDeferredAcks.xReleased, &ulAckToken, portMAX_DELAY);
+        }
+    }
+
+    if (xQueued != pdPASS) {
+        ESP_LOGE(TAG, "No room for the PUBACK of packet %u.", (unsigned int) (ulAckToken & 0xFFFFU));
+    } else if ((__atomic_exchange_n(&(xDeferredAcks.xWakePending), true, __ATOMIC_ACQ_REL) == false) &&
+               (MQTTAgent_ProcessLoop(&xGlobalMqttAgentContext, &xCommandInfo) != MQTTSuccess)) {
+        /* The next release wakes the agent task instead. */
+        __atomic_store_n(&(xDeferredAcks.xWakePending), false, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&(pxStats->ulWakeFailed), 1U, __ATOMIC_RELAXED);
+        ESP_LOGW(TAG, "Failed to wake the agent task for the PUBACK of packet %u.",
+                 (unsigned int) (ulAckToken & 0xFFFFU));
+    }
+}
+
+static void prvSendReleasedAcks(void) {
+    uint8_t ucPacket[MQTT_PUBLISH_ACK_PACKET_SIZE];
+    MQTTFixedBuffer_t xPacketBuffer = {.pBuffer = ucPacket, .size = sizeof(ucPacket)};
+    DeferredAckStats_t *pxStats = &(xDeferredAcks.xStats);
+    uint32_t ulAckToken;
+
+    /* A release from now on wakes the agent task again. */
+    __atomic_store_n(&(xDeferredAcks.xWakePending), false, __ATOMIC_RELEASE);
+
+    while (xQueueReceive(xDeferredAcks.xReleased, &ulAckToken, 0U) == pdPASS) {
+        __atomic_fetch_sub(&(xDeferredAcks.ulUnacked), 1U, __ATOMIC_RELAXED);
+
+        /* The broker sends the publishes of a lost connection again. */
+        if ((ulAckToken >> 16U) != xDeferredAcks.usConnection) {
+            __atomic_store_n(&(pxStats->ulStale), pxStats->ulStale + 1U, __ATOMIC_RELAXED);
+        } else if ((MQTT_SerializeAck(&xPacketBuffer, MQTT_PACKET_TYPE_PUBACK,
+                                      (uint16_t) ulAckToken) != MQTTSuccess) ||
+                   (espTlsTransportSend(&networkContext, ucPacket, sizeof(ucPacket)) != (int32_t) sizeof(ucPacket))) {
+            ESP_LOGW(TAG, "Failed to send the PUBACK of packet %u.", (unsigned int) (ulAckToken & 0xFFFFU));
+        } else {
+            __atomic_store_n(&(pxStats->ulSent), pxStats->ulSent + 1U, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static bool prvIsReadPaused(void) {
+    const MQTTContext_t *pxMqttContext = &(xGlobalMqttAgentContext.mqttContext);
+
+    return (pxMqttContext->connectStatus == MQTTConnected) &&
+           (pxMqttContext->waitingForPingResp == false) &&
+           (isDispatchSaturated() ||
+            (__atomic_load_n(&(xDeferredAcks.ulUnacked), __ATOMIC_RELAXED) >= MQTT_AGENT_MAX_UNACKED_PUBLISHES));
+}
+
+static int32_t prvTransportRecv(NetworkContext_t *pNetworkContext,
+                                void *pBuffer,
+                                size_t bytesToRecv) {
+    int32_t lBytesReceived = 0;
+
+    if (prvIsReadPaused() == false) {
+        lBytesReceived = receivePublishStreams(xGlobalSubscriptionList, &xStreamTransport, pBuffer, bytesToRecv,
+                                               MQTT_AGENT_NETWORK_BUFFER_SIZE);
+    }
+
+    return lBytesReceived;
+}
+
+static int32_t prvTransportSend(NetworkContext_t *pNetworkContext,
+                                const void *pBuffer,
+                                size_t bytesToSend) {
+    const uint8_t *pucPacket = (const uint8_t *) pBuffer;
+    int32_t lBytesSent;
+
+    /* coreMQTT sends a PUBACK in one piece, and considers it sent. */
+    if ((xDeferredAcks.usHeldPacketId != 0U) &&
+        (bytesToSend == MQTT_PUBLISH_ACK_PACKET_SIZE) &&
+        (pucPacket[0] == MQTT_PACKET_TYPE_PUBACK) &&
+        (pucPacket[2] == (uint8_t) (xDeferredAcks.usHeldPacketId >> 8U)) &&
+        (pucPacket[3] == (uint8_t) xDeferredAcks.usHeldPacketId)) {
+        xDeferredAcks.usHeldPacketId = 0U;
+        lBytesSent = (int32_t) bytesToSend;
+    } else {
+        lBytesSent = espTlsTransportSend(pNetworkContext, pBuffer, bytesToSend);
+    }
+
+    return lBytesSent;
+}
+
+static void prvHandleUnsolicitedPublish(MQTTPublishInfo_t *pxPublishInfo) {
+    UnsolicitedPublishStats_t *pxStats = &(xUnsolicitedPublishes.xStats);
+    UnsolicitedTopicStats_t *pxTopic;
+    uint32_t ulTopicHash = getUnsolicitedTopicHash(pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
+    uint32_t ulNowMs;
+    size_t xIndex;
+    bool xCounted = false;
+
+    __atomic_store_n(&(pxStats->ulTotal), pxStats->ulTotal + 1U, __ATOMIC_RELAXED);
+
+    /* The first topics seen keep their entry, the others are counted together. */
+    for (xIndex = 0; (xCounted == false) && (xIndex < MQTT_AGENT_UNSOLICITED_TOPICS); xIndex++) {
+        pxTopic = &(pxStats->xTopics[xIndex]);
+
+        if (pxTopic->ulCount == 0U) {
+            __atomic_store_n(&(pxTopic->ulTopicHash), ulTopicHash, __ATOMIC_RELAXED);
+        }
+
+        if (pxTopic->ulTopicHash == ulTopicHash) {
+            __atomic_store_n(&(pxTopic->ulCount), pxTopic->ulCount + 1U, __ATOMIC_RELAXED);
+            xCounted = true;
+        }
+    }
+
+    if (xCounted == false) {
+        __atomic_store_n(&(pxStats->ulOtherTopics), pxStats->ulOtherTopics + 1U, __ATOMIC_RELAXED);
+    }
+
+    if (xUnsolicitedPublishes.pxHandler != NULL) {
+        xUnsolicitedPublishes.pxHandler(xUnsolicitedPublishes.pvHandlerContext, pxPublishInfo);
+    } else {
+        ulNowMs = prvGetTimeMs();
+        xUnsolicitedPublishes.ulUnreported++;
+
+        /* The topic is printed with its length, the network buffer is left as
+         * it is. */
+        if ((pxStats->ulTotal == 1U) ||
+            ((ulNowMs - xUnsolicitedPublishes.ulLastReportMs) >= MQTT_AGENT_UNSOLICITED_LOG_INTERVAL_MS)) {
+            if (xUnsolicitedPublishes.ulUnreported == 1U) {
+                ESP_LOGW(TAG, "Received an unsolicited publish on topic %.*s.",
+                         (int) pxPublishInfo->topicNameLength,
+                         pxPublishInfo->pTopicName);
+            } else {
+                ESP_LOGW(TAG, "Received %u unsolicited publishes in the last %u ms, the latest on topic %.*s.",
+                         (unsigned int) xUnsolicitedPublishes.ulUnreported,
+                         (unsigned int) (ulNowMs - xUnsolicitedPublishes.ulLastReportMs),
+                         (int) pxPublishInfo->topicNameLength,
+                         pxPublishInfo->pTopicName);
+            }
+
+            xUnsolicitedPublishes.ulLastReportMs = ulNowMs;
+            xUnsolicitedPublishes.ulUnreported = 0U;
+        }
     }
 }
 
@@ -430,7 +920,7 @@ static MQTTStatus_t prvMQTTInit() {
             {
                     .pMsgCtx        = NULL,
                     .send           = Agent_MessageSend,
-                    .recv           = Agent_MessageReceive,
+                    .recv           = prvAgentMessageReceive,
                     .getCommand     = Agent_GetCommand,
                     .releaseCommand = Agent_ReleaseCommand
             };
@@ -446,10 +936,18 @@ static MQTTStatus_t prvMQTTInit() {
     /* Initialize the task pool. */
     Agent_InitializePool();
 
+    xDeferredAcks.xReleased = xQueueCreateStatic(MQTT_AGENT_MAX_UNACKED_PUBLISHES,
+                                                 sizeof(uint32_t),
+                                                 xDeferredAcks.ucReleasedStorage,
+                                                 &(xDeferredAcks.xReleasedBuffer));
+    configASSERT(xDeferredAcks.xReleased);
+    setPublishAckHandler(prvQueueReleasedAck);
+    setSpilledPublishHandler(prvHandleSpilledPublish);
+
     /* Fill in Transport Interface send and receive function pointers. */
     xTransport.pNetworkContext = &networkContext;
-    xTransport.send = espTlsTransportSend;
-    xTransport.recv = espTlsTransportRecv;
+    xTransport.send = prvTransportSend;
+    xTransport.recv = prvTransportRecv;
     xTransport.writev = NULL;
 
     /* Initialize MQTT library. */
@@ -465,6 +963,21 @@ static MQTTStatus_t prvMQTTInit() {
     return xReturn;
 }
 
+static void prvRecordGrantedQoS(const MQTTAgentSubscribeArgs_t *pxSubscribeArgs,
+                                const uint8_t *pucSubackCodes) {
+    size_t xIndex;
+
+    for (xIndex = 0; (pucSubackCodes != NULL) && (xIndex < pxSubscribeArgs->numSubscriptions); xIndex++) {
+        if (pucSubackCodes[xIndex] != MQTTSubAckFailure) {
+            /* The success codes of a SUBACK are the granted QoS. */
+            setGrantedQoS(xGlobalSubscriptionList,
+                          pxSubscribeArgs->pSubscribeInfo[xIndex].pTopicFilter,
+                          pxSubscribeArgs->pSubscribeInfo[xIndex].topicFilterLength,
+                          (MQTTQoS_t) pucSubackCodes[xIndex]);
+        }
+    }
+}
+
 static void prvSubscriptionCommandCallback(MQTTAgentCommandContext_t *pxCommandContext,
                                            MQTTAgentReturnInfo_t *pxReturnInfo) {
     /* Based on
@@ -473,9 +986,11 @@ static void prvSubscriptionCommandCallback(MQTTAgentCommandContext_t *pxCommandC
     size_t lIndex = 0;
     MQTTAgentSubscribeArgs_t *pxSubscribeArgs = (MQTTAgentSubscribeArgs_t *) pxCommandContext;
 
-    /* If the return code is success, no further action is required as all the topic filters
-     * are already part of the subscription list. */
-    if (pxReturnInfo->returnCode != MQTTSuccess) {
+    /* If the return code is success, the topic filters are already part of the
+     * subscription list and only the QoS granted this time is recorded. */
+    if (pxReturnInfo->returnCode == MQTTSuccess) {
+        prvRecordGrantedQoS(pxSubscribeArgs, pxReturnInfo->pSubackCodes);
+    } else {
         /* Check through each of the suback codes and determine if there are any failures. */
         for (lIndex = 0; lIndex < pxSubscribeArgs->numSubscriptions; lIndex++) {
             /* This demo doesn't attempt to resubscribe in the event that a SUBACK failed. */
@@ -494,6 +1009,287 @@ static void prvSubscriptionCommandCallback(MQTTAgentCommandContext_t *pxCommandC
          * the subscriptions. This logic will be updated with exponential backoff and retry.  */
         configASSERT(pdTRUE);
     }
+
+#if SUBSCRIPTION_MANAGER_USE_POOL
+    /* The subscribe info was sized for this resubscribe in prvHandleResubscribe(). */
+    vPortFree(pxSubscribeArgs->pSubscribeInfo);
+    pxSubscribeArgs->pSubscribeInfo = NULL;
+#endif
+}
+
+static void prvSubscriptionBatchCallback(MQTTAgentCommandContext_t *pxCommandContext,
+                                         MQTTAgentReturnInfo_t *pxReturnInfo) {
+    SubscriptionBatch_t *pxBatch = (SubscriptionBatch_t *) pxCommandContext;
+    MQTTSubscribeInfo_t *pxSubscribeInfo = pxBatch->xSubscribeArgs.pSubscribeInfo;
+    size_t xIndex;
+    uint32_t ulNumFilters = 0U;
+    bool xReturnStatus = (pxReturnInfo->returnCode == MQTTSuccess);
+
+    if (__atomic_exchange_n(&(pxBatch->xSettled), true, __ATOMIC_ACQ_REL)) {
+        /* The calling task gave up. The topic filters the broker granted are
+         * unsubscribed from in turn, once no task is changing subscriptions. */
+        for (xIndex = 0; pxBatch->xSubscribe && xReturnStatus &&
+                         (xIndex < pxBatch->xSubscribeArgs.numSubscriptions); xIndex++) {
+            if ((pxReturnInfo->pSubackCodes == NULL) ||
+                (pxReturnInfo->pSubackCodes[xIndex] != MQTTSubAckFailure)) {
+                pxSubscribeInfo[ulNumFilters] = pxSubscribeInfo[xIndex];
+                ulNumFilters++;
+            }
+        }
+
+        if (ulNumFilters > 0U) {
+            pxBatch->xSubscribeArgs.numSubscriptions = ulNumFilters;
+            prvAbandonSubscriptionBatch(pxBatch);
+        }
+    } else if (pxBatch->xSubscribe) {
+        /* The callbacks of an unsubscribe batch are removed before it is sent.
+         * A refused topic filter is only reported through its SUBACK code. */
+        for (xIndex = 0; (pxReturnInfo->pSubackCodes != NULL) &&
+                         (xIndex < pxBatch->xSubscribeArgs.numSubscriptions); xIndex++) {
+            if (pxReturnInfo->pSubackCodes[xIndex] == MQTTSubAckFailure) {
+                ESP_LOGE(TAG, "Broker refused the subscription to topic %.*s.",
+                         pxSubscribeInfo[xIndex].topicFilterLength,
+                         pxSubscribeInfo[xIndex].pTopicFilter);
+                xReturnStatus = false;
+            }
+        }
+
+        if (xReturnStatus) {
+            xReturnStatus = addSubscriptions(xGlobalSubscriptionList, pxBatch->pxRequests, pxBatch->xNumRequests);
+
+            if (xReturnStatus) {
+                prvRecordGrantedQoS(&(pxBatch->xSubscribeArgs), pxReturnInfo->pSubackCodes);
+            } else {
+                ESP_LOGE(TAG, "Failed to register the callbacks of %u subscriptions.",
+                         (unsigned int) pxBatch->xNumRequests);
+            }
+        }
+    }
+
+    pxBatch->xReturnStatus = xReturnStatus;
+    xSemaphoreGive(pxBatch->xDone);
+
+    if (__atomic_sub_fetch(&(pxBatch->ulReferences), 1U, __ATOMIC_ACQ_REL) == 0U) {
+        vPortFree(pxBatch);
+    }
+}
+
+static SubscriptionBatch_t *prvCreateSubscriptionBatch(const SubscriptionRequest_t *pxRequests,
+                                                       size_t xNumRequests,
+                                                       bool xSubscribe) {
+    SubscriptionBatch_t *pxBatch = NULL;
+    size_t xFilterBytes = 0U;
+    size_t xIndex;
+
+    if ((pxRequests == NULL) || (xNumRequests == 0U)) {
+        ESP_LOGE(TAG, "Invalid parameter. pxRequests=%p, xNumRequests=%u.",
+                 pxRequests, (unsigned int) xNumRequests);
+    } else {
+        for (xIndex = 0; xIndex < xNumRequests; xIndex++) {
+            xFilterBytes += pxRequests[xIndex].usTopicFilterLength;
+        }
+
+        /* One allocation holds everything the command callback needs, so that
+         * it does not depend on the stack of the calling task. */
+        pxBatch = pvPortMalloc(sizeof(SubscriptionBatch_t) +
+                               ((sizeof(MQTTSubscribeInfo_t) + sizeof(SubscriptionRequest_t) + sizeof(bool)) *
+                                xNumRequests) + xFilterBytes);
+
+        if (pxBatch == NULL) {
+            ESP_LOGE(TAG, "Failed to allocate a batch of %u subscriptions.", (unsigned int) xNumRequests);
+        }
+    }
+
+    if (pxBatch != NULL) {
+        memset(pxBatch, 0x00, sizeof(SubscriptionBatch_t));
+        pxBatch->xSubscribeArgs.pSubscribeInfo = (MQTTSubscribeInfo_t *) (pxBatch + 1);
+        pxBatch->pxRequests = (SubscriptionRequest_t *) (pxBatch->xSubscribeArgs.pSubscribeInfo + xNumRequests);
+        pxBatch->pxLastSubscriber = (bool *) (pxBatch->pxRequests + xNumRequests);
+        pxBatch->pcFilters = (char *) (pxBatch->pxLastSubscriber + xNumRequests);
+        memcpy(pxBatch->pxRequests, pxRequests, sizeof(SubscriptionRequest_t) * xNumRequests);
+        pxBatch->xNumRequests = xNumRequests;
+        pxBatch->xSubscribe = xSubscribe;
+    }
+
+    return pxBatch;
+}
+
+static void prvAddFilterToBatch(SubscriptionBatch_t *pxBatch,
+                                const SubscriptionRequest_t *pxRequest) {
+    MQTTSubscribeInfo_t *pxSubscribeInfo = pxBatch->xSubscribeArgs.pSubscribeInfo;
+    size_t xIndex;
+    bool xFound = false;
+
+    for (xIndex = 0; (xFound == false) && (xIndex < pxBatch->xSubscribeArgs.numSubscriptions); xIndex++) {
+        xFound = (pxSubscribeInfo[xIndex].topicFilterLength == pxRequest->usTopicFilterLength) &&
+                 (strncmp(pxSubscribeInfo[xIndex].pTopicFilter, pxRequest->pcTopicFilterString,
+                          pxRequest->usTopicFilterLength) == 0);
+    }
+
+    if (xFound) {
+        /* Several requests for one topic filter are sent with the highest QoS. */
+        xIndex--;
+
+        if (pxRequest->xQoS > pxSubscribeInfo[xIndex].qos) {
+            pxSubscribeInfo[xIndex].qos = pxRequest->xQoS;
+        }
+    } else {
+        /* The callback may outlive the strings of the calling task. */
+        xIndex = pxBatch->xSubscribeArgs.numSubscriptions;
+        memcpy(pxBatch->pcFilters, pxRequest->pcTopicFilterString, pxRequest->usTopicFilterLength);
+        pxSubscribeInfo[xIndex].pTopicFilter = pxBatch->pcFilters;
+        pxBatch->pcFilters += pxRequest->usTopicFilterLength;
+        pxSubscribeInfo[xIndex].topicFilterLength = pxRequest->usTopicFilterLength;
+        pxSubscribeInfo[xIndex].qos = pxRequest->xQoS;
+        pxBatch->xSubscribeArgs.numSubscriptions++;
+    }
+}
+
+static bool prvSendSubscriptionBatch(SubscriptionBatch_t *pxBatch) {
+    MQTTAgentCommandInfo_t xCommandParams = {0};
+    MQTTStatus_t xResult;
+    bool xReturnStatus = false;
+
+    pxBatch->ulReferences = 2U;
+    pxBatch->xDone = xSemaphoreCreateBinaryStatic(&(pxBatch->xDoneBuffer));
+
+    xCommandParams.blockTimeMs = MQTT_AGENT_SUBSCRIBE_TIMEOUT_MS;
+    xCommandParams.cmdCompleteCallback = prvSubscriptionBatchCallback;
+    xCommandParams.pCmdCompleteCallbackContext = (MQTTAgentCommandContext_t *) pxBatch;
+
+    if (pxBatch->xSubscribe) {
+        xResult = MQTTAgent_Subscribe(&xGlobalMqttAgentContext, &(pxBatch->xSubscribeArgs), &xCommandParams);
+    } else {
+        xResult = MQTTAgent_Unsubscribe(&xGlobalMqttAgentContext, &(pxBatch->xSubscribeArgs), &xCommandParams);
+    }
+
+    if (xResult != MQTTSuccess) {
+        ESP_LOGE(TAG, "Failed to enqueue the MQTT %s command. xResult=%s.",
+                 pxBatch->xSubscribe ? "subscribe" : "unsubscribe", MQTT_Status_strerror(xResult));
+        /* The callback will never run, so its reference is dropped here. */
+        pxBatch->ulReferences = 1U;
+    } else if (xSemaphoreTake(pxBatch->xDone, pdMS_TO_TICKS(MQTT_AGENT_SUBSCRIBE_TIMEOUT_MS)) == pdTRUE) {
+        xReturnStatus = pxBatch->xReturnStatus;
+    } else if (__atomic_exchange_n(&(pxBatch->xSettled), true, __ATOMIC_ACQ_REL)) {
+        /* The callback got to the batch first, and is about to be done with
+         * the requests. */
+        xSemaphoreTake(pxBatch->xDone, portMAX_DELAY);
+        xReturnStatus = pxBatch->xReturnStatus;
+    } else {
+        ESP_LOGE(TAG, "Timed out waiting for the broker to acknowledge the %s of %u topic filters.",
+                 pxBatch->xSubscribe ? "subscribe" : "unsubscribe",
+                 (unsigned int) pxBatch->xSubscribeArgs.numSubscriptions);
+    }
+
+    if (__atomic_sub_fetch(&(pxBatch->ulReferences), 1U, __ATOMIC_ACQ_REL) == 0U) {
+        vPortFree(pxBatch);
+    }
+
+    return xReturnStatus;
+}
+
+static void prvAbandonSubscriptionBatch(SubscriptionBatch_t *pxBatch) {
+    /* The queue holds a reference until the batch is undone. */
+    __atomic_fetch_add(&(pxBatch->ulReferences), 1U, __ATOMIC_ACQ_REL);
+    pxBatch->pxNextAbandoned = __atomic_load_n(&pxAbandonedBatches, __ATOMIC_RELAXED);
+
+    while (__atomic_compare_exchange_n(&pxAbandonedBatches, &(pxBatch->pxNextAbandoned), pxBatch, true,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) == false) {
+    }
+
+    /* Otherwise the task holding the mutex undoes it once it gives it. */
+    if (xSemaphoreTake(xSubscriptionChangeMutex, 0U) == pdTRUE) {
+        prvGiveSubscriptionChangeMutex();
+    }
+}
+
+static void prvGiveSubscriptionChangeMutex(void) {
+    MQTTAgentCommandInfo_t xCommandParams = {0};
+    SubscriptionBatch_t *pxBatch;
+    SubscriptionBatch_t *pxNext;
+    MQTTSubscribeInfo_t *pxSubscribeInfo;
+    size_t xIndex;
+    uint32_t ulNumFilters;
+
+    /* The agent task cannot wait for room in its own queue. */
+    xCommandParams.blockTimeMs = (xTaskGetCurrentTaskHandle() == xDeferredAcks.xAgentTask) ?
+                                 0U : MQTT_AGENT_SUBSCRIBE_TIMEOUT_MS;
+    xCommandParams.cmdCompleteCallback = prvSubscriptionBatchCallback;
+
+    do {
+        pxBatch = __atomic_exchange_n(&pxAbandonedBatches, NULL, __ATOMIC_SEQ_CST);
+
+        for (; pxBatch != NULL; pxBatch = pxNext) {
+            pxNext = pxBatch->pxNextAbandoned;
+            pxSubscribeInfo = pxBatch->xSubscribeArgs.pSubscribeInfo;
+            ulNumFilters = 0U;
+
+            for (xIndex = 0; xIndex < pxBatch->xSubscribeArgs.numSubscriptions; xIndex++) {
+                if (getSubscriberCount(xGlobalSubscriptionList, pxSubscribeInfo[xIndex].pTopicFilter,
+                                       pxSubscribeInfo[xIndex].topicFilterLength, NULL) == 0U) {
+                    pxSubscribeInfo[ulNumFilters] = pxSubscribeInfo[xIndex];
+                    ulNumFilters++;
+                }
+            }
+
+            /* The callback of the unsubscribe then only releases the batch. */
+            pxBatch->xSubscribe = false;
+            pxBatch->xSubscribeArgs.numSubscriptions = ulNumFilters;
+            xCommandParams.pCmdCompleteCallbackContext = (MQTTAgentCommandContext_t *) pxBatch;
+
+            if (ulNumFilters == 0U) {
+                /* Other tasks subscribed to all of them meanwhile. */
+            } else if (MQTTAgent_Unsubscribe(&xGlobalMqttAgentContext, &(pxBatch->xSubscribeArgs),
+                                             &xCommandParams) == MQTTSuccess) {
+                ESP_LOGW(TAG, "Unsubscribing from %u topic filters acknowledged after the subscribe timed out.",
+                         (unsigned int) ulNumFilters);
+                pxBatch = NULL;
+            } else {
+                ESP_LOGE(TAG, "Failed to enqueue the unsubscribe from %u topic filters.",
+                         (unsigned int) ulNumFilters);
+            }
+
+            if ((pxBatch != NULL) && (__atomic_sub_fetch(&(pxBatch->ulReferences), 1U, __ATOMIC_ACQ_REL) == 0U)) {
+                vPortFree(pxBatch);
+            }
+        }
+
+        xSemaphoreGive(xSubscriptionChangeMutex);
+
+        /* A batch queued while the mutex was held was left to this task. */
+    } while ((__atomic_load_n(&pxAbandonedBatches, __ATOMIC_SEQ_CST) != NULL) &&
+             (xSemaphoreTake(xSubscriptionChangeMutex, 0U) == pdTRUE));
+}
+
+static void prvAddResubscribeFilter(MQTTSubscribeInfo_t *pxSubInfo,
+                                    uint16_t *pusNumSubscriptions,
+                                    const SubscriptionElement_t *pxSubscription) {
+    uint16_t usIndex;
+
+    for (usIndex = 0U; usIndex < *pusNumSubscriptions; usIndex++) {
+        if ((pxSubInfo[usIndex].topicFilterLength == pxSubscription->usFilterStringLength) &&
+            (strncmp(pxSubInfo[usIndex].pTopicFilter, pxSubscription->pcSubscriptionFilterString,
+                     pxSubscription->usFilterStringLength) == 0)) {
+            break;
+        }
+    }
+
+    if (usIndex < *pusNumSubscriptions) {
+        /* A topic filter shared by several subscribers gets the highest QoS requested. */
+        if (pxSubscription->ucRequestedQoS > pxSubInfo[usIndex].qos) {
+            pxSubInfo[usIndex].qos = (MQTTQoS_t) pxSubscription->ucRequestedQoS;
+        }
+    } else {
+        pxSubInfo[usIndex].pTopicFilter = pxSubscription->pcSubscriptionFilterString;
+        pxSubInfo[usIndex].topicFilterLength = pxSubscription->usFilterStringLength;
+        pxSubInfo[usIndex].qos = (MQTTQoS_t) pxSubscription->ucRequestedQoS;
+
+        ESP_LOGI(TAG, "Resubscribe to the topic %.*s will be attempted.",
+                 pxSubInfo[usIndex].topicFilterLength,
+                 pxSubInfo[usIndex].pTopicFilter);
+
+        (*pusNumSubscriptions)++;
+    }
 }
 
 static MQTTStatus_t prvHandleResubscribe() {
@@ -502,36 +1298,60 @@ static MQTTStatus_t prvHandleResubscribe() {
      */
 
     MQTTStatus_t xResult = MQTTBadParameter;
-    uint32_t ulIndex = 0U;
+    uint32_t ulSlot = 0U, ulMaxSubscriptions;
     uint16_t usNumSubscriptions = 0U;
+    SubscriptionElement_t xSubscription;
+    const StaticSubscription_t *pxStaticSubscriptions;
+    size_t xNumStaticSubscriptions, xStaticIndex;
 
     /* These variables need to stay in scope until command completes. */
     static MQTTAgentSubscribeArgs_t xSubArgs = {0};
-    static MQTTSubscribeInfo_t xSubInfo[SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS] = {{0}};
     static MQTTAgentCommandInfo_t xCommandParams = {0};
+    pxStaticSubscriptions = getStaticSubscriptions(xGlobalSubscriptionList, &xNumStaticSubscriptions);
+
+#if SUBSCRIPTION_MANAGER_USE_POOL
+    SubscriptionStats_t xStats;
+    MQTTSubscribeInfo_t *pxSubInfo;
+
+    /* The store may have grown beyond the static list, so the subscribe info is
+     * sized for the subscriptions present and freed once the command completes. */
+    getSubscriptionStats(xGlobalSubscriptionList, &xStats);
+    ulMaxSubscriptions = xStats.ulActive + xNumStaticSubscriptions;
+    ulMaxSubscriptions = (ulMaxSubscriptions > 0U) ? ulMaxSubscriptions : 1U;
+    pxSubInfo = pvPortMalloc(sizeof(MQTTSubscribeInfo_t) * ulMaxSubscriptions);
+
+    if (pxSubInfo == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate the subscribe info for %u subscriptions.",
+                 (unsigned int) xStats.ulActive);
+        return MQTTNoMemory;
+    }
+#else
+    static MQTTSubscribeInfo_t xSubInfo[SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS +
+                                        SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS] = {{0}};
+    MQTTSubscribeInfo_t *pxSubInfo = xSubInfo;
+
+    ulMaxSubscriptions = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS + SUBSCRIPTION_MANAGER_MAX_STATIC_SUBSCRIPTIONS;
+#endif
+
+    /* The static subscriptions come first, they always fit. */
+    for (xStaticIndex = 0U; xStaticIndex < xNumStaticSubscriptions; xStaticIndex++) {
+        xSubscription.pcSubscriptionFilterString = pxStaticSubscriptions[xStaticIndex].pcTopicFilterString;
+        xSubscription.usFilterStringLength = pxStaticSubscriptions[xStaticIndex].usTopicFilterLength;
+        xSubscription.ucRequestedQoS = (uint8_t) pxStaticSubscriptions[xStaticIndex].xQoS;
+        prvAddResubscribeFilter(pxSubInfo, &usNumSubscriptions, &xSubscription);
+    }
 
     /* Loop through each subscription in the subscription list and add a subscribe
-     * command to the command queue. */
-    for (ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; ulIndex++) {
-        /* Check if there is a subscription in the subscription list. This demo
-         * doesn't check for duplicate subscriptions. */
-        if (xGlobalSubscriptionList[ulIndex].usFilterStringLength != 0) {
-            xSubInfo[usNumSubscriptions].pTopicFilter = xGlobalSubscriptionList[ulIndex].pcSubscriptionFilterString;
-            xSubInfo[usNumSubscriptions].topicFilterLength = xGlobalSubscriptionList[ulIndex].usFilterStringLength;
-
-            /* QoS1 is used for all the subscriptions in this demo. */
-            xSubInfo[usNumSubscriptions].qos = MQTTQoS1;
-
-            ESP_LOGI(TAG, "Resubscribe to the topic %.*s will be attempted.",
-                     xSubInfo[usNumSubscriptions].topicFilterLength,
-                     xSubInfo[usNumSubscriptions].pTopicFilter);
-
-            usNumSubscriptions++;
-        }
+     * command to the command queue. Other tasks may add subscriptions meanwhile,
+     * so stop once the subscribe info is full. A topic filter shared by several
+     * subscribers is subscribed to once. */
+    while ((usNumSubscriptions < ulMaxSubscriptions) &&
+           getSubscription(xGlobalSubscriptionList, &ulSlot, &xSubscription)) {
+        prvAddResubscribeFilter(pxSubInfo, &usNumSubscriptions, &xSubscription);
     }
 
     if (usNumSubscriptions > 0U) {
-        xSubArgs.pSubscribeInfo = xSubInfo;
+        xSubArgs.pSubscribeInfo = pxSubInfo;
         xSubArgs.numSubscriptions = usNumSubscriptions;
 
         /* The block time can be 0 as the command loop is not running at this point. */
@@ -551,6 +1371,13 @@ static MQTTStatus_t prvHandleResubscribe() {
         ESP_LOGE(TAG, "Failed to enqueue the MQTT subscribe command. xResult=%s.", MQTT_Status_strerror(xResult));
     }
 
+#if SUBSCRIPTION_MANAGER_USE_POOL
+    /* Without a queued command, prvSubscriptionCommandCallback() will not free it. */
+    if ((usNumSubscriptions == 0U) || (xResult != MQTTSuccess)) {
+        vPortFree(pxSubInfo);
+    }
+#endif
+
     return xResult;
 }
 
@@ -621,11 +1448,12 @@ static MQTTStatus_t prvMQTTConnect(bool xCleanSession) {
     /* Resume a session if desired. */
     if ((xResult == MQTTSuccess) && (xCleanSession == false)) {
         xResult = MQTTAgent_ResumeSession(&xGlobalMqttAgentContext, xSessionPresent);
+    }
 
-        /* Resubscribe to all the subscribed topics. */
-        if ((xResult == MQTTSuccess) && (xSessionPresent == false)) {
-            xResult = prvHandleResubscribe();
-        }
+    /* Resubscribe to all the subscribed topics. On the first connection, this
+     * subscribes to the static subscriptions. */
+    if ((xResult == MQTTSuccess) && (xSessionPresent == false)) {
+        xResult = prvHandleResubscribe();
     }
 
     if (xResult == MQTTSuccess) {
@@ -675,6 +1503,14 @@ static void prvMQTTAgentTask(void *pvParameters) {
          * clean up and reconnect however the application writer prefers. */
         xMQTTStatus = MQTTAgent_CommandLoop(&xGlobalMqttAgentContext);
 
+        /* Deliver what was collected in the last receive cycle, and end the
+         * stream cut short if any. The PUBACKs still held belong to the
+         * connection lost. */
+        flushDispatchBatches();
+        resetPublishStreams();
+        xDeferredAcks.usHeldPacketId = 0U;
+        xDeferredAcks.usConnection++;
+
         /* Success is returned for disconnect or termination. The socket should
          * be disconnected. */
         if (xMQTTStatus == MQTTSuccess) {
@@ -702,6 +1538,8 @@ static void prvMQTTAgentTask(void *pvParameters) {
 
 void connectToMQTTAndStartAgent(void *pvParameters) {
     configASSERT(xMQTTAgentEventGroupHandle);
+    xDeferredAcks.xAgentTask = xTaskGetCurrentTaskHandle();
+
     /* Create the TCP connection to the broker, then the MQTT connection to the
      * same. */
     prvConnectToMQTTBroker();
@@ -719,9 +1557,151 @@ void connectToMQTTAndStartAgent(void *pvParameters) {
 void initMQTTAgent() {
     ESP_LOGD(TAG, "Initializing MQTT agent.");
     xMQTTAgentEventGroupHandle =  xEventGroupCreateStatic(&prvMQTTAgentEventGroup);
+    xSubscriptionChangeMutex = xSemaphoreCreateMutexStatic(&xSubscriptionChangeMutexBuffer);
 }
 
 void waitForMQTTAgentConnection() {
     configASSERT(xMQTTAgentEventGroupHandle);
     xEventGroupWaitBits(xMQTTAgentEventGroupHandle, MQTT_AGENT_CONNECTED_FLAG, false, true, portMAX_DELAY);
-}
\ No newline at end of file
+}
+
+bool subscribeToTopics(const SubscriptionRequest_t *pxSubscriptions,
+                       size_t xNumSubscriptions) {
+    SubscriptionBatch_t *pxBatch;
+    size_t xIndex;
+    MQTTQoS_t xRequestedQoS;
+    bool xReturnStatus = false;
+
+    configASSERT(xSubscriptionChangeMutex);
+    xSemaphoreTake(xSubscriptionChangeMutex, portMAX_DELAY);
+
+    /* An invalid topic filter would get the connection closed by the broker. */
+    if (validateSubscriptions(xGlobalSubscriptionList, pxSubscriptions, xNumSubscriptions)) {
+        pxBatch = prvCreateSubscriptionBatch(pxSubscriptions, xNumSubscriptions, true);
+    } else {
+        pxBatch = NULL;
+    }
+
+    if (pxBatch != NULL) {
+        /* The broker only needs to hear about the topic filters no other task
+         * is subscribed to, or subscribed to at a lower QoS. */
+        for (xIndex = 0; xIndex < xNumSubscriptions; xIndex++) {
+            if ((getSubscriberCount(xGlobalSubscriptionList,
+                                    pxSubscriptions[xIndex].pcTopicFilterString,
+                                    pxSubscriptions[xIndex].usTopicFilterLength,
+                                    &xRequestedQoS) == 0U) ||
+                (pxSubscriptions[xIndex].xQoS > xRequestedQoS)) {
+                prvAddFilterToBatch(pxBatch, &(pxSubscriptions[xIndex]));
+            }
+        }
+
+        if (pxBatch->xSubscribeArgs.numSubscriptions > 0U) {
+            xReturnStatus = prvSendSubscriptionBatch(pxBatch);
+        } else {
+            xReturnStatus = addSubscriptions(xGlobalSubscriptionList, pxSubscriptions, xNumSubscriptions);
+            vPortFree(pxBatch);
+        }
+    }
+
+    prvGiveSubscriptionChangeMutex();
+
+    return xReturnStatus;
+}
+
+bool registerStaticSubscriptions(const StaticSubscription_t *pxTable,
+                                 size_t xNumEntries) {
+    return setStaticSubscriptions(xGlobalSubscriptionList, pxTable, xNumEntries);
+}
+
+void setUnsolicitedPublishHandler(IncomingPubCallback_t pxHandler,
+                                  void *pvHandlerContext) {
+    xUnsolicitedPublishes.pxHandler = pxHandler;
+    xUnsolicitedPublishes.pvHandlerContext = pvHandlerContext;
+}
+
+void getUnsolicitedPublishStats(UnsolicitedPublishStats_t *pxStats) {
+    UnsolicitedPublishStats_t *pxCounters = &(xUnsolicitedPublishes.xStats);
+    size_t xIndex;
+
+    if (pxStats == NULL) {
+        ESP_LOGE(TAG, "Invalid parameter. pxStats=%p.", pxStats);
+    } else {
+        pxStats->ulTotal = __atomic_load_n(&(pxCounters->ulTotal), __ATOMIC_RELAXED);
+        pxStats->ulOtherTopics = __atomic_load_n(&(pxCounters->ulOtherTopics), __ATOMIC_RELAXED);
+
+        for (xIndex = 0; xIndex < MQTT_AGENT_UNSOLICITED_TOPICS; xIndex++) {
+            pxStats->xTopics[xIndex].ulCount = __atomic_load_n(&(pxCounters->xTopics[xIndex].ulCount),
+                                                               __ATOMIC_RELAXED);
+            pxStats->xTopics[xIndex].ulTopicHash = __atomic_load_n(&(pxCounters->xTopics[xIndex].ulTopicHash),
+                                                                   __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void getDeferredAckStats(DeferredAckStats_t *pxStats) {
+    DeferredAckStats_t *pxCounters = &(xDeferredAcks.xStats);
+
+    if (pxStats == NULL) {
+        ESP_LOGE(TAG, "Invalid parameter. pxStats=%p.", pxStats);
+    } else {
+        pxStats->ulDeferred = __atomic_load_n(&(pxCounters->ulDeferred), __ATOMIC_RELAXED);
+        pxStats->ulSent = __atomic_load_n(&(pxCounters->ulSent), __ATOMIC_RELAXED);
+        pxStats->ulStale = __atomic_load_n(&(pxCounters->ulStale), __ATOMIC_RELAXED);
+        pxStats->ulOverCap = __atomic_load_n(&(pxCounters->ulOverCap), __ATOMIC_RELAXED);
+        pxStats->ulUnacked = __atomic_load_n(&(xDeferredAcks.ulUnacked), __ATOMIC_RELAXED);
+        pxStats->ulWakeFailed = __atomic_load_n(&(pxCounters->ulWakeFailed), __ATOMIC_RELAXED);
+    }
+}
+
+uint32_t getUnsolicitedTopicHash(const char *pcTopicName,
+                                 uint16_t usTopicNameLength) {
+    uint32_t ulHash = 2166136261UL;
+    uint16_t usIndex;
+
+    for (usIndex = 0; usIndex < usTopicNameLength; usIndex++) {
+        ulHash ^= (uint8_t) pcTopicName[usIndex];
+        ulHash *= 16777619UL;
+    }
+
+    return ulHash;
+}
+
+bool unsubscribeFromTopics(const SubscriptionRequest_t *pxSubscriptions,
+                           size_t xNumSubscriptions) {
+    SubscriptionBatch_t *pxBatch;
+    size_t xIndex;
+    bool xReturnStatus = false;
+
+    configASSERT(xSubscriptionChangeMutex);
+    xSemaphoreTake(xSubscriptionChangeMutex, portMAX_DELAY);
+
+    pxBatch = prvCreateSubscriptionBatch(pxSubscriptions, xNumSubscriptions, false);
+
+    if (pxBatch != NULL) {
+        /* The callbacks stop being called right away; the broker is only told
+         * about the topic filters that have no subscriber left. */
+        xReturnStatus = removeSubscriptions(xGlobalSubscriptionList, pxSubscriptions, xNumSubscriptions,
+                                            pxBatch->pxLastSubscriber);
+
+        for (xIndex = 0; xReturnStatus && (xIndex < xNumSubscriptions); xIndex++) {
+            /* A topic filter of the static subscriptions stays subscribed. */
+            if (pxBatch->pxLastSubscriber[xIndex] &&
+                (getSubscriberCount(xGlobalSubscriptionList,
+                                    pxSubscriptions[xIndex].pcTopicFilterString,
+                                    pxSubscriptions[xIndex].usTopicFilterLength,
+                                    NULL) == 0U)) {
+                prvAddFilterToBatch(pxBatch, &(pxSubscriptions[xIndex]));
+            }
+        }
+
+        if (pxBatch->xSubscribeArgs.numSubscriptions > 0U) {
+            xReturnStatus = prvSendSubscriptionBatch(pxBatch);
+        } else {
+            vPortFree(pxBatch);
+        }
+    }
+
+    prvGiveSubscriptionChangeMutex();
+
+    return xReturnStatus;
+}